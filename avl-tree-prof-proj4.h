@@ -6,8 +6,32 @@
 #include <cassert>
 #include <algorithm>
 #include <cstdlib>
+#include <cstring>
 #include <sstream>
 #include <vector>
+#include <type_traits>
+#include <stdexcept>
+#include <iterator>
+#include <thread>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <functional>
+#include <new>
+#include <fstream>
+#include <cstdint>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
@@ -15,13 +39,171 @@ using namespace std;
  * friend.  This avoids the chicken-and-egg problem of declaring two classes
  * that must refer to one another.
  */
-template <class Base>
+template <class Base, class Compare = less<Base> >
 class AVLTree;
 
+template <class Base>
+class AVLNodePool;
+
+template <class Base, class Compare = less<Base> >
+class EncryptionTree;
+
+template <class Base>
+class SnapshotEncryptionTree;
+
+template <class Base, class Compare = less<Base> >
+class FrozenEncryptionTree;
+
+/* IsHashable<T>::value is true when T can be hashed with std::hash and
+ * compared with ==, so that it can be the key of an unordered_map.
+ */
+template <class T, class = void>
+struct IsHashable : false_type {};
+
+template <class T>
+struct IsHashable<T, decltype((void)hash<T>()(declval<const T &>()),
+                              (void)(declval<const T &>() == declval<const T &>()))>
+    : true_type {};
+
+/* HasBytes<T>::value is true when T exposes its contents as bytes through
+ * data() and size(), as string and string_view do.
+ */
+template <class T, class = void>
+struct HasBytes : false_type {};
+
+template <class T>
+struct HasBytes<T, decltype((void)static_cast<const char *>(declval<const T &>().data()),
+                            (void)declval<const T &>().size())>
+    : true_type {};
+
+/* A KeyPrefix<T> is what an AVLNode keeps about its key, besides the key
+ * itself, to make comparisons during a descent cheaper. Its compare() method
+ * is a three-way comparison: negative, zero or positive as a is less than,
+ * equal to or greater than b, where this is a's prefix and pb is b's. A
+ * search builds the prefix of the key it looks for once and then needs one
+ * compare() per level instead of two operator< calls.
+ *
+ * For most types there is nothing to keep, and compare() is the two operator<
+ * tests. The class is empty and AVLNode derives from it, so it takes no space.
+ * The key searched for need not be a T, only comparable with one.
+ */
+template <class T>
+class KeyPrefix {
+public:
+    KeyPrefix() {}
+    template <class Key>
+    explicit KeyPrefix(const Key &) {}
+
+    template <class A, class B>
+    int compare(const A &a, const B &b, const KeyPrefix &) const {
+        return a < b ? -1 : (b < a ? 1 : 0);
+    }
+};
+
+/* For strings, the prefix is the first 8 bytes of the key, zero-padded and
+ * read big-endian into one integer, so integer order is the order of the
+ * bytes as unsigned chars, which is the order string's operator< uses. Two
+ * keys whose prefixes differ are settled by one integer comparison, without
+ * touching either string's characters. On a tie, a key of at most 8 bytes is
+ * a prefix of the other one, so the lengths (stored in the string objects
+ * themselves) decide; only ties between longer keys fall back to memcmp() on
+ * the bytes after the first 8. This makes an AVLNode<string> 8 bytes larger.
+ * The key searched for may be any type with data() and size(), such as a
+ * string_view.
+ */
+template <>
+class KeyPrefix<string> {
+public:
+    KeyPrefix() : bits(0) {}
+    template <class Key>
+    explicit KeyPrefix(const Key &s) : bits(0) {
+        size_t n = s.size() < 8 ? s.size() : 8;
+        for (size_t i = 0; i < 8; i++){
+            bits = bits << 8 | (i < n ? static_cast<unsigned char>(s.data()[i]) : 0);
+        }
+    }
+
+    template <class A, class B>
+    int compare(const A &a, const B &b, const KeyPrefix &pb) const {
+        if (bits != pb.bits){
+            return bits < pb.bits ? -1 : 1;
+        }
+        size_t la = a.size(), lb = b.size();
+        if (la > 8 && lb > 8){
+            int c = memcmp(a.data() + 8, b.data() + 8, (la < lb ? la : lb) - 8);
+            if (c != 0){
+                return c;
+            }
+        }
+        return la < lb ? -1 : (lb < la ? 1 : 0);
+    }
+
+private:
+    unsigned long long bits;
+};
+
+/* KeyCodec<T> turns keys into bytes and back, for anything that stores keys
+ * outside the tree. Keys with data() and size(), such as strings, are stored
+ * as a 32-bit length and then their bytes, and must be constructible from a
+ * pointer and a length. Any other key must be trivially copyable and is
+ * stored as its raw memory. Lengths are in the byte order of the machine.
+ *
+ * WIDTH is the fixed size of every stored key, or 0 if keys are stored with
+ * their length. size() is the number of bytes append() adds for a key.
+ * length() is the number of bytes the stored key at "at" takes, or 0 if it
+ * runs past "end"; make() rebuilds a key that length() has accepted.
+ */
+template <class T, bool = HasBytes<T>::value>
+struct KeyCodec {
+    static_assert(is_trivially_copyable<T>::value,
+                  "stored keys need data() and size(), or must be trivially copyable");
+
+    static constexpr uint64_t WIDTH = sizeof(T);
+
+    static size_t size(const T &) { return sizeof(T); }
+    static void append(string &out, const T &item) {
+        out.append(reinterpret_cast<const char *>(&item), sizeof(T));
+    }
+    static size_t length(const char *at, const char *end) {
+        return static_cast<size_t>(end - at) < sizeof(T) ? 0 : sizeof(T);
+    }
+    static T make(const char *at) {
+        T item;
+        memcpy(static_cast<void *>(&item), at, sizeof(T));
+        return item;
+    }
+};
+
+template <class T>
+struct KeyCodec<T, true> {
+    static constexpr uint64_t WIDTH = 0;
+
+    static size_t size(const T &item) { return sizeof(uint32_t) + item.size(); }
+    static void append(string &out, const T &item) {
+        uint32_t n = item.size();
+        out.append(reinterpret_cast<const char *>(&n), sizeof(n));
+        out.append(item.data(), n);
+    }
+    static size_t length(const char *at, const char *end) {
+        uint32_t n;
+        if (static_cast<size_t>(end - at) < sizeof(n)){
+            return 0;
+        }
+        memcpy(&n, at, sizeof(n));
+        return static_cast<size_t>(end - at) - sizeof(n) < n ? 0 : sizeof(n) + n;
+    }
+    static T make(const char *at) {
+        uint32_t n;
+        memcpy(&n, at, sizeof(n));
+        return T(at + sizeof(n), n);
+    }
+};
+
 /* An AVLNode represents a node in an AVL-balanced binary search tree. Each
  * AVLNode object stores a single item (called "data"). Each object also has
  * left and right pointers, which point to the left and right subtrees, and it
- * knows its own height (the path length to its deepest descendant).
+ * knows its balance factor: the height of its right subtree minus the height
+ * of its left subtree, which in an AVL tree is always -1, 0 or 1.
  *
  * The AVLTree is a friend of the AVLNode class, so that the AVLTree may make
  * changes to the internals of an AVLNode.
@@ -31,69 +213,120 @@ class AVLTree;
  * getLeft(), getRight(), getData(), printPreorder(), verifySearchOrder(),
  * minNode(), maxNode(), and the copy constructor and assignment operator.
  *
+ * visitPreorder() walks the subtree in preorder without recursion, keeping the
+ * nodes still to visit on a fixed array on the stack (an AVL tree is never
+ * taller than MAX_HEIGHT, see AVLTree), and calls fn(item, depth) for every
+ * node and for every missing child, with item NULL for a missing child and
+ * depth 0 for the node it was called on. printPreorder() is built on it: each
+ * line is indent, two spaces per level taken from one shared static string,
+ * and the data or NULL. The lines are gathered in blocks of PRINT_BLOCK bytes
+ * and written a block at a time, so printing allocates per block, not per
+ * node. AVLTree::visitPreorder() visits the whole tree.
+ *
  * The function verifyBalance() can be used to do verifications that the AVL
  * balance property holds at each node. It also can and should be used for
- * testing purposes. What is its running time?
+ * testing purposes. What is its running time? verifyBalanceFactors() checks
+ * the stored balance factors themselves against heights counted from the
+ * leaves, and returns the height of the subtree.
  *
  * The singleRotateLeft() and singleRotateRight() methods do a single rotation
  * on the node they are called on, and return a pointer to the node that takes
- * its place (so that the node's parent's pointer can be changed).  Note that
- * these methods should update the heights of some nodes as necessary.
+ * its place (so that the node's parent's pointer can be changed). They take
+ * the node's balance factor as it would be after the change that unbalanced
+ * it (so it may be 2 or -2, which the node itself cannot hold). They set the
+ * balance factors of both nodes from that value and the child's, with no
+ * height computed.
  *
  * The doubleRotateLeftRight() and doubleRotateRightLeft() methods do a double
- * rotation on the node they are called on. This is really simple if you have
- * implemented the single rotation methods; my double rotation methods are two
- * lines each. These methods return a pointer to the node which took the place
- * of the node the method was called on (so that the node's parent's pointer can
- * be changed).
+ * rotation on a node whose balance factor would be -2 or 2 and whose taller
+ * child leans the other way. The middle grandchild's balance factor decides
+ * the new factors of all three nodes. These methods return a pointer to the
+ * node which took the place of the node the method was called on (so that the
+ * node's parent's pointer can be changed).
  *
  * The getHeight() method is a static method which takes a pointer to a node,
- * and returns the height of that node (or -1 if the pointer is NULL). This
- * makes it easy to find the height of any node with a pointer, without having
- * to check for NULL.
+ * and returns the height of that node (or -1 if the pointer is NULL). Heights
+ * are not stored, so it walks down the taller side of each node, which takes
+ * O(log n) time; the insert and remove paths never need it.
  *
- * The updateHeight() method calculates and updates the value of the height on
- * the node it's called on. It assumes that the height values for the two
- * children of this node are correct, and uses them.
+ * Each node also counts the nodes in its subtree (including itself) in "size".
+ * updateSize() recomputes it from the children, and the rotations call it.
+ * The static getSize() returns 0 for NULL. The size and the balance factor
+ * share one 32-bit word, so a tree holds at most MAX_SIZE = 2^30 - 1 keys.
+ * Every method that adds keys throws length_error, leaving the tree
+ * unchanged, rather than grow a tree past that, and readShape() rejects a
+ * bigger snapshot. The data comes last, so for 4-byte keys a node is 32
+ * bytes.
+ *
+ * Each node also points back to its parent (NULL at the root). The rotation
+ * methods keep these links correct, setting the parent of the node they return
+ * to the parent of the node they were called on. With parent links, successor()
+ * and predecessor() find the neighbouring node in key order without a search
+ * from the root, in amortized O(1) time over a full traversal.
+ *
+ * A node also holds the KeyPrefix of its data, set once by the constructor
+ * (the data of a node never changes). compareTo() compares a key being
+ * searched for, given with its own prefix, against the node's data.
  */
 template <class Base>
-class AVLNode {
+class AVLNode : private KeyPrefix<Base> {
 public:
-    friend class AVLTree<Base>;
+    template <class, class> friend class AVLTree;
+    friend class AVLNodePool<Base>;
+    friend class SnapshotEncryptionTree<Base>;
     AVLNode(const Base &d = Base(), AVLNode *l = NULL, AVLNode *r = NULL,
-            int h = 0) : data(d), left(l), right(r), height(h) {}
+            int b = 0) : KeyPrefix<Base>(d), left(l), right(r), parent(NULL),
+                         size(1 + getSize(l) + getSize(r)), balance(b), data(d) {}
     ~AVLNode();
 
     const AVLNode *getLeft() const { return left; }
     const AVLNode *getRight() const { return right; }
+    const AVLNode *getParent() const { return parent; }
+    int getSize() const { return size; }
     const Base &getData() const { return data; }
+    template <class Key>
+    int compareTo(const Key &item, const KeyPrefix<Base> &key) const {
+        return key.compare(item, data, *this);
+    }
 
-    void printPreorder(ostream &os = cout, string indent = "") const;
+    static constexpr int MAX_HEIGHT = 96;
+    static constexpr size_t MAX_SIZE = (size_t(1) << 30) - 1;
+    static constexpr size_t PRINT_BLOCK = 65536;
+
+    void printPreorder(ostream &os = cout, const string &indent = "") const;
+    template <class Function>
+    void visitPreorder(Function fn) const;
 
     pair<AVLNode<Base> const *, AVLNode<Base> const *> verifySearchOrder() const;
     void verifyBalance() const;
+    int verifyBalanceFactors() const;
 
     const AVLNode *minNode() const;
     const AVLNode *maxNode() const;
+    const AVLNode *successor() const;
+    const AVLNode *predecessor() const;
 
 protected:
     AVLNode(const AVLNode &t) { assert(false); }
     const AVLNode &operator=(const AVLNode &n) { assert(false); return *this; }
 
+    AVLNode *left, *right, *parent;
+    unsigned size : 30;
+    signed balance : 2;
     Base data;
-    AVLNode *left, *right;
-    int height;
-
-    AVLNode *singleRotateLeft();
-    AVLNode *singleRotateRight();
-    AVLNode *doubleRotateLeftRight();
-    AVLNode *doubleRotateRightLeft();
-
-    static int getHeight(AVLNode const *n) { return n ? n->height : -1; }
-    void updateHeight() {
-        int lh = getHeight(left), rh = getHeight(right);
-        height = (lh > rh ? lh : rh) + 1;
+
+    AVLNode *singleRotateLeft(int b);
+    AVLNode *singleRotateRight(int b);
+    AVLNode *doubleRotateLeftRight(int b);
+    AVLNode *doubleRotateRightLeft(int b);
+
+    static int getHeight(AVLNode const *n) {
+        int h = -1;
+        for (; n; n = n->balance > 0 ? n->right : n->left) h++;
+        return h;
     }
+    static int getSize(AVLNode const *n) { return n ? n->size : 0; }
+    void updateSize() { size = getSize(left) + getSize(right) + 1; }
 };
 
 /* professor's implementation of verifySearchOrder(); don't change it */
@@ -123,9 +356,100 @@ void AVLNode<Base>::verifyBalance() const {
 }
 
 
+/* An AVLNodePool hands out the AVLNode objects used by one AVLTree. Nodes are
+ * carved out of large slabs instead of being allocated one at a time with new,
+ * so nodes inserted close together in time sit close together in memory, and a
+ * root-to-leaf walk touches far fewer cache lines and pages.
+ *
+ * The allocate() method constructs a node holding a copy of the given item in
+ * the next free slot. Slots of removed nodes are kept on a free list by
+ * deallocate() and reused before any new slab memory is touched, so workloads
+ * that insert and remove heavily do not fragment the heap.
+ *
+ * The release() method gives every slab back at once. It does not run the
+ * destructors of nodes still in use; the owning tree does that first when the
+ * stored type needs it, and skips it entirely when it doesn't, which makes
+ * tearing down a tree of plain keys O(1) in the number of nodes.
+ *
+ * Slabs are reference counted, so that more than one pool can hold the same
+ * slab. This happens when a tree is split in two: the nodes of both halves stay
+ * where they are, and share() gives the second tree's pool a hold on every
+ * slab of the first. A slab's memory goes back to the system once no pool
+ * holds it any more; release() only drops this pool's holds.
+ *
+ * The reserve() method makes sure the next n allocations (that don't come from
+ * the free list) are served from one contiguous slab. The allocateRun() method
+ * goes one step further and hands out raw storage for n consecutive nodes, which
+ * the caller constructs in place (possibly from several threads at once).
+ *
+ * The splice() method takes over all the slabs and free slots of another pool,
+ * leaving it empty. Work split across threads gives each thread a pool of its
+ * own and splices them back together when the threads are done. Both methods
+ * keep at most one hold per slab.
+ *
+ * Slabs grow geometrically (from MIN_SLAB_NODES up to MAX_SLAB_NODES). If huge
+ * pages are requested, slabs are rounded up to HUGE_PAGE_BYTES and mapped with
+ * huge pages where the platform supports it, falling back to transparent huge
+ * pages and then to ordinary memory.
+ */
+template <class Base>
+class AVLNodePool {
+public:
+    explicit AVLNodePool(bool hugePages = false)
+        : freeList(NULL), cursor(NULL), limit(NULL),
+          nextSlabNodes(MIN_SLAB_NODES), useHugePages(hugePages) {}
+    ~AVLNodePool() { release(); }
+
+    AVLNode<Base> *allocate(const Base &item);
+    void deallocate(AVLNode<Base> *n);
+    void release();
+    void reserve(size_t n);
+    AVLNode<Base> *allocateRun(size_t n);
+    void splice(AVLNodePool &other);
+    void share(const AVLNodePool &other);
+
+    bool usesHugePages() const { return useHugePages; }
+
+protected:
+    AVLNodePool(const AVLNodePool &p) { assert(false); }
+    const AVLNodePool &operator=(const AVLNodePool &p) { assert(false); return *this; }
+
+    union Slot {
+        Slot *next;
+        alignas(AVLNode<Base>) unsigned char bytes[sizeof(AVLNode<Base>)];
+    };
+    struct Slab {
+        Slab() : memory(NULL), bytes(0), mapped(false) {}
+        ~Slab();
+
+        void *memory;
+        size_t bytes;
+        bool mapped;
+    };
+
+    static constexpr size_t MIN_SLAB_NODES = 64;
+    static constexpr size_t MAX_SLAB_NODES = 65536;
+    static constexpr size_t HUGE_PAGE_BYTES = 2 * 1024 * 1024;
+
+    void grow(size_t minNodes = 0);
+    void dropDuplicateSlabs();
+
+    Slot *freeList;
+    Slot *cursor, *limit;
+    size_t nextSlabNodes;
+    bool useHugePages;
+    vector<shared_ptr<Slab> > slabs;
+};
+
+
 /* An AVLTree is a templated class that represents an AVL-balanced binary search
  * tree. It has one data member, "root", which is a pointer to the root of the
- * tree.
+ * tree. Its nodes come from "pool", an AVLNodePool owned by the tree (see
+ * above); pass true to the constructor to back the pool with huge pages.
+ *
+ * The clear() method empties the tree without recursion and without allocating,
+ * and hands all node memory back to the pool in one step. The destructor uses
+ * it, so tearing down a very large tree costs one pass over the nodes at most.
  *
  * Many of the methods in this class are virtually identical to methods in the
  * BST from the previous project, including the constructor, destructor,
@@ -133,20 +457,16 @@ void AVLNode<Base>::verifyBalance() const {
  * operator.
  *
  * The insert() and remove() methods behave as in the plain BST, but both
- * methods should rebalance the tree as necessary. This is best done by creating
- * a vector of pointers to AVLNode objects as the insert/remove methods search
- * for the place to do their work.  This vector of pointers represents the path
- * taken to get from the root to the place where a change occurs in the tree.
- * Note that for remove(), this path might go deeper than the node removed, in
- * the case of removing a node with two children (think carefully about this).
- * After insert/remove finish updating the tree, they can pass the path to
- * rebalancePathToRoot() which actually does the rebalancing. Think about how
- * large the vector of pointers needs to be, at its largest. An AVL tree with
- * height 30 must have at least 3,524,577 nodes, and if it has height 50, it
- * must have at least 53,316,291,172 nodes -- probably more than we care to put
- * in the tree. These results come from the minimum size of an AVL tree of
- * height h, which is described in your book as: S(h) = S(h - 1) + S(h - 2) + 1
- * (and base cases S(0) = 1, S(1) = 2).
+ * methods rebalance the tree as necessary. As they search for the place to do
+ * their work, they record the path taken from the root in a fixed-size array
+ * of MAX_HEIGHT node pointers on the stack, so no memory is allocated per
+ * call. Note that for remove(), this path might go deeper than the node
+ * removed, in the case of removing a node with two children. The array never
+ * needs to be longer than the tallest AVL tree that fits in memory: an AVL
+ * tree of height h has at least S(h) nodes, where S(h) = S(h - 1) + S(h - 2) + 1
+ * (and base cases S(0) = 1, S(1) = 2), so height 30 already needs 3,524,577
+ * nodes and height MAX_HEIGHT needs more nodes than a 64-bit address space
+ * can hold.
  *
  * The printLevelOrder() method prints out all the nodes in the tree in
  * level-order (root, then the root's children, then their children, etc.). This
@@ -157,49 +477,785 @@ void AVLNode<Base>::verifyBalance() const {
  * tree to our correspondent. If we were to take all the non-NULL nodes and
  * insert them in the order printed by this method, we would get the exact same
  * tree. We would not always be able to construct the exact same tree if we were
- * to use printPreorder() instead.
- *
- * The rebalancePathToRoot() method takes a vector of pointers to AVLNode
- * objects. This vector represents the path that needs rebalancing after an
- * insert or remove. It's probably best to have the root at the start of the
- * vector. This method should walk from the bottom of the path to the root,
- * checking for imbalances, and correcting any it finds by calling rotation
- * methods as necessary to correct imbalances.
+ * to use printPreorder() instead. It makes one pass, keeping only real nodes
+ * in the queue: the root is printed first, and then each node taken off the
+ * queue prints its left and right child, or NULL for a missing one. The text
+ * is gathered in blocks of PRINT_BLOCK bytes and written a block at a time.
+ * writeShape() (below) is the binary form of the same level order.
+ *
+ * Rebuilding a tree that way rebalances it all over again, though, so the tree
+ * can also be saved as a shape snapshot. writeShape() writes a 32-byte header
+ * (the magic "AVLSHAPE", the number of nodes, the key width and the number of
+ * key bytes, as 64-bit numbers), then two bits per node in level order saying
+ * whether it has a left and a right child, then the keys in the same order.
+ * The keys are written by KeyCodec (see above). Numbers are in the byte order
+ * of the machine that wrote the snapshot. readShape() rebuilds exactly the
+ * same tree from a snapshot in memory in O(n), with no rotations: every child
+ * comes after its parent in level order, so one backward pass over the bits
+ * works out the heights (and rejects anything that is not an AVL tree), and
+ * another links the nodes, built in one run of pool memory, and sets their
+ * balance factors and sizes. That pass also compares each node with its
+ * neighbours in key order, about n comparisons in all, and rejects keys that
+ * are not strictly increasing. saveShape() and loadShape() do the same
+ * through a file; loadShape() memory-maps it on Linux. Since the shape is the
+ * same, so is every code path an EncryptionTree hands out. A malformed
+ * snapshot leaves the tree unchanged.
+ *
+ * The tree can be walked in key order with the bidirectional const_iterator
+ * returned by begin() and end() (or backwards with rbegin() and rend()). An
+ * iterator refers to a node, and nodes are never moved or copied while their
+ * key is in the tree, so the iterator returned by insert() (or find()) is a
+ * stable handle: it stays valid until that key is removed, and passing it to
+ * erase() removes the key without searching for it again.
+ *
+ * The bulkLoad() method replaces the contents of the tree with the keys of a
+ * sorted range, skipping repeated keys as insert() would. It counts the keys,
+ * reserves one contiguous slab for them, and builds a perfectly balanced tree
+ * in order, setting balance factors and sizes directly, so it costs O(n) with
+ * no key searches and no rotations. (A perfectly balanced subtree of n nodes
+ * has height floor(log2 n), so each node's factor follows from the counts.)
+ *
+ * The insertBatch() method inserts a large unsorted batch of keys using several
+ * threads. The batch is sorted in parallel and its repeated keys dropped. A
+ * batch that is small next to the tree is then inserted key by key; otherwise
+ * it is built into a balanced subtree in one run of pool memory, with the left
+ * and right halves of each large subtree built on different threads, and that
+ * subtree is merged into the tree by splits and joins (see unionWith() below)
+ * in O(m log(n/m + 1)). Keys already in the tree keep their nodes, and the
+ * new nodes of keys that were already there are freed, so iterators into the
+ * tree stay valid as they do for insert(). BATCH_MIN is the number of keys
+ * from which a caller holding a run of inserts should hand it to
+ * insertBatch() instead of calling insert() for each one.
+ *
+ * The unionWith(), intersectWith() and differenceWith() methods combine this
+ * tree with another one, leaving the result in this tree. They are built on
+ * two primitives over subtrees: joinNodes(), which links two subtrees and a
+ * middle node whose key lies between them into one AVL tree in time
+ * proportional to the difference of their heights once those are known, and
+ * splitNode(), which cuts a subtree into the keys less than and greater than a
+ * given key in O(log n). Heights are not stored, so joinNodes() measures them
+ * in O(log n) unless the caller passes them in; splitNode() works out the
+ * heights of the pieces from the balance factors on its way down.
+ * Each operation splits this tree by the root key of the other, recurses on the
+ * two sides, and joins the results, which costs O(m log(n/m + 1)) for trees of
+ * m <= n keys. The two recursive calls of large enough subproblems run on
+ * different threads; each thread takes new nodes from a pool of its own, and
+ * the pools are spliced into this tree's pool afterwards. Nodes of the other
+ * tree are copied, never shared.
+ *
+ * The split() and join() methods expose these primitives on whole trees.
+ * split() moves the keys greater than a given key into another tree in
+ * O(log n); the moved nodes are not copied, and the two trees share the slabs
+ * they live in (see AVLNodePool). join() appends a key and all of another
+ * tree's keys, which must be larger, in O(log n). The eraseRange() method
+ * splits off the keys in [lo, hi], joins the two outer pieces back together,
+ * and frees the detached keys in one sweep without any rebalancing.
+ *
+ * The range methods treat [lo, hi] as a closed interval. lowerBound() returns
+ * the first key not less than its argument and upperBound() the first key
+ * greater than it. forEachInRange() makes one descent to the first key in range
+ * and then steps through the k keys in it with the iterator, so it costs
+ * O(log n + k).
+ *
+ * Because every node knows its subtree size, the tree also answers order
+ * statistics in O(log n). select(k) returns the key of rank k (the k-th
+ * smallest, counting from 0), and rank() returns the number of keys less than
+ * its argument. countInRange() is the difference of two ranks.
+ *
+ * The rebalancePathToRoot() method takes the recorded path, root first, which
+ * side of its last node changed height, and whether that side grew (insert) or
+ * shrank (remove). It walks the path from the bottom up, moving each node's
+ * balance factor one step towards the changed side or away from it. After an
+ * insert the walk stops at the first node whose factor becomes 0, or that is
+ * rotated; after a remove it stops at the first node whose factor becomes -1
+ * or 1, or that is rotated around a child with factor 0. In every other case
+ * the subtree's height changed and the walk goes on with the side of the parent
+ * it hangs from. Past the stopping point only the sizes of the remaining
+ * ancestors are refreshed. Each insert or remove therefore costs O(log n) in
+ * total, and no height is ever computed.
+ *
+ * shapeVersion goes up every time a key is added or removed or the tree is
+ * reshaped in any other way. Anything derived from the tree's shape, such as
+ * EncryptionTree's code cache, stays valid while shapeVersion is unchanged.
+ *
+ * Keys are ordered by Compare, which is less<Base> (operator<) unless another
+ * function object type is given. Compare must be default-constructible, and a
+ * default-constructed one is used for every comparison, so it cannot carry
+ * state. If Compare defines is_transparent, as less<> does, then find(),
+ * contains() and remove() also take any key type that Compare can compare
+ * with a Base, such as a string_view for a tree of strings, and never build a
+ * Base from it. The comparisons of a search go through order(), which uses
+ * the nodes' KeyPrefix when Compare is less<Base> or less<> and the key has
+ * data() and size(), and Compare otherwise.
  */
-template <class Base>
+template <class Base, class Compare>
 class AVLTree {
 public:
-    AVLTree() : root(NULL) {}
-    virtual ~AVLTree() { delete root; }
+    class const_iterator {
+    public:
+        typedef bidirectional_iterator_tag iterator_category;
+        typedef Base value_type;
+        typedef ptrdiff_t difference_type;
+        typedef const Base *pointer;
+        typedef const Base &reference;
 
-    void insert(const Base &item);
-    void remove(const Base &item);
+        const_iterator() : node(NULL), tree(NULL) {}
+
+        reference operator*() const { return node->getData(); }
+        pointer operator->() const { return &node->getData(); }
+        const_iterator &operator++() { node = node->successor(); return *this; }
+        const_iterator operator++(int) { const_iterator old = *this; ++*this; return old; }
+        const_iterator &operator--() {
+            node = node ? node->predecessor() : tree->root->maxNode();
+            return *this;
+        }
+        const_iterator operator--(int) { const_iterator old = *this; --*this; return old; }
+        bool operator==(const const_iterator &i) const { return node == i.node; }
+        bool operator!=(const const_iterator &i) const { return node != i.node; }
+
+    private:
+        friend class AVLTree;
+        const_iterator(const AVLNode<Base> *n, const AVLTree *t) : node(n), tree(t) {}
+
+        const AVLNode<Base> *node;
+        const AVLTree *tree;
+    };
+    typedef const_iterator iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+    typedef Compare key_compare;
+
+    explicit AVLTree(bool hugePages = false) : root(NULL), pool(hugePages), shapeVersion(0) {}
+    virtual ~AVLTree() { clear(); }
+
+    pair<const_iterator, bool> insert(const Base &item);
+    void remove(const Base &item) { removeKey(item); }
+    template <class Key, class C = Compare, class = typename C::is_transparent>
+    void remove(const Key &item) { removeKey(item); }
+    const_iterator erase(const_iterator position);
+    void clear();
+    template <class ForwardIterator>
+    void bulkLoad(ForwardIterator first, ForwardIterator last);
+    void insertBatch(vector<Base> batch, unsigned threads = 0);
+    static constexpr size_t BATCH_MIN = 4096;
+    void unionWith(const AVLTree &other, unsigned threads = 0);
+    void intersectWith(const AVLTree &other, unsigned threads = 0);
+    void differenceWith(const AVLTree &other, unsigned threads = 0);
+    bool split(const Base &item, AVLTree &right);
+    void join(const Base &item, AVLTree &right);
+    void eraseRange(const Base &lo, const Base &hi);
+
+    const_iterator find(const Base &item) const { return const_iterator(findNode(item), this); }
+    template <class Key, class C = Compare, class = typename C::is_transparent>
+    const_iterator find(const Key &item) const { return const_iterator(findNode(item), this); }
+    bool contains(const Base &item) const { return findNode(item) != NULL; }
+    template <class Key, class C = Compare, class = typename C::is_transparent>
+    bool contains(const Key &item) const { return findNode(item) != NULL; }
+    const_iterator lowerBound(const Base &item) const;
+    const_iterator upperBound(const Base &item) const;
+    size_t countInRange(const Base &lo, const Base &hi) const;
+    const_iterator select(size_t k) const;
+    size_t rank(const Base &item) const;
+    size_t size() const { return AVLNode<Base>::getSize(root); }
+    template <class Function>
+    void forEachInRange(const Base &lo, const Base &hi, Function fn) const;
+    const_iterator begin() const { return const_iterator(root ? root->minNode() : NULL, this); }
+    const_iterator end() const { return const_iterator(NULL, this); }
+    const_reverse_iterator rbegin() const { return const_reverse_iterator(end()); }
+    const_reverse_iterator rend() const { return const_reverse_iterator(begin()); }
 
     void printLevelOrder(ostream &os = cout) const;
     void printPreorder(ostream &os = cout) const { if (root) root->printPreorder(os); }
-    void verifySearchOrder() const { if (root) root->verifySearchOrder(); }
-    void verifyBalance() const { if (root) root->verifyBalance(); }
+    template <class Function>
+    void visitPreorder(Function fn) const { if (root) root->visitPreorder(fn); }
+    void writeShape(ostream &os) const;
+    bool readShape(const char *bytes, size_t length);
+    bool saveShape(const string &fileName) const;
+    bool loadShape(const string &fileName);
+    void verifySearchOrder() const { verifySearchOrder(is_same<Compare, less<Base> >()); }
+    void verifyBalance() const {
+        if (root) { root->verifyBalance(); root->verifyBalanceFactors(); }
+    }
 
 protected:
     AVLTree(const AVLTree &t) { assert(false); }
     const AVLTree &operator=(const AVLTree &t) { assert(false); return *this; }
 
-    void rebalancePathToRoot(vector<AVLNode<Base> *> const &path);
+    static constexpr int MAX_HEIGHT = AVLNode<Base>::MAX_HEIGHT;
+    static constexpr size_t MAX_SIZE = AVLNode<Base>::MAX_SIZE;
+    static constexpr size_t PARALLEL_CUTOFF = 16384;
+    static constexpr size_t SHAPE_BLOCK = 65536;
+    static constexpr size_t PRINT_BLOCK = AVLNode<Base>::PRINT_BLOCK;
+
+    template <class Key>
+    struct UsesPrefix
+        : integral_constant<bool, HasBytes<Key>::value &&
+                                  (is_same<Compare, less<Base> >::value ||
+                                   is_same<Compare, less<void> >::value)> {};
+
+    template <class A, class B>
+    static bool lessThan(const A &a, const B &b) { return Compare()(a, b); }
+    template <class Key>
+    static KeyPrefix<Base> prefixOf(const Key &item) { return prefixOf(item, UsesPrefix<Key>()); }
+    template <class Key>
+    static KeyPrefix<Base> prefixOf(const Key &item, true_type) { return KeyPrefix<Base>(item); }
+    template <class Key>
+    static KeyPrefix<Base> prefixOf(const Key &, false_type) { return KeyPrefix<Base>(); }
+    template <class Key>
+    static int order(const Key &item, const KeyPrefix<Base> &key, const AVLNode<Base> *n) {
+        return order(item, key, n, UsesPrefix<Key>());
+    }
+    template <class Key>
+    static int order(const Key &item, const KeyPrefix<Base> &key, const AVLNode<Base> *n,
+                     true_type) {
+        return n->compareTo(item, key);
+    }
+    template <class Key>
+    static int order(const Key &item, const KeyPrefix<Base> &, const AVLNode<Base> *n,
+                     false_type) {
+        return lessThan(item, n->data) ? -1 : (lessThan(n->data, item) ? 1 : 0);
+    }
+
+    void verifySearchOrder(true_type) const { if (root) root->verifySearchOrder(); }
+    void verifySearchOrder(false_type) const;
+
+    template <class Key>
+    const AVLNode<Base> *findNode(const Key &item) const;
+    template <class Key>
+    void removeKey(const Key &item);
+
+    void rebalancePathToRoot(AVLNode<Base> * const *path, int length, bool fromLeft,
+                             bool grew);
+    void removeNode(AVLNode<Base> *toRemove, AVLNode<Base> **path, int length);
+    template <class ForwardIterator>
+    AVLNode<Base> *buildSorted(ForwardIterator &first, ForwardIterator last, size_t n);
+    static AVLNode<Base> *buildRun(AVLNode<Base> *nodes, const Base *keys, size_t n,
+                                   unsigned threads);
+    template <class RandomAccessIterator>
+    static void sortParallel(RandomAccessIterator first, RandomAccessIterator last,
+                             unsigned threads);
+    static unsigned threadCount(unsigned threads);
+
+    static int balancedHeight(size_t n);
+    static void checkSize(size_t n);
+    static AVLNode<Base> *link(AVLNode<Base> *l, AVLNode<Base> *k, AVLNode<Base> *r,
+                               int balance);
+    static AVLNode<Base> *joinNodes(AVLNode<Base> *l, AVLNode<Base> *k, AVLNode<Base> *r);
+    static AVLNode<Base> *joinNodes(AVLNode<Base> *l, int hl, AVLNode<Base> *k,
+                                    AVLNode<Base> *r, int hr, int &h);
+    static AVLNode<Base> *joinRight(AVLNode<Base> *l, int hl, AVLNode<Base> *k,
+                                    AVLNode<Base> *r, int hr, int &h);
+    static AVLNode<Base> *joinLeft(AVLNode<Base> *l, int hl, AVLNode<Base> *k,
+                                   AVLNode<Base> *r, int hr, int &h);
+    static AVLNode<Base> *concatNodes(AVLNode<Base> *l, AVLNode<Base> *r);
+    static AVLNode<Base> *splitLast(AVLNode<Base> *t, int ht, AVLNode<Base> *&last, int &h);
+    static AVLNode<Base> *splitNode(AVLNode<Base> *t, const Base &item,
+                                    AVLNode<Base> *&l, AVLNode<Base> *&r);
+    static AVLNode<Base> *splitNode(AVLNode<Base> *t, int ht, const Base &item,
+                                    AVLNode<Base> *&l, int &hl, AVLNode<Base> *&r, int &hr);
+    static AVLNode<Base> *copyNodes(const AVLNode<Base> *t, AVLNodePool<Base> &nodePool);
+    static void destroyNodes(AVLNode<Base> *t, AVLNodePool<Base> &nodePool);
+    static AVLNode<Base> *unionNodes(AVLNode<Base> *t1, const AVLNode<Base> *t2,
+                                     AVLNodePool<Base> &nodePool, unsigned threads);
+    static AVLNode<Base> *mergeNodes(AVLNode<Base> *t1, AVLNode<Base> *t2,
+                                     AVLNodePool<Base> &nodePool, unsigned threads);
+    static AVLNode<Base> *intersectNodes(AVLNode<Base> *t1, const AVLNode<Base> *t2,
+                                         AVLNodePool<Base> &nodePool, unsigned threads);
+    static AVLNode<Base> *differenceNodes(AVLNode<Base> *t1, const AVLNode<Base> *t2,
+                                          AVLNodePool<Base> &nodePool, unsigned threads);
 
     AVLNode<Base> *root;
+    AVLNodePool<Base> pool;
+    unsigned long long shapeVersion;
+};
+
+/* A PathCode is the binary form of an EncryptionTree code. Step i of the path
+ * from the root (0 for left, 1 for right) is bit i % 64 of words[i / 64], and
+ * length is the number of steps. The code "r" has length 0, and a key that is
+ * not in the tree gets a code whose length is INVALID. CAPACITY bits are more
+ * than any AVLTree can be deep, so a PathCode never needs heap memory.
+ *
+ * toString() and fromString() convert to and from the text form. fromString()
+ * reads text the same way decrypt() does: text that does not start with 'r'
+ * is invalid, and any character other than '0' and '1' after it is skipped.
+ */
+struct PathCode {
+    static constexpr unsigned WORDS = 2;
+    static constexpr unsigned CAPACITY = 64 * WORDS;
+    static constexpr unsigned INVALID = ~0u;
+
+    PathCode() : length(INVALID) { for (unsigned i = 0; i < WORDS; i++) words[i] = 0; }
+
+    bool valid() const { return length != INVALID; }
+    bool step(unsigned i) const { return (words[i >> 6] >> (i & 63)) & 1; }
+    string toString() const;
+    static PathCode fromString(const string &text);
+
+    unsigned long long words[WORDS];
+    unsigned length;
 };
 
 /* The EncryptionTree for this project is exactly the same as for the previous
  * project, except that it now has an AVLTree as its parent class.
+ *
+ * The encryptRange() method returns every key in [lo, hi] in order, paired with
+ * the code encrypt() would give it. It makes a single descent that skips any
+ * subtree lying wholly outside the range, and builds each code by extending the
+ * code of the node's parent, so it costs O(log n + k) rather than one encrypt()
+ * per key.
+ *
+ * A tree can also be constructed directly from a sorted range of keys, which
+ * is loaded with bulkLoad().
+ *
+ * freeze() makes a read-only FrozenEncryptionTree copy of the tree as it is
+ * now (see below).
+ *
+ * encryptBits() and decryptBits() work with PathCode values instead of text.
+ * They give the same paths as encrypt() and decrypt() but never allocate.
+ * decryptBits() loads each 64-step word once and shifts one bit off it per
+ * level.
+ *
+ * The decryptByRank() method treats a key's rank as its code: it returns the
+ * key of rank k (as select() does), or NULL if there are not that many keys.
+ *
+ * The code walks themselves live in the static encryptFrom() and decryptFrom()
+ * methods, which start from any root; SnapshotEncryptionTree (below) uses them
+ * so that its codes are always the same as this class's.
+ *
+ * enableCache() turns on a cache of recent results for encrypt() and
+ * decrypt(). It maps each key to its code, and each code to the key it leads
+ * to. Entries are tagged with the tree's shapeVersion and are only used while
+ * it is unchanged, so any change to the tree makes all of them stale in O(1).
+ * A stale entry is overwritten the next time it is looked up. Keys that
+ * std::hash cannot hash are kept in an ordered map instead. When a map
+ * reaches its capacity it is emptied and refilled by later calls. With the
+ * cache on, encrypt() and decrypt() change it, so they must not be called
+ * from several threads at once. encryptMany() and decryptMany() do not use
+ * the cache.
+ *
+ * When Compare is transparent (see AVLTree), encrypt(), encryptBits() and
+ * encryptMany() take any key type it can compare with a Base, as find()
+ * does. Such calls walk the tree without the code cache, which is keyed by
+ * Base.
+ *
+ * The encryptMany() and decryptMany() methods handle a whole message at once.
+ * The output vector is sized up front and each word's result is written to
+ * its own slot, so the order matches the input. decryptMany() takes paths of
+ * any string-like type, such as string_view. A message of at least
+ * PARALLEL_CUTOFF words is split among a group of worker threads. Each worker
+ * takes the next block of MANY_CHUNK words until none are left. The tree is
+ * only read, so the workers need no locks; it must not be changed until the
+ * call returns.
  */
-template <class Base>
-class EncryptionTree : public AVLTree<Base> {
+template <class Base, class Compare>
+class EncryptionTree : public AVLTree<Base, Compare> {
 public:
-    EncryptionTree() {}
+    explicit EncryptionTree(bool hugePages = false) : AVLTree<Base, Compare>(hugePages) {}
+    template <class ForwardIterator>
+    EncryptionTree(ForwardIterator first, ForwardIterator last, bool hugePages = false)
+        : AVLTree<Base, Compare>(hugePages) { this->bulkLoad(first, last); }
     virtual ~EncryptionTree() {}
 
     string encrypt(const Base &item) const;
+    template <class Key, class C = Compare, class = typename C::is_transparent>
+    string encrypt(const Key &item) const { return encryptFrom(this->root, item); }
     const Base *decrypt(const string &path) const;
+    PathCode encryptBits(const Base &item) const { return encryptBitsFrom(this->root, item); }
+    template <class Key, class C = Compare, class = typename C::is_transparent>
+    PathCode encryptBits(const Key &item) const { return encryptBitsFrom(this->root, item); }
+    const Base *decryptBits(const PathCode &code) const;
+    const Base *decryptByRank(size_t k) const;
+    FrozenEncryptionTree<Base, Compare> freeze() const;
+    vector<pair<Base, string> > encryptRange(const Base &lo, const Base &hi) const;
+    vector<string> encryptMany(const vector<Base> &items, unsigned threads = 0) const {
+        return encryptEach(items, threads);
+    }
+    template <class Key, class C = Compare, class = typename C::is_transparent>
+    vector<string> encryptMany(const vector<Key> &items, unsigned threads = 0) const {
+        return encryptEach(items, threads);
+    }
+    template <class Path>
+    vector<const Base *> decryptMany(const vector<Path> &paths, unsigned threads = 0) const;
+    void enableCache(size_t capacity = DEFAULT_CACHE_CAPACITY);
+    void disableCache() { cache.reset(); }
+
+protected:
+    friend class SnapshotEncryptionTree<Base>;
+
+    static constexpr size_t MANY_CHUNK = 1024;
+    static constexpr size_t DEFAULT_CACHE_CAPACITY = 4096;
+
+    struct CodeCache {
+        explicit CodeCache(size_t c) : capacity(c) {}
+
+        struct CodeEntry {
+            string code;
+            unsigned long long version;
+        };
+        struct ItemEntry {
+            const Base *item;
+            unsigned long long version;
+        };
+
+        typedef typename conditional<IsHashable<Base>::value, unordered_map<Base, CodeEntry>,
+                                     map<Base, CodeEntry> >::type CodeMap;
+
+        size_t capacity;
+        CodeMap codes;
+        unordered_map<string, ItemEntry> items;
+    };
+
+    unique_ptr<CodeCache> cache;
+
+    template <class Function>
+    static void forEachIndex(size_t n, unsigned threads, Function fn);
+
+    template <class Key>
+    vector<string> encryptEach(const vector<Key> &items, unsigned threads) const;
+    template <class Key>
+    static string encryptFrom(const AVLNode<Base> *root, const Key &item);
+    template <class Key>
+    static PathCode encryptBitsFrom(const AVLNode<Base> *root, const Key &item);
+    template <class Path>
+    static const Base *decryptFrom(const AVLNode<Base> *root, const Path &path);
+    void encryptRange(const AVLNode<Base> *node, const Base &lo, const Base &hi,
+                      string &code, vector<pair<Base, string> > &out) const;
+};
+
+/* A FrozenEncryptionTree is a read-only copy of an EncryptionTree, made by
+ * EncryptionTree::freeze(), for times when the keys will not change for a
+ * while. It has exactly the same shape as the tree it was made from, so every
+ * key has the same code in both.
+ *
+ * An AVL tree is not complete, so its nodes cannot be given Eytzinger
+ * positions without leaving most of the array empty. Instead the nodes are
+ * numbered in breadth-first order, which is Eytzinger order for the complete
+ * levels near the root. Keys and shape are kept in separate arrays: keys[i]
+ * is the key of node i, and children[2 * i] and children[2 * i + 1] are the
+ * positions of its left and right children, or NONE. The top levels of the
+ * tree then share a few cache lines, and a search reads one key and one
+ * child index per level.
+ *
+ * A search does not stop at a match. Going right when keys[i] < item and
+ * left otherwise, it always reaches the bottom of the tree, and the last node
+ * where it went left is the only one that can hold item. Because of this, the
+ * loop has no data-dependent branch except its end test, and the code of
+ * the match is the first part of the recorded directions. Each step also
+ * prefetches the next node's key and child indices.
+ *
+ * containsMany() runs several searches side by side, so the memory accesses
+ * of one search overlap with those of the others. When the compiler targets
+ * AVX2 and the keys are 32-bit or 64-bit integers, each step of 8 or 4
+ * searches uses one gather for the keys, one vector compare and one gather
+ * for the child indices. (The vector compare is operator<, so this is only
+ * done when Compare is less<Base>.)
+ */
+template <class Base, class Compare>
+class FrozenEncryptionTree {
+public:
+    FrozenEncryptionTree() {}
+
+    bool contains(const Base &item) const { return search(item, NULL) != NONE; }
+    string encrypt(const Base &item) const { return encryptBits(item).toString(); }
+    const Base *decrypt(const string &path) const { return decryptBits(PathCode::fromString(path)); }
+    PathCode encryptBits(const Base &item) const;
+    const Base *decryptBits(const PathCode &code) const;
+    vector<bool> containsMany(const vector<Base> &items) const;
+    size_t size() const { return keys.size(); }
+
+protected:
+    friend class EncryptionTree<Base, Compare>;
+
+    static constexpr int NONE = -1;
+    static constexpr size_t LANES = 8;
+#ifdef __AVX2__
+    static constexpr int SIMD_LANES = is_integral<Base>::value && !is_same<Base, bool>::value &&
+                                      is_same<Compare, less<Base> >::value
+                                      ? (sizeof(Base) == 4 ? 8 : (sizeof(Base) == 8 ? 4 : 0)) : 0;
+#else
+    static constexpr int SIMD_LANES = 0;
+#endif
+
+    int search(const Base &item, PathCode *code) const;
+    void containsLanes(const vector<Base> &items, vector<bool> &found, integral_constant<int, 0>) const;
+#ifdef __AVX2__
+    void containsLanes(const vector<Base> &items, vector<bool> &found, integral_constant<int, 8>) const;
+    void containsLanes(const vector<Base> &items, vector<bool> &found, integral_constant<int, 4>) const;
+#endif
+
+    vector<Base> keys;
+    vector<int> children;
+};
+
+/* A SnapshotEncryptionTree is an EncryptionTree for one writer and many readers
+ * running at the same time, with no locks on the read side (multi-version
+ * concurrency control). It gives the same codes as an EncryptionTree holding
+ * the same keys that was built by the same sequence of inserts and removes.
+ *
+ * Published nodes are never changed. The insert() and remove() methods copy
+ * the nodes on the path they change (path copying), and the rotations make
+ * new copies of the nodes they move instead of relinking them in place. The
+ * new root is then published with one atomic store, so every root ever
+ * published is an immutable version of the whole tree. Writers are serialized
+ * by writeLock; nodes are not given parent links, since a node may be shared
+ * by several versions.
+ *
+ * A reader pins a version by constructing a Snapshot, which claims one of the
+ * MAX_READERS (128) announcement slots, records the current epoch in it, and
+ * then reads the root. So at most 128 Snapshots of a tree can be alive at
+ * once, counting the short-lived ones made by the tree's own lookups; a
+ * Snapshot constructed while every slot is taken waits for one to be given
+ * up, and asserts if every slot is held by its own thread, which would then
+ * wait forever. Every lookup through the Snapshot sees that version,
+ * however many writes happen meanwhile. The encrypt(), decrypt() and contains()
+ * methods of the tree itself are shorthand for a one-lookup Snapshot. Since
+ * that Snapshot is gone when they return, the tree's decrypt() copies the key
+ * into its second argument (and returns false for an invalid path) instead of
+ * returning a pointer into a node that a later write could free; hold a
+ * Snapshot to get pointers.
+ *
+ * Nodes replaced by a write are retired rather than freed: the writer advances
+ * the epoch after publishing, and tags the replaced nodes with the new epoch.
+ * A batch is freed (by the writer, back into its pool) once every slot that is
+ * in use holds an epoch at least as new as the batch's tag, since any reader
+ * that started after that point can only reach the new version. The tree must
+ * not be destroyed while a Snapshot of it is alive.
+ */
+template <class Base>
+class SnapshotEncryptionTree {
+public:
+    class Snapshot {
+    public:
+        explicit Snapshot(const SnapshotEncryptionTree &t);
+        ~Snapshot();
+
+        string encrypt(const Base &item) const {
+            return EncryptionTree<Base>::encryptFrom(root, item);
+        }
+        const Base *decrypt(const string &path) const {
+            return EncryptionTree<Base>::decryptFrom(root, path);
+        }
+        bool contains(const Base &item) const;
+        size_t size() const { return AVLNode<Base>::getSize(root); }
+
+    protected:
+        friend class SnapshotEncryptionTree;
+
+        Snapshot(const Snapshot &s) { assert(false); }
+        const Snapshot &operator=(const Snapshot &s) { assert(false); return *this; }
+
+        const SnapshotEncryptionTree *tree;
+        const AVLNode<Base> *root;
+        size_t slot;
+    };
+
+    explicit SnapshotEncryptionTree(bool hugePages = false)
+        : root(NULL), epoch(1), pool(hugePages) {
+        for (size_t i = 0; i < MAX_READERS; i++){
+            readers[i].epoch.store(0);
+            readers[i].owner.store(thread::id());
+        }
+    }
+    ~SnapshotEncryptionTree();
+
+    void insert(const Base &item);
+    void remove(const Base &item);
+
+    string encrypt(const Base &item) const { return Snapshot(*this).encrypt(item); }
+    bool decrypt(const string &path, Base &item) const {
+        Snapshot s(*this);
+        const Base *found = s.decrypt(path);
+        if (found){
+            item = *found;
+        }
+        return found != NULL;
+    }
+    bool contains(const Base &item) const { return Snapshot(*this).contains(item); }
+    size_t size() const { return Snapshot(*this).size(); }
+
+    void verifySearchOrder() const { Snapshot s(*this); if (s.root) s.root->verifySearchOrder(); }
+    void verifyBalance() const {
+        Snapshot s(*this);
+        if (s.root) { s.root->verifyBalance(); s.root->verifyBalanceFactors(); }
+    }
+
+protected:
+    SnapshotEncryptionTree(const SnapshotEncryptionTree &t) { assert(false); }
+    const SnapshotEncryptionTree &operator=(const SnapshotEncryptionTree &t) { assert(false); return *this; }
+
+    static constexpr size_t MAX_READERS = 128;
+
+    struct ReaderSlot {
+        alignas(64) atomic<unsigned long long> epoch;
+        atomic<thread::id> owner;
+    };
+
+    AVLNode<Base> *copyOf(const AVLNode<Base> *n);
+    AVLNode<Base> *rotateLeft(AVLNode<Base> *n, int b);
+    AVLNode<Base> *rotateRight(AVLNode<Base> *n, int b);
+    AVLNode<Base> *rotateRightLeft(AVLNode<Base> *n);
+    AVLNode<Base> *rotateLeftRight(AVLNode<Base> *n);
+    AVLNode<Base> *rebalance(AVLNode<Base> *n, int delta, bool grew, bool &changed);
+    AVLNode<Base> *insertInto(const AVLNode<Base> *n, const Base &item, bool &grew);
+    AVLNode<Base> *removeFrom(const AVLNode<Base> *n, const Base &item, bool &shrank);
+    AVLNode<Base> *removeMin(const AVLNode<Base> *n, const AVLNode<Base> *&minimum,
+                             bool &shrank);
+    void publish(const AVLNode<Base> *newRoot);
+    void reclaim();
+
+    atomic<const AVLNode<Base> *> root;
+    atomic<unsigned long long> epoch;
+    mutable ReaderSlot readers[MAX_READERS];
+
+    mutex writeLock;
+    AVLNodePool<Base> pool;
+    vector<const AVLNode<Base> *> replaced;
+    deque<pair<unsigned long long, vector<const AVLNode<Base> *> > > retired;
+};
+
+/* A ConcurrentEncryptionTree is an AVL-balanced tree of keys that any number of
+ * threads may insert into, remove from and search at the same time. It follows
+ * the optimistic design of Bronson, Casper, Chafi and Olukotun ("A Practical
+ * Concurrent Binary Search Tree"):
+ *
+ * Each node has a version word. A rotation that moves a node down, shrinking
+ * the range of keys under it, sets the node's "shrinking" bit for the duration
+ * and bumps the version at the end; a node taken out of the tree gets the
+ * "unlinked" version for good. Searches (contains(), encrypt() and decrypt())
+ * take no locks at all. They record a node's version before reading its child
+ * pointer and check it again after moving to the child; if it has changed, the
+ * step is retried from that node, or from its parent if the node itself moved.
+ *
+ * Writers lock only the nodes they change, always a parent before its child,
+ * so they cannot deadlock. Inserting a key links a new leaf under a locked
+ * parent. Removing a key with two children just marks its node as a routing
+ * node (present is false), which still guides searches; nodes with at most one
+ * child are unlinked from their locked parent. After changing the tree, a
+ * writer walks up from the damaged node fixing heights, unlinking routing
+ * nodes that have become unnecessary, and rotating, each time locking just the
+ * parent, the node, and the child or grandchild the rotation moves. The tree
+ * is an ordinary AVL tree again once no write is in progress, but its shape
+ * (and so its codes) may differ from an EncryptionTree built by the same
+ * operations.
+ *
+ * Searches may still be reading a node after it is unlinked, so unlinked
+ * nodes are retired rather than deleted. Every operation announces the epoch
+ * it started in, the way a SnapshotEncryptionTree reader does, and a retired
+ * node is deleted once every announced epoch is at least as new as the epoch
+ * of its retirement. There are MAX_THREADS (128) announcement slots, one per
+ * operation in progress, so at most 128 threads can use the tree at once;
+ * an operation started while every slot is taken waits for one to be given
+ * up. decrypt() copies the key out for the same reason, instead
+ * of returning a pointer into the tree.
+ *
+ * The verify and size methods read the tree without any synchronization and
+ * may only be called while no other thread is using it.
+ */
+template <class Base>
+class ConcurrentEncryptionTree {
+public:
+    ConcurrentEncryptionTree() : rootHolder(Base(), false, NULL, 0), epoch(1) {
+        for (size_t i = 0; i < MAX_THREADS; i++){
+            threads[i].epoch.store(0);
+            threads[i].owner.store(thread::id());
+        }
+    }
+    ~ConcurrentEncryptionTree();
+
+    bool insert(const Base &item);
+    bool remove(const Base &item);
+    bool contains(const Base &item) const;
+    string encrypt(const Base &item) const;
+    bool decrypt(const string &path, Base &item) const;
+
+    size_t size() const;
+    void verifySearchOrder() const;
+    void verifyBalance() const;
+
+protected:
+    ConcurrentEncryptionTree(const ConcurrentEncryptionTree &t) { assert(false); }
+    const ConcurrentEncryptionTree &operator=(const ConcurrentEncryptionTree &t) { assert(false); return *this; }
+
+    struct Node {
+        Node(const Base &k, bool p, Node *par, int h)
+            : key(k), present(p), parent(par), left(NULL), right(NULL), height(h), version(0) {}
+
+        Node *child(int dir) const { return dir < 0 ? left.load() : right.load(); }
+        void setChild(int dir, Node *n) { if (dir < 0) left.store(n); else right.store(n); }
+
+        const Base key;
+        atomic<bool> present;
+        atomic<Node *> parent, left, right;
+        atomic<int> height;
+        atomic<unsigned long long> version;
+        mutex lock;
+    };
+
+    class Pin {
+    public:
+        explicit Pin(const ConcurrentEncryptionTree &t);
+        ~Pin();
+
+    protected:
+        Pin(const Pin &p) { assert(false); }
+        const Pin &operator=(const Pin &p) { assert(false); return *this; }
+
+        const ConcurrentEncryptionTree *tree;
+        size_t slot;
+    };
+
+    struct ThreadSlot {
+        alignas(64) atomic<unsigned long long> epoch;
+        atomic<thread::id> owner;
+    };
+
+    enum Result { NOT_FOUND, FOUND, RETRY };
+
+    static constexpr unsigned long long UNLINKED = 1;
+    static constexpr unsigned long long SHRINKING = 2;
+    static constexpr unsigned long long VERSION_STEP = 4;
+    static constexpr int NOTHING_REQUIRED = -1;
+    static constexpr int REBALANCE_REQUIRED = -2;
+    static constexpr int UNLINK_REQUIRED = -3;
+    static constexpr size_t MAX_THREADS = 128;
+    static constexpr size_t RECLAIM_BATCH = 64;
+
+    static bool isShrinkingOrUnlinked(unsigned long long v) { return (v & (SHRINKING | UNLINKED)) != 0; }
+    static bool isUnlinked(unsigned long long v) { return (v & UNLINKED) != 0; }
+    static unsigned long long beginChange(unsigned long long v) { return v | SHRINKING; }
+    static unsigned long long endChange(unsigned long long v) { return (v & ~(SHRINKING | UNLINKED)) + VERSION_STEP; }
+    static int getHeight(const Node *n) { return n ? n->height.load() : 0; }
+    static int compare(const Base &a, const Base &b) { return a < b ? -1 : (b < a ? 1 : 0); }
+    static void waitUntilNotChanging(Node *n);
+
+    Result attemptGet(const Base &item, Node *node, int dir, unsigned long long nodeVersion,
+                      string *code) const;
+    Result attemptDecrypt(const string &path, size_t pos, Node *node, int dir,
+                          unsigned long long nodeVersion, Base &item) const;
+    Result attemptInsert(const Base &item, Node *node, int dir, unsigned long long nodeVersion);
+    Result attemptRemove(const Base &item, Node *node, int dir, unsigned long long nodeVersion);
+    Result attemptRemoveNode(Node *parent, Node *n);
+
+    static int nodeCondition(Node *node);
+    void fixHeightAndRebalance(Node *node);
+    Node *fixHeight(Node *node);
+    Node *rebalance(Node *nParent, Node *n);
+    Node *rebalanceToRight(Node *nParent, Node *n, Node *nL, int hR0);
+    Node *rebalanceToLeft(Node *nParent, Node *n, Node *nR, int hL0);
+    Node *rotateRight(Node *nParent, Node *n, Node *nL, int hR, int hLL, Node *nLR, int hLR);
+    Node *rotateLeft(Node *nParent, Node *n, int hL, Node *nR, Node *nRL, int hRL, int hRR);
+    Node *rotateRightOverLeft(Node *nParent, Node *n, Node *nL, int hR, int hLL, Node *nLR, int hLRL);
+    Node *rotateLeftOverRight(Node *nParent, Node *n, int hL, Node *nR, Node *nRL, int hRR, int hRLR);
+    bool attemptUnlink(Node *parent, Node *n);
+    void retire(Node *n);
+    void reclaim();
+
+    mutable Node rootHolder;
+    atomic<unsigned long long> epoch;
+    mutable ThreadSlot threads[MAX_THREADS];
+
+    mutex retireLock;
+    deque<pair<unsigned long long, Node *> > retired;
 };
 
 #endif
@@ -501,4 +1557,4 @@ i shine
 l
 p
 q
- */
\ No newline at end of file
+ */
\ No newline at end of file
@@ -5,776 +5,4502 @@
 #include <queue>
 
 /* ~AVLNode()
- * Destructor for AVLNode, recursively deletes left and right children
+ * Destructor for AVLNode. Children are not deleted here: every node lives in
+ * its tree's AVLNodePool, and the tree destroys its nodes through the pool.
  */
 template <typename T>
 AVLNode<T>::~AVLNode(){
-    const AVLNode<T> *leftChild = this->getLeft();
-    const AVLNode<T> *rightChild = this->getRight();
-    if (leftChild) {
-        delete leftChild;
-        leftChild = nullptr;
-    }
-    if (rightChild) {
-        delete rightChild;
-        rightChild = nullptr;
-    }
     this->left = nullptr;
     this->right = nullptr;
     return;
 }
 
-/* minNode() const
- * Returns a pointer to the node with the minimum value of the given node
+/* allocate(const T&)
+ * Constructs a node holding a copy of item, reusing a freed slot if there is one
  *  parameters:
+ *  item, value to be stored in the new node
  *
  *  return value:
- *  Pointer to the node with the minimum value
+ *  Pointer to the newly constructed node
  */
 template <typename T>
-const AVLNode<T>* AVLNode<T>::minNode() const{
-    if (!this->left){
-        return this;
+AVLNode<T>* AVLNodePool<T>::allocate(const T &item){
+    Slot* slot = this->freeList;
+    if (slot){
+        this->freeList = slot->next;
     }
-    AVLNode* that = this->left;
-    while (that->left){
-        that = that->left;
+    else {
+        if (this->cursor == this->limit){
+            this->grow();
+        }
+        slot = this->cursor++;
     }
-    return that;
+    return new (slot->bytes) AVLNode<T>(item);
 }
 
-/* maxNode() const
- * Returns a pointer to the node with the maximum value of the given node
+/* deallocate(AVLNode<T>*)
+ * Destroys the given node and puts its slot on the free list for reuse
  *  parameters:
+ *  n, node previously returned by allocate()
  *
  *  return value:
- *  Pointer to the node with the maximum value
+ *
  */
 template <typename T>
-const AVLNode<T>* AVLNode<T>::maxNode() const{
-    if (!this->right){
-        return this;
-    }
-    AVLNode* that = this->right;
-    while (that->right){
-        that = that->right;
+void AVLNodePool<T>::deallocate(AVLNode<T> *n){
+    if (!n){
+        return;
     }
-    return that;
+    n->~AVLNode<T>();
+    Slot* slot = reinterpret_cast<Slot*>(n);
+    slot->next = this->freeList;
+    this->freeList = slot;
 }
 
-/* singleRotateLeft()
- * Performs a single rotation to the left on the AVL Node
- * parameters:
+/* reserve(size_t)
+ * Makes room for n more nodes in the current slab, adding a slab big enough
+ * for all of them if it does not already have space
+ *  parameters:
+ *  n, number of nodes about to be allocated
+ *
+ *  return value:
  *
- * return value:
- *   Pointer to the node that becomes the new "root" after rotation
  */
 template <typename T>
-AVLNode<T>* AVLNode<T>::singleRotateLeft(){
-    if (this->right){
-        AVLNode* temp = this->right;
-        AVLNode* hold = nullptr;
-        if (temp->left){
-            hold = temp->left;
-            temp->left = nullptr;
-            temp->updateHeight();
-        }
-        this->right = nullptr;
-        this->updateHeight();
-        temp->left = this;
-        this->right = hold;
-        this->updateHeight();
-        if (temp->left){
-            temp->left->updateHeight();
-        }
-        if (temp->right){
-            temp->right->updateHeight();
-        }
-        temp->updateHeight();
-        return temp;
+void AVLNodePool<T>::reserve(size_t n){
+    if (static_cast<size_t>(this->limit - this->cursor) < n){
+        this->grow(n);
     }
-    return this;
 }
 
-/* singleRotateRight()
- * Performs a single rotation to the right on the AVL Node
- * parameters:
+/* allocateRun(size_t)
+ * Hands out uninitialized storage for n nodes that sit next to each other in
+ * one slab. Each node must be constructed with placement new before use and
+ * can later be given back with deallocate() like any other node
+ *  parameters:
+ *  n, number of nodes in the run
  *
- * return value:
- *   Pointer to the node that becomes the new "root" after rotation
+ *  return value:
+ *  Pointer to storage for the first node of the run
  */
 template <typename T>
-AVLNode<T>* AVLNode<T>::singleRotateRight(){
-    if (this->left){
-        AVLNode* temp = this->left;
-        AVLNode* hold = nullptr;
-        if (temp->right){
-            hold = temp->right;
-            temp->right = nullptr;
-            temp->updateHeight();
-        }
-        this->left = nullptr;
-        this->updateHeight();
-        temp->right = this;
-        this->left = hold;
-        this->updateHeight();
-        if (temp->left){
-            temp->left->updateHeight();
-        }
-        if (temp->right){
-            temp->right->updateHeight();
+AVLNode<T>* AVLNodePool<T>::allocateRun(size_t n){
+    static_assert(sizeof(Slot) == sizeof(AVLNode<T>), "slots must be exactly one node wide");
+    this->reserve(n);
+    Slot* run = this->cursor;
+    this->cursor += n;
+    return reinterpret_cast<AVLNode<T>*>(run);
+}
+
+/* splice(AVLNodePool<T>&)
+ * Moves every slab and free slot of another pool into this one. The other
+ * pool is left empty, and its unused bump space is given up
+ *  parameters:
+ *  other, pool to take the memory of
+ *
+ *  return value:
+ *
+ */
+template <typename T>
+void AVLNodePool<T>::splice(AVLNodePool<T> &other){
+    this->slabs.insert(this->slabs.end(), other.slabs.begin(), other.slabs.end());
+    this->dropDuplicateSlabs();
+    if (other.freeList){
+        Slot* tail = other.freeList;
+        while (tail->next){
+            tail = tail->next;
         }
-        temp->updateHeight();
-        return temp;
+        tail->next = this->freeList;
+        this->freeList = other.freeList;
     }
-    return this;
+    other.slabs.clear();
+    other.freeList = nullptr;
+    other.cursor = nullptr;
+    other.limit = nullptr;
 }
 
-/* doubleRotateLeftRight()
- * Performs a double rotation (left-right) on the AVL Node, left rotation on
- * its left child, and right rotation on "root" location
- * parameters:
+/* share(const AVLNodePool<T>&)
+ * Takes a hold on every slab of another pool, so that nodes living in them
+ * stay valid for as long as this pool needs them. The other pool is not
+ * changed, and this pool keeps allocating from its own slabs
+ *  parameters:
+ *  other, pool whose slabs are shared
+ *
+ *  return value:
  *
- * return value:
- *   pointer to the node that becomes the new "root" after rotation
  */
 template <typename T>
-AVLNode<T>* AVLNode<T>::doubleRotateLeftRight(){
-    this->left = this->left->singleRotateLeft();
-    return this->singleRotateRight();
+void AVLNodePool<T>::share(const AVLNodePool<T> &other){
+    this->slabs.insert(this->slabs.end(), other.slabs.begin(), other.slabs.end());
+    this->dropDuplicateSlabs();
 }
 
-/* doubleRotateRightLeft()
- * Performs a double rotation (right-left) on the AVL Node, right rotation on
- * its right child, and left rotation on "root" location
- * parameters:
+/* dropDuplicateSlabs()
+ * Lets go of extra holds on slabs this pool holds more than once
+ *  parameters:
+ *
+ *  return value:
  *
- * return value:
- *   pointer to the node that becomes the new "root" after rotation
  */
 template <typename T>
-AVLNode<T>* AVLNode<T>::doubleRotateRightLeft(){
-    this->right = this->right->singleRotateRight();
-    return this->singleRotateLeft();
+void AVLNodePool<T>::dropDuplicateSlabs(){
+    sort(this->slabs.begin(), this->slabs.end());
+    this->slabs.erase(unique(this->slabs.begin(), this->slabs.end()), this->slabs.end());
 }
 
-/* insert(const T&)
- * Inserts a new node with the given item into the AVL Tree
+/* grow(size_t)
+ * Adds a new slab to the pool and points the bump cursor at it. Slabs double
+ * in size up to MAX_SLAB_NODES; huge page slabs are rounded to whole pages
  *  parameters:
- *  item, value to be inserted into the AVL Tree
+ *  minNodes, smallest number of nodes the new slab must hold
  *
  *  return value:
  *
  */
 template <typename T>
-void AVLTree<T>::insert(const T &item){
-    if (!this->root){
-        this->root = new AVLNode<T> (item);
+void AVLNodePool<T>::grow(size_t minNodes){
+    shared_ptr<Slab> held = make_shared<Slab>();
+    Slab& slab = *held;
+    slab.bytes = (minNodes > this->nextSlabNodes ? minNodes : this->nextSlabNodes) * sizeof(Slot);
+#ifdef __linux__
+    if (this->useHugePages){
+        slab.bytes = (slab.bytes + HUGE_PAGE_BYTES - 1) / HUGE_PAGE_BYTES * HUGE_PAGE_BYTES;
+        void* memory = mmap(nullptr, slab.bytes, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (memory == MAP_FAILED){
+            memory = mmap(nullptr, slab.bytes, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (memory != MAP_FAILED){
+                madvise(memory, slab.bytes, MADV_HUGEPAGE);
+            }
+        }
+        if (memory != MAP_FAILED){
+            slab.memory = memory;
+            slab.mapped = true;
+        }
+    }
+#endif
+    if (!slab.memory){
+        slab.memory = ::operator new(slab.bytes);
+    }
+    this->slabs.push_back(held);
+    this->cursor = static_cast<Slot*>(slab.memory);
+    this->limit = this->cursor + slab.bytes / sizeof(Slot);
+    if (this->nextSlabNodes < MAX_SLAB_NODES){
+        this->nextSlabNodes *= 2;
+    }
+}
+
+/* ~Slab()
+ * Returns the slab's memory to the system once the last pool lets go of it
+ */
+template <typename T>
+AVLNodePool<T>::Slab::~Slab(){
+#ifdef __linux__
+    if (this->mapped){
+        munmap(this->memory, this->bytes);
         return;
     }
-    vector<AVLNode<T>*> path;
-    AVLNode<T>* temp = this->root;
-    while(true) {
-        path.push_back(temp);
-        if (!(item < temp->data) && !(temp->data < item)){
-            return;
-        }
-        else if (item < temp->data){
+#endif
+    ::operator delete(this->memory);
+}
+
+/* release()
+ * Drops this pool's hold on every slab at once; slabs no other pool holds go
+ * back to the system. Node destructors are not run; the owning tree is
+ * responsible for that before calling release()
+ *  parameters:
+ *
+ *  return value:
+ *
+ */
+template <typename T>
+void AVLNodePool<T>::release(){
+    this->slabs.clear();
+    this->freeList = nullptr;
+    this->cursor = nullptr;
+    this->limit = nullptr;
+    this->nextSlabNodes = MIN_SLAB_NODES;
+}
+
+/* clear()
+ * Removes every node from the tree. When T needs a destructor, the nodes are
+ * destroyed iteratively by rotating each left child up until the node in hand
+ * has none, so no recursion or extra memory is needed even if the tree is
+ * badly out of shape. The pool's slabs are then released in one step; when T
+ * needs no destructor, that release is the only work done
+ *  parameters:
+ *
+ *  return value:
+ *
+ */
+template <typename T, class Compare>
+void AVLTree<T, Compare>::clear(){
+    if (!is_trivially_destructible<T>::value){
+        AVLNode<T>* temp = this->root;
+        while (temp){
             if (temp->left){
-                temp = temp->left;
-            }
-            else {
-                temp->left = new AVLNode<T>(item);
-                path.push_back(temp->left);
-                break;
-            }
-        }
-        else {
-            if(temp->right){
-                temp = temp->right;
+                AVLNode<T>* child = temp->left;
+                temp->left = child->right;
+                child->right = temp;
+                temp = child;
             }
             else {
-                temp->right = new AVLNode<T>(item);
-                path.push_back(temp->right);
-                break;
+                AVLNode<T>* next = temp->right;
+                temp->~AVLNode<T>();
+                temp = next;
             }
         }
     }
-    for (int i = path.size() - 1; i >= 0; i--){
-        if (path.at(i)->right && path.at(i)->left) {
-            path.at(i)->updateHeight();
-        }
-        else if (path.at(i)->right){
-            path.at(i)->height = path.at(i)->right->height + 1;
-        }
-        else if (path.at(i)->left){
-            path.at(i)->height = path.at(i)->left->height + 1;
-        }
-        else {
-            path.at(i)->height = 0;
+    this->pool.release();
+    this->root = nullptr;
+    this->shapeVersion++;
+}
+
+/* bulkLoad(ForwardIterator, ForwardIterator)
+ * Replaces the contents of the AVL Tree with the keys in a sorted range,
+ * skipping keys equal to the one before them
+ *  parameters:
+ *  first, iterator to the smallest key
+ *  last, iterator one past the largest key
+ *
+ *  return value:
+ *
+ */
+template <typename T, class Compare>
+template <class ForwardIterator>
+void AVLTree<T, Compare>::bulkLoad(ForwardIterator first, ForwardIterator last){
+    size_t n = 0;
+    for (ForwardIterator it = first; it != last; ){
+        ForwardIterator prev = it;
+        ++it;
+        while (it != last && !lessThan(*prev, *it)){
+            assert(!lessThan(*it, *prev));
+            ++it;
         }
+        n++;
     }
-    this->rebalancePathToRoot(path);
+    checkSize(n);
+    this->clear();
+    this->pool.reserve(n);
+    this->root = this->buildSorted(first, last, n);
 }
 
-/* rebalancePathToRoot(const vector<AVLNode<T>*>&)
- * Rebalances the AVL Tree along the path from the newly inserted node to the root
- * parameters:
- *   path, vector of pointers to nodes along the path from the newly inserted node to the root
- * return value:
+/* buildSorted(ForwardIterator&, ForwardIterator, size_t)
+ * Builds a balanced subtree from the next n distinct keys of a sorted range.
+ * The left subtree gets (n - 1) / 2 keys and the right subtree the rest, so
+ * their heights never differ by more than one; nodes are allocated in key
+ * order and their balance factors, sizes and parent links are set as they are
+ * built
+ *  parameters:
+ *  first, iterator to the next key; advanced past the keys used
+ *  last, iterator one past the largest key
+ *  n, number of distinct keys to take
  *
+ *  return value:
+ *  Pointer to the root of the new subtree, or nullptr if n is 0
  */
-
-const int HEIGHTMAX = 2;
-template <typename T>
-void AVLTree<T>::rebalancePathToRoot(vector<AVLNode<T>*> const &path){
-    if (!this->root){
-        return;
+template <typename T, class Compare>
+template <class ForwardIterator>
+AVLNode<T>* AVLTree<T, Compare>::buildSorted(ForwardIterator &first, ForwardIterator last, size_t n){
+    if (n == 0){
+        return nullptr;
     }
-    if (this->root->height < HEIGHTMAX){
-        return;
+    size_t leftCount = (n - 1) / 2;
+    AVLNode<T>* left = this->buildSorted(first, last, leftCount);
+    AVLNode<T>* temp = this->pool.allocate(*first);
+    ForwardIterator prev = first;
+    ++first;
+    while (first != last && !lessThan(*prev, *first)){
+        ++first;
     }
-    //i is set to this size because we assume it is always being balanced, so the
-    //last 2 nodes for the path don't need to be checked? could be wrong
-    AVLNode<T>* temp = nullptr;
-    AVLNode<T>* parent = nullptr;
-    for (int i = path.size() - 1; i >= 0; i--){
-        temp = path.at(i);
-        if (i > 0){
-            parent = path.at(i - 1);
-        }
-        else {
-            if (!path.empty()){
-                parent = path.at(0);
-            }
-        }
-        if (temp->height >= HEIGHTMAX){
-            if (temp->right && temp->left){
-                if (abs(temp->right->height - temp->left->height) > 1){
-                    if (temp->right->height > temp->left->height){
-                        if (temp->right->right && temp->right->left){
-                            if (temp->right->right->height >= temp->right->left->height){
-                                if (parent->right == temp){
-                                    parent->right = temp->singleRotateLeft();
-                                }
-                                else if (parent->left == temp){
-                                    parent->left = temp->singleRotateLeft();
-                                }
-                                else {
-                                    this->root = temp->singleRotateLeft();
-                                }
-                            }
-                            else {
-                                if (parent->right == temp){
-                                    parent->right = temp->doubleRotateRightLeft();
-                                }
-                                else if (parent->left == temp){
-                                    parent->left = temp->doubleRotateRightLeft();
-                                }
-                                else {
-                                    this->root = temp->doubleRotateRightLeft();
-                                }
-                            }
-                        }
-                        else if (temp->right->right){
-                            if (parent->right == temp){
-                                parent->right = temp->singleRotateLeft();
-                            }
-                            else if (parent->left == temp){
-                                parent->left = temp->singleRotateLeft();
-                            }
-                            else {
-                                this->root = temp->singleRotateLeft();
-                            }
-                        }
-                        else if (temp->right->left){
-                            if (parent->right == temp){
-                                parent->right = temp->doubleRotateRightLeft();
-                            }
-                            else if (parent->left == temp){
-                                parent->left = temp->doubleRotateRightLeft();
-                            }
-                            else {
-                                this->root = temp->doubleRotateRightLeft();
-                            }
-                        }
-                    }
-                    else {
-                        if (temp->left->right && temp->left->left){
-                            if (temp->left->left->height >= temp->left->right->height){
-                                if (parent->right == temp){
-                                    parent->right = temp->singleRotateRight();
-                                }
-                                else if (parent->left == temp){
-                                    parent->left = temp->singleRotateRight();
-                                }
-                                else {
-                                    this->root = temp->singleRotateRight();
-                                }
-                            }
-                            else {
-                                if (parent->right == temp){
-                                    parent->right = temp->doubleRotateLeftRight();
-                                }
-                                else if (parent->left == temp){
-                                    parent->left = temp->doubleRotateLeftRight();
-                                }
-                                else {
-                                    this->root = temp->doubleRotateLeftRight();
-                                }
-                            }
-                        }
-                        else if(temp->left->left){
-                            if (parent->right == temp){
-                                parent->right = temp->singleRotateRight();
-                            }
-                            else if (parent->left == temp){
-                                parent->left = temp->singleRotateRight();
-                            }
-                            else {
-                                this->root = temp->singleRotateRight();
-                            }
-                        }
-                        else if (temp->left->right){
-                            if (parent->right == temp){
-                                parent->right = temp->doubleRotateLeftRight();
-                            }
-                            else if (parent->left == temp){
-                                parent->left = temp->doubleRotateLeftRight();
-                            }
-                            else {
-                                this->root = temp->doubleRotateLeftRight();
-                            }
-                        }
-                    }
-                }
-            }
-            else if (temp->right){
-                if (temp->right->right && temp->right->left){
-                    if (temp->right->right->height >= temp->right->left->height){
-                        if (parent->right == temp){
-                            parent->right = temp->singleRotateLeft();
-                        }
-                        else if (parent->left == temp){
-                            parent->left = temp->singleRotateLeft();
-                        }
-                        else {
-                            this->root = temp->singleRotateLeft();
-                        }
-                    }
-                    else {
-                        if (parent->right == temp){
-                            parent->right = temp->doubleRotateRightLeft();
-                        }
-                        else if (parent->left == temp){
-                            parent->left = temp->doubleRotateRightLeft();
-                        }
-                        else {
-                            this->root = temp->doubleRotateRightLeft();
-                        }
-                    }
-                }
-                else if (temp->right->right){
-                    if (parent->right == temp){
-                        parent->right = temp->singleRotateLeft();
-                    }
-                    else if (parent->left == temp){
-                        parent->left = temp->singleRotateLeft();
-                    }
-                    else {
-                        this->root = temp->singleRotateLeft();
-                    }
-                }
-                else if (temp->right->left){
-                    if (parent->right == temp){
-                        parent->right = temp->doubleRotateRightLeft();
-                    }
-                    else if (parent->left == temp){
-                        parent->left = temp->doubleRotateRightLeft();
-                    }
-                    else {
-                        this->root = temp->doubleRotateRightLeft();
-                    }
-                }
-            }
-            else if (temp->left){
-                if (temp->left->right && temp->left->left){
-                    if (temp->left->left->height >= temp->left->right->height){
-                        if (parent->right == temp){
-                            parent->right = temp->singleRotateRight();
-                        }
-                        else if (parent->left == temp){
-                            parent->left = temp->singleRotateRight();
-                        }
-                        else {
-                            this->root = temp->singleRotateRight();
-                        }
-                    }
-                    else {
-                        if (parent->right == temp){
-                            parent->right = temp->doubleRotateLeftRight();
-                        }
-                        else if (parent->left == temp){
-                            parent->left = temp->doubleRotateLeftRight();
-                        }
-                        else {
-                            this->root = temp->doubleRotateLeftRight();
-                        }
-                    }
-                }
-                else if(temp->left->left){
-                    if (parent->right == temp){
-                        parent->right = temp->singleRotateRight();
-                    }
-                    else if (parent->left == temp){
-                        parent->left = temp->singleRotateRight();
-                    }
-                    else {
-                        this->root = temp->singleRotateRight();
-                    }
-                }
-                else if (temp->left->right){
-                    if (parent->right == temp){
-                        parent->right = temp->doubleRotateLeftRight();
-                    }
-                    else if (parent->left == temp){
-                        parent->left = temp->doubleRotateLeftRight();
-                    }
-                    else {
-                        this->root = temp->doubleRotateLeftRight();
-                    }
-                }
-            }
-            for (int j = i; j >= 0; j--){
-                if (path.at(j)->right && path.at(j)->left) {
-                    path.at(j)->updateHeight();
-                }
-                else if (path.at(j)->right){
-                    path.at(j)->height = path.at(j)->right->height + 1;
-                }
-                else if (path.at(j)->left){
-                    path.at(j)->height = path.at(j)->left->height + 1;
-                }
-                else {
-                    path.at(j)->height = 0;
-                }
-            }
-        }
+    temp->left = left;
+    temp->right = this->buildSorted(first, last, n - 1 - leftCount);
+    if (temp->left){
+        temp->left->parent = temp;
+    }
+    if (temp->right){
+        temp->right->parent = temp;
     }
+    temp->balance = balancedHeight(n - 1 - leftCount) - balancedHeight(leftCount);
+    temp->updateSize();
+    return temp;
 }
 
-/* remove(const T&)
- * Removes a node with the given item from the AVL Tree
+/* insertBatch(vector<T>, unsigned)
+ * Inserts every key of an unsorted batch into the AVL Tree, using several
+ * threads to sort the batch, to build it into a subtree and to merge that
+ * subtree into the tree. Nodes already in the tree are kept where they are
  *  parameters:
- *  item, value to be removed from the AVL Tree
+ *  batch, keys to be inserted, in any order and possibly repeated
+ *  threads, number of threads to use (0 for one per hardware thread)
  *
  *  return value:
  *
  */
-template <typename T>
-void AVLTree<T>::remove(const T &item){
-    if(!this->root){
-        return;
-    }
-    AVLNode<T>* toRemove = this->root;
-    AVLNode<T>* parent = nullptr;
-    vector<AVLNode<T>*> path;
-    while((toRemove->data < item || item < toRemove->data)
-          && (toRemove->right || toRemove->left)){
-        path.push_back(toRemove);
-        parent = toRemove;
-        if (item < toRemove->data){
-            if (toRemove->left){
-                toRemove = toRemove->left;
-            }
-            else {
-                return;
-            }
+template <typename T, class Compare>
+void AVLTree<T, Compare>::insertBatch(vector<T> batch, unsigned threads){
+    threads = threadCount(threads);
+    sortParallel(batch.begin(), batch.end(), threads);
+    batch.erase(unique(batch.begin(), batch.end(),
+                       [](const T &a, const T &b){ return !lessThan(a, b); }),
+                batch.end());
+    if (this->size() + batch.size() > MAX_SIZE){
+        size_t added = 0;
+        for (size_t i = 0; i < batch.size(); i++){
+            added += !this->contains(batch[i]);
         }
-        else if (toRemove->data < item){
-            if (toRemove->right){
-                toRemove = toRemove->right;
-            }
-            else {
-                return;
-            }
+        checkSize(this->size() + added);
+    }
+    if (this->root && batch.size() * (AVLNode<T>::getHeight(this->root) + 1) < this->size()){
+        for (size_t i = 0; i < batch.size(); i++){
+            this->insert(batch[i]);
         }
+        return;
     }
-    if (toRemove == nullptr) {
+    if (batch.empty()){
         return;
     }
-    int ndx = path.size();
-    bool check = false;
-    if (!(toRemove->data < item) && !(item < toRemove->data)){
-        AVLNode<T>* child = nullptr;
-        if (toRemove->left && toRemove->right){
-            AVLNode<T>* toNull = nullptr;
-            child = toRemove->right;
-            path.push_back(child);
-            while(child->left){
-                toNull = child;
-                child = child->left;
-                path.push_back(child);
-                check = true;
-            }
-            if (check){
-                path.pop_back();
-                if (ndx != path.size()){
-                    path.insert(path.begin() + ndx, child);
-                }
-            }
-            if (toNull){
-                if (child->right){
-                    toNull->left = child->right;
-                }
-                else {
-                    toNull->left = nullptr;
-                }
-            }
-            child->left = toRemove->left;
-            if (child != toRemove->right){
-                child->right = toRemove->right;
-            }
-        }
-        else if (toRemove->left){
-            child = toRemove->left;
-            path.push_back(child);
-        }
-        else if (toRemove->right){
-            child = toRemove->right;
-            path.push_back(child);
-        }
-        toRemove->left = nullptr;
-        toRemove->right = nullptr;
-        if (parent == nullptr){
-            this->root = child;
-        }
-        else if (toRemove == parent->right){
-            parent->right = child;
-        }
-        else if (toRemove == parent->left){
-            parent->left = child;
-        }
-        else {
-            this->root = child;
-        }
-        delete toRemove;
-        for (int j = path.size() - 1; j >= 0; j--) {
-            if (path.at(j)->right && path.at(j)->left) {
-                path.at(j)->updateHeight();
-            }
-            else if (path.at(j)->right){
-                path.at(j)->height = path.at(j)->right->height + 1;
-            }
-            else if (path.at(j)->left){
-                path.at(j)->height = path.at(j)->left->height + 1;
-            }
-            else {
-                path.at(j)->height = 0;
-            }
-        }
+    AVLNode<T>* nodes = this->pool.allocateRun(batch.size());
+    AVLNode<T>* built = buildRun(nodes, batch.data(), batch.size(), threads);
+    this->root = mergeNodes(this->root, built, this->pool, threads);
+    this->root->parent = nullptr;
+    this->shapeVersion++;
+}
+
+/* buildRun(AVLNode<T>*, const T*, size_t, unsigned)
+ * Builds a balanced subtree from n sorted, distinct keys, constructing the
+ * node for keys[i] in the storage at nodes + i. The split is the same as in
+ * buildSorted(); the two halves of a large enough subtree are built at the
+ * same time, sharing out the available threads
+ *  parameters:
+ *  nodes, uninitialized storage for n nodes
+ *  keys, sorted keys with no repeats
+ *  n, number of keys
+ *  threads, number of threads this subtree may use
+ *
+ *  return value:
+ *  Pointer to the root of the new subtree, or nullptr if n is 0
+ */
+template <typename T, class Compare>
+AVLNode<T>* AVLTree<T, Compare>::buildRun(AVLNode<T> *nodes, const T *keys, size_t n, unsigned threads){
+    if (n == 0){
+        return nullptr;
+    }
+    size_t leftCount = (n - 1) / 2;
+    AVLNode<T>* left = nullptr;
+    AVLNode<T>* right = nullptr;
+    if (threads > 1 && n >= PARALLEL_CUTOFF){
+        thread worker([&](){ left = buildRun(nodes, keys, leftCount, threads / 2); });
+        right = buildRun(nodes + leftCount + 1, keys + leftCount + 1, n - 1 - leftCount,
+                         threads - threads / 2);
+        worker.join();
     }
     else {
-        return;
+        left = buildRun(nodes, keys, leftCount, 1);
+        right = buildRun(nodes + leftCount + 1, keys + leftCount + 1, n - 1 - leftCount, 1);
+    }
+    AVLNode<T>* temp = new (nodes + leftCount) AVLNode<T>(keys[leftCount], left, right);
+    if (left){
+        left->parent = temp;
+    }
+    if (right){
+        right->parent = temp;
     }
-    this->rebalancePathToRoot(path);
+    temp->balance = balancedHeight(n - 1 - leftCount) - balancedHeight(leftCount);
+    return temp;
 }
 
+/* sortParallel(RandomAccessIterator, RandomAccessIterator, unsigned)
+ * Sorts a range by sorting its two halves at the same time and merging them
+ *  parameters:
+ *  first, iterator to the start of the range
+ *  last, iterator one past the end of the range
+ *  threads, number of threads the sort may use
+ *
+ *  return value:
+ *
+ */
+template <typename T, class Compare>
+template <class RandomAccessIterator>
+void AVLTree<T, Compare>::sortParallel(RandomAccessIterator first, RandomAccessIterator last,
+                              unsigned threads){
+    if (threads <= 1 || static_cast<size_t>(last - first) < 2 * PARALLEL_CUTOFF){
+        sort(first, last, Compare());
+        return;
+    }
+    RandomAccessIterator middle = first + (last - first) / 2;
+    thread worker([=](){ sortParallel(first, middle, threads / 2); });
+    sortParallel(middle, last, threads - threads / 2);
+    worker.join();
+    inplace_merge(first, middle, last, Compare());
+}
 
+/* threadCount(unsigned)
+ * Picks the number of threads to use for a parallel operation
+ *  parameters:
+ *  threads, number requested (0 for one per hardware thread)
+ *
+ *  return value:
+ *  Number of threads to use, at least 1
+ */
+template <typename T, class Compare>
+unsigned AVLTree<T, Compare>::threadCount(unsigned threads){
+    if (threads == 0){
+        threads = thread::hardware_concurrency();
+    }
+    return threads == 0 ? 1 : threads;
+}
 
-/* printLevelOrder(ostream&, string) const
- * Prints the data of the AVLNode and its children in level order traversal, uses BFS
+/* unionWith(const AVLTree<T, Compare>&, unsigned)
+ * Adds every key of another tree to this AVL Tree
  *  parameters:
- *  os, ostream reference for output
+ *  other, tree whose keys are added; it is not changed
+ *  threads, number of threads to use (0 for one per hardware thread)
  *
  *  return value:
  *
  */
-const int countMAX = 19;
-template <typename T>
-void AVLTree<T>::printLevelOrder(ostream &os) const{
-    int count = 0, count2 = 0;
-    queue<AVLNode<T>*> queue, queue2;
-    if (!this->root){
-        os << "NULL" << endl;
+template <typename T, class Compare>
+void AVLTree<T, Compare>::unionWith(const AVLTree<T, Compare> &other, unsigned threads){
+    if (&other == this){
         return;
     }
-    AVLNode<T>* temp = this->root;
-    queue.push(temp);
-    queue2.push(temp);
-    while (!queue.empty()){
-        if (temp->left){
-            queue.push(temp->left);
-            queue2.push(temp->left);
-        }
-        else {
-            queue.push(nullptr);
-            queue2.push(nullptr);
-            count2++;
-        }
-        if (temp->right) {
-            queue.push(temp->right);
-            queue2.push(temp->right);
-        }
-        else {
-            queue.push(nullptr);
-            queue2.push(nullptr);
-            count2++;
-        }
-        queue.pop();
-        if (!queue.empty()){
-            temp = queue.front();
-            while (!temp){
-                queue.pop();
-                temp = queue.front();
-                if (queue.empty()){
-                    break;
-                }
-            }
+    if (this->size() + other.size() > MAX_SIZE){
+        size_t added = 0;
+        for (const_iterator it = other.begin(); it != other.end(); ++it){
+            added += !this->contains(*it);
         }
+        checkSize(this->size() + added);
     }
-    while (!queue2.empty() && count2 > 0){
-        temp = queue2.front();
-        if (temp){
-            os << queue2.front()->getData();
-            if (count < countMAX){
-                os << " ";
-            }
-        }
-        else {
-            os << "NULL";
-            count2--;
-            if (count2 > 0 && count < countMAX){
-                os << " ";
-            }
-        }
-        count++;
-        if (count > countMAX){
-            os << endl;
-            count = 0;
-        }
-        queue2.pop();
+    this->root = unionNodes(this->root, other.root, this->pool, threadCount(threads));
+    this->shapeVersion++;
+    if (this->root){
+        this->root->parent = nullptr;
     }
-    os << endl;
-    return;
 }
 
-
-/* printPreorder(ostream&, string) const
- * Prints the data of the BSTNode and its children in preorder traversal
+/* intersectWith(const AVLTree<T, Compare>&, unsigned)
+ * Removes every key from this AVL Tree that is not also in another tree
  *  parameters:
- *  os, ostream reference for output
- *  indent, string for indentation in the output
+ *  other, tree whose keys are kept; it is not changed
+ *  threads, number of threads to use (0 for one per hardware thread)
  *
  *  return value:
  *
  */
-template <typename T>
-void AVLNode<T>::printPreorder(ostream &os, string indent) const{
-    os << indent << this->data << endl;
-    indent += "  ";
-    if (this->left){
-        this->left->printPreorder(os, indent);
-    }
-    else {
-        os << indent << "NULL" << endl;
-    }
-    if (this->right){
-        this->right->printPreorder(os, indent);
+template <typename T, class Compare>
+void AVLTree<T, Compare>::intersectWith(const AVLTree<T, Compare> &other, unsigned threads){
+    if (&other == this){
+        return;
     }
-    else {
-        os << indent << "NULL" << endl;
+    this->root = intersectNodes(this->root, other.root, this->pool, threadCount(threads));
+    this->shapeVersion++;
+    if (this->root){
+        this->root->parent = nullptr;
     }
-    return;
 }
 
-/* encrypt(const T&) const
- * Encrypts the given item and returns its code path
+/* differenceWith(const AVLTree<T, Compare>&, unsigned)
+ * Removes every key from this AVL Tree that is also in another tree
  *  parameters:
- *      item - value to be encrypted
+ *  other, tree whose keys are removed; it is not changed
+ *  threads, number of threads to use (0 for one per hardware thread)
  *
  *  return value:
- *  Encrypted code path as a string
- *  Returns '?' if item is not in tree
+ *
  */
-template <typename T>
-string EncryptionTree<T>::encrypt(const T &item) const{
-    if (!this->root){
+template <typename T, class Compare>
+void AVLTree<T, Compare>::differenceWith(const AVLTree<T, Compare> &other, unsigned threads){
+    if (&other == this){
+        this->clear();
+        return;
+    }
+    this->root = differenceNodes(this->root, other.root, this->pool, threadCount(threads));
+    this->shapeVersion++;
+    if (this->root){
+        this->root->parent = nullptr;
+    }
+}
+
+/* split(const T&, AVLTree<T, Compare>&)
+ * Moves every key greater than item into another tree, which is emptied
+ * first, and removes item itself. The moved nodes stay where they are in
+ * memory, and the other tree shares the slabs holding them
+ *  parameters:
+ *  item, key to split at
+ *  right, tree that receives the keys greater than item
+ *
+ *  return value:
+ *  true if item was in the tree (and has been removed), false otherwise
+ */
+template <typename T, class Compare>
+bool AVLTree<T, Compare>::split(const T &item, AVLTree<T, Compare> &right){
+    assert(&right != this);
+    right.clear();
+    AVLNode<T> *l, *r;
+    AVLNode<T>* found = splitNode(this->root, item, l, r);
+    this->root = l;
+    right.root = r;
+    this->shapeVersion++;
+    right.shapeVersion++;
+    if (l){
+        l->parent = nullptr;
+    }
+    if (r){
+        r->parent = nullptr;
+        right.pool.share(this->pool);
+    }
+    if (found){
+        this->pool.deallocate(found);
+    }
+    return found != nullptr;
+}
+
+/* join(const T&, AVLTree<T, Compare>&)
+ * Adds item and every key of another tree to this AVL Tree, leaving the other
+ * tree empty. Every key in this tree must be less than item, and every key
+ * in right greater than item
+ *  parameters:
+ *  item, key that goes between the two trees
+ *  right, tree of keys greater than item
+ *
+ *  return value:
+ *
+ */
+template <typename T, class Compare>
+void AVLTree<T, Compare>::join(const T &item, AVLTree<T, Compare> &right){
+    assert(&right != this);
+    assert(!this->root || lessThan(this->root->maxNode()->data, item));
+    assert(!right.root || lessThan(item, right.root->minNode()->data));
+    checkSize(this->size() + right.size() + 1);
+    AVLNode<T>* middle = this->pool.allocate(item);
+    this->root = joinNodes(this->root, middle, right.root);
+    this->root->parent = nullptr;
+    this->pool.splice(right.pool);
+    right.root = nullptr;
+    this->shapeVersion++;
+    right.shapeVersion++;
+}
+
+/* eraseRange(const T&, const T&)
+ * Removes every key between lo and hi, inclusive, from the AVL Tree
+ *  parameters:
+ *  lo, smallest value to be removed
+ *  hi, largest value to be removed
+ *
+ *  return value:
+ *
+ */
+template <typename T, class Compare>
+void AVLTree<T, Compare>::eraseRange(const T &lo, const T &hi){
+    if (lessThan(hi, lo)){
+        return;
+    }
+    AVLNode<T> *l, *rest, *middle, *r;
+    AVLNode<T>* found = splitNode(this->root, lo, l, rest);
+    if (found){
+        this->pool.deallocate(found);
+    }
+    found = splitNode(rest, hi, middle, r);
+    if (found){
+        this->pool.deallocate(found);
+    }
+    destroyNodes(middle, this->pool);
+    this->root = concatNodes(l, r);
+    this->shapeVersion++;
+    if (this->root){
+        this->root->parent = nullptr;
+    }
+}
+
+/* balancedHeight(size_t)
+ * Gives the height of a subtree of n nodes built by buildSorted() or
+ * buildRun(), which is floor(log2 n) since every level but the last is full
+ *  parameters:
+ *  n, number of nodes in the subtree
+ *
+ *  return value:
+ *  The height of the subtree, or -1 if n is 0
+ */
+template <typename T, class Compare>
+int AVLTree<T, Compare>::balancedHeight(size_t n){
+    int h = -1;
+    for (; n > 0; n >>= 1){
+        h++;
+    }
+    return h;
+}
+
+/* checkSize(size_t)
+ * Refuses a change that would leave a tree with more keys than the 30-bit
+ * node sizes can count
+ *  parameters:
+ *  n, number of keys the tree would hold
+ *
+ *  return value:
+ *  none; throws length_error if n is more than MAX_SIZE
+ */
+template <typename T, class Compare>
+void AVLTree<T, Compare>::checkSize(size_t n){
+    if (n > MAX_SIZE){
+        throw length_error("AVLTree: more than MAX_SIZE keys");
+    }
+}
+
+/* link(AVLNode<T>*, AVLNode<T>*, AVLNode<T>*, int)
+ * Makes l and r the children of k and sets k's balance factor and size
+ *  parameters:
+ *  l, new left subtree of k
+ *  k, node to link under
+ *  r, new right subtree of k
+ *  balance, height of r minus height of l (-1, 0 or 1)
+ *
+ *  return value:
+ *  k
+ */
+template <typename T, class Compare>
+AVLNode<T>* AVLTree<T, Compare>::link(AVLNode<T> *l, AVLNode<T> *k, AVLNode<T> *r, int balance){
+    assert(balance >= -1 && balance <= 1);
+    k->left = l;
+    k->right = r;
+    if (l){
+        l->parent = k;
+    }
+    if (r){
+        r->parent = k;
+    }
+    k->balance = balance;
+    k->updateSize();
+    return k;
+}
+
+/* joinNodes(AVLNode<T>*, AVLNode<T>*, AVLNode<T>*)
+ * Joins two AVL subtrees and a middle node into one AVL subtree. Every key in
+ * l must be less than k's key, and every key in r greater. Heights are not
+ * stored, so both are measured first, which costs O(log n)
+ *  parameters:
+ *  l, subtree of smaller keys
+ *  k, detached node holding the middle key
+ *  r, subtree of larger keys
+ *
+ *  return value:
+ *  Root of the joined subtree; its parent link must be set by the caller
+ */
+template <typename T, class Compare>
+AVLNode<T>* AVLTree<T, Compare>::joinNodes(AVLNode<T> *l, AVLNode<T> *k, AVLNode<T> *r){
+    int h;
+    return joinNodes(l, AVLNode<T>::getHeight(l), k, r, AVLNode<T>::getHeight(r), h);
+}
+
+/* joinNodes(AVLNode<T>*, int, AVLNode<T>*, AVLNode<T>*, int, int&)
+ * Joins as joinNodes() does when the heights of both subtrees are already
+ * known, so the cost is proportional to the difference in heights
+ *  parameters:
+ *  l, subtree of smaller keys
+ *  hl, height of l
+ *  k, detached node holding the middle key
+ *  r, subtree of larger keys
+ *  hr, height of r
+ *  h, set to the height of the joined subtree
+ *
+ *  return value:
+ *  Root of the joined subtree; its parent link must be set by the caller
+ */
+template <typename T, class Compare>
+AVLNode<T>* AVLTree<T, Compare>::joinNodes(AVLNode<T> *l, int hl, AVLNode<T> *k,
+                                  AVLNode<T> *r, int hr, int &h){
+    if (hl > hr + 1){
+        return joinRight(l, hl, k, r, hr, h);
+    }
+    if (hr > hl + 1){
+        return joinLeft(l, hl, k, r, hr, h);
+    }
+    h = 1 + (hl > hr ? hl : hr);
+    return link(l, k, r, hr - hl);
+}
+
+/* joinRight(AVLNode<T>*, int, AVLNode<T>*, AVLNode<T>*, int, int&)
+ * Joins as joinNodes() does when l is the taller subtree, by following the
+ * right spine of l down and rotating on the way back up where needed. The
+ * heights of l's children follow from l's height and balance factor
+ *  parameters:
+ *  l, subtree of smaller keys, more than one level taller than r
+ *  hl, height of l
+ *  k, detached node holding the middle key
+ *  r, subtree of larger keys
+ *  hr, height of r
+ *  h, set to the height of the joined subtree
+ *
+ *  return value:
+ *  Root of the joined subtree
+ */
+template <typename T, class Compare>
+AVLNode<T>* AVLTree<T, Compare>::joinRight(AVLNode<T> *l, int hl, AVLNode<T> *k,
+                                  AVLNode<T> *r, int hr, int &h){
+    AVLNode<T>* c = l->right;
+    int hc = hl - 1 - (l->balance < 0 ? 1 : 0);
+    int hll = hl - 1 - (l->balance > 0 ? 1 : 0);
+    int ht;
+    if (hc <= hr + 1){
+        AVLNode<T>* temp = link(c, k, r, hr - hc);
+        ht = 1 + (hc > hr ? hc : hr);
+        if (ht <= hll + 1){
+            h = 1 + (hll > ht ? hll : ht);
+            return link(l->left, l, temp, ht - hll);
+        }
+        l->right = temp;
+        temp->parent = l;
+        h = ht;
+        return l->doubleRotateRightLeft(2);
+    }
+    AVLNode<T>* temp = joinRight(c, hc, k, r, hr, ht);
+    if (ht <= hll + 1){
+        h = 1 + (hll > ht ? hll : ht);
+        return link(l->left, l, temp, ht - hll);
+    }
+    l->right = temp;
+    temp->parent = l;
+    h = temp->balance > 0 ? ht : ht + 1;
+    return l->singleRotateLeft(2);
+}
+
+/* joinLeft(AVLNode<T>*, int, AVLNode<T>*, AVLNode<T>*, int, int&)
+ * Mirror image of joinRight(), used when r is the taller subtree
+ *  parameters:
+ *  l, subtree of smaller keys
+ *  hl, height of l
+ *  k, detached node holding the middle key
+ *  r, subtree of larger keys, more than one level taller than l
+ *  hr, height of r
+ *  h, set to the height of the joined subtree
+ *
+ *  return value:
+ *  Root of the joined subtree
+ */
+template <typename T, class Compare>
+AVLNode<T>* AVLTree<T, Compare>::joinLeft(AVLNode<T> *l, int hl, AVLNode<T> *k,
+                                 AVLNode<T> *r, int hr, int &h){
+    AVLNode<T>* c = r->left;
+    int hc = hr - 1 - (r->balance > 0 ? 1 : 0);
+    int hrr = hr - 1 - (r->balance < 0 ? 1 : 0);
+    int ht;
+    if (hc <= hl + 1){
+        AVLNode<T>* temp = link(l, k, c, hc - hl);
+        ht = 1 + (hc > hl ? hc : hl);
+        if (ht <= hrr + 1){
+            h = 1 + (hrr > ht ? hrr : ht);
+            return link(temp, r, r->right, hrr - ht);
+        }
+        r->left = temp;
+        temp->parent = r;
+        h = ht;
+        return r->doubleRotateLeftRight(-2);
+    }
+    AVLNode<T>* temp = joinLeft(l, hl, k, c, hc, ht);
+    if (ht <= hrr + 1){
+        h = 1 + (hrr > ht ? hrr : ht);
+        return link(temp, r, r->right, hrr - ht);
+    }
+    r->left = temp;
+    temp->parent = r;
+    h = temp->balance < 0 ? ht : ht + 1;
+    return r->singleRotateRight(-2);
+}
+
+/* concatNodes(AVLNode<T>*, AVLNode<T>*)
+ * Joins two AVL subtrees without a middle node, by detaching the largest
+ * node of l and using it as the middle node
+ *  parameters:
+ *  l, subtree of smaller keys
+ *  r, subtree of larger keys
+ *
+ *  return value:
+ *  Root of the joined subtree
+ */
+template <typename T, class Compare>
+AVLNode<T>* AVLTree<T, Compare>::concatNodes(AVLNode<T> *l, AVLNode<T> *r){
+    if (!l){
+        return r;
+    }
+    AVLNode<T>* last = nullptr;
+    int hRest, h;
+    AVLNode<T>* rest = splitLast(l, AVLNode<T>::getHeight(l), last, hRest);
+    return joinNodes(rest, hRest, last, r, AVLNode<T>::getHeight(r), h);
+}
+
+/* splitLast(AVLNode<T>*, int, AVLNode<T>*&, int&)
+ * Detaches the node with the largest key from an AVL subtree
+ *  parameters:
+ *  t, non-empty subtree
+ *  ht, height of t
+ *  last, set to the detached node
+ *  h, set to the height of what remains
+ *
+ *  return value:
+ *  Root of what remains of the subtree
+ */
+template <typename T, class Compare>
+AVLNode<T>* AVLTree<T, Compare>::splitLast(AVLNode<T> *t, int ht, AVLNode<T> *&last, int &h){
+    int hLeft = ht - 1 - (t->balance > 0 ? 1 : 0);
+    if (!t->right){
+        last = t;
+        h = hLeft;
+        return t->left;
+    }
+    int hRest;
+    AVLNode<T>* rest = splitLast(t->right, ht - 1 - (t->balance < 0 ? 1 : 0), last, hRest);
+    return joinNodes(t->left, hLeft, t, rest, hRest, h);
+}
+
+/* splitNode(AVLNode<T>*, const T&, AVLNode<T>*&, AVLNode<T>*&)
+ * Cuts an AVL subtree into the keys less than item and the keys greater than
+ * item, rejoining the pieces met on the way down
+ *  parameters:
+ *  t, subtree to split
+ *  item, key to split at
+ *  l, set to the subtree of keys less than item
+ *  r, set to the subtree of keys greater than item
+ *
+ *  return value:
+ *  The detached node holding item, or nullptr if item was not in the subtree
+ */
+template <typename T, class Compare>
+AVLNode<T>* AVLTree<T, Compare>::splitNode(AVLNode<T> *t, const T &item, AVLNode<T> *&l, AVLNode<T> *&r){
+    int hl, hr;
+    return splitNode(t, AVLNode<T>::getHeight(t), item, l, hl, r, hr);
+}
+
+/* splitNode(AVLNode<T>*, int, const T&, AVLNode<T>*&, int&, AVLNode<T>*&, int&)
+ * Splits as splitNode() does, given the height of t. The heights of the
+ * children of each node on the way down follow from its balance factor, and
+ * the heights of the pieces are passed back up, so each join on the way back
+ * costs only the difference in heights and the whole split is O(log n)
+ *  parameters:
+ *  t, subtree to split
+ *  ht, height of t
+ *  item, key to split at
+ *  l, set to the subtree of keys less than item
+ *  hl, set to the height of l
+ *  r, set to the subtree of keys greater than item
+ *  hr, set to the height of r
+ *
+ *  return value:
+ *  The detached node holding item, or nullptr if item was not in the subtree
+ */
+template <typename T, class Compare>
+AVLNode<T>* AVLTree<T, Compare>::splitNode(AVLNode<T> *t, int ht, const T &item,
+                                  AVLNode<T> *&l, int &hl, AVLNode<T> *&r, int &hr){
+    if (!t){
+        l = r = nullptr;
+        hl = hr = -1;
+        return nullptr;
+    }
+    int hLeft = ht - 1 - (t->balance > 0 ? 1 : 0);
+    int hRight = ht - 1 - (t->balance < 0 ? 1 : 0);
+    AVLNode<T>* found = nullptr;
+    if (lessThan(item, t->data)){
+        AVLNode<T>* inner = nullptr;
+        int hInner;
+        found = splitNode(t->left, hLeft, item, l, hl, inner, hInner);
+        r = joinNodes(inner, hInner, t, t->right, hRight, hr);
+    }
+    else if (lessThan(t->data, item)){
+        AVLNode<T>* inner = nullptr;
+        int hInner;
+        found = splitNode(t->right, hRight, item, inner, hInner, r, hr);
+        l = joinNodes(t->left, hLeft, t, inner, hInner, hl);
+    }
+    else {
+        l = t->left;
+        r = t->right;
+        hl = hLeft;
+        hr = hRight;
+        found = t;
+    }
+    return found;
+}
+
+/* copyNodes(const AVLNode<T>*, AVLNodePool<T>&)
+ * Copies a subtree of another tree, shape and all
+ *  parameters:
+ *  t, subtree to copy
+ *  nodePool, pool to take the new nodes from
+ *
+ *  return value:
+ *  Root of the copy
+ */
+template <typename T, class Compare>
+AVLNode<T>* AVLTree<T, Compare>::copyNodes(const AVLNode<T> *t, AVLNodePool<T> &nodePool){
+    if (!t){
+        return nullptr;
+    }
+    AVLNode<T>* temp = nodePool.allocate(t->data);
+    return link(copyNodes(t->left, nodePool), temp, copyNodes(t->right, nodePool), t->balance);
+}
+
+/* destroyNodes(AVLNode<T>*, AVLNodePool<T>&)
+ * Frees every node of a subtree, the same way clear() walks the tree
+ *  parameters:
+ *  t, subtree to free
+ *  nodePool, pool to return the nodes to
+ *
+ *  return value:
+ *
+ */
+template <typename T, class Compare>
+void AVLTree<T, Compare>::destroyNodes(AVLNode<T> *t, AVLNodePool<T> &nodePool){
+    while (t){
+        if (t->left){
+            AVLNode<T>* child = t->left;
+            t->left = child->right;
+            child->right = t;
+            t = child;
+        }
+        else {
+            AVLNode<T>* next = t->right;
+            nodePool.deallocate(t);
+            t = next;
+        }
+    }
+}
+
+/* unionNodes(AVLNode<T>*, const AVLNode<T>*, AVLNodePool<T>&, unsigned)
+ * Builds the union of a subtree of this tree and a subtree of another tree.
+ * Keys already in t1 keep their nodes; keys only in t2 get copied nodes
+ *  parameters:
+ *  t1, subtree of this tree; its nodes are reused
+ *  t2, subtree of the other tree; it is not changed
+ *  nodePool, pool to take new nodes from
+ *  threads, number of threads this call may use
+ *
+ *  return value:
+ *  Root of the union
+ */
+template <typename T, class Compare>
+AVLNode<T>* AVLTree<T, Compare>::unionNodes(AVLNode<T> *t1, const AVLNode<T> *t2,
+                                   AVLNodePool<T> &nodePool, unsigned threads){
+    if (!t2){
+        return t1;
+    }
+    if (!t1){
+        return copyNodes(t2, nodePool);
+    }
+    size_t work = static_cast<size_t>(t1->size + t2->size);
+    AVLNode<T> *l1, *r1;
+    AVLNode<T>* middle = splitNode(t1, t2->data, l1, r1);
+    if (!middle){
+        middle = nodePool.allocate(t2->data);
+    }
+    AVLNode<T> *l, *r;
+    if (threads > 1 && work >= PARALLEL_CUTOFF){
+        AVLNodePool<T> leftPool(nodePool.usesHugePages());
+        thread worker([&](){ l = unionNodes(l1, t2->left, leftPool, threads / 2); });
+        r = unionNodes(r1, t2->right, nodePool, threads - threads / 2);
+        worker.join();
+        nodePool.splice(leftPool);
+    }
+    else {
+        l = unionNodes(l1, t2->left, nodePool, 1);
+        r = unionNodes(r1, t2->right, nodePool, 1);
+    }
+    return joinNodes(l, middle, r);
+}
+
+/* mergeNodes(AVLNode<T>*, AVLNode<T>*, AVLNodePool<T>&, unsigned)
+ * Builds the union of two subtrees that both belong to this tree's pool,
+ * reusing the nodes of both. A key in both keeps its node from t1, and the
+ * node from t2 is freed, so no node of t1 is moved or freed
+ *  parameters:
+ *  t1, subtree of this tree; its nodes are reused
+ *  t2, subtree of new nodes; its nodes are reused or freed
+ *  nodePool, pool to return freed nodes to
+ *  threads, number of threads this call may use
+ *
+ *  return value:
+ *  Root of the union
+ */
+template <typename T, class Compare>
+AVLNode<T>* AVLTree<T, Compare>::mergeNodes(AVLNode<T> *t1, AVLNode<T> *t2,
+                                   AVLNodePool<T> &nodePool, unsigned threads){
+    if (!t2){
+        return t1;
+    }
+    if (!t1){
+        return t2;
+    }
+    size_t work = static_cast<size_t>(t1->size + t2->size);
+    AVLNode<T>* l2 = t2->left;
+    AVLNode<T>* r2 = t2->right;
+    AVLNode<T> *l1, *r1;
+    AVLNode<T>* middle = splitNode(t1, t2->data, l1, r1);
+    if (middle){
+        nodePool.deallocate(t2);
+    }
+    else {
+        middle = t2;
+    }
+    AVLNode<T> *l, *r;
+    if (threads > 1 && work >= PARALLEL_CUTOFF){
+        AVLNodePool<T> leftPool(nodePool.usesHugePages());
+        thread worker([&](){ l = mergeNodes(l1, l2, leftPool, threads / 2); });
+        r = mergeNodes(r1, r2, nodePool, threads - threads / 2);
+        worker.join();
+        nodePool.splice(leftPool);
+    }
+    else {
+        l = mergeNodes(l1, l2, nodePool, 1);
+        r = mergeNodes(r1, r2, nodePool, 1);
+    }
+    return joinNodes(l, middle, r);
+}
+
+/* intersectNodes(AVLNode<T>*, const AVLNode<T>*, AVLNodePool<T>&, unsigned)
+ * Builds the intersection of a subtree of this tree and a subtree of another
+ * tree, freeing the nodes of t1 whose keys are not in t2
+ *  parameters:
+ *  t1, subtree of this tree; its nodes are reused or freed
+ *  t2, subtree of the other tree; it is not changed
+ *  nodePool, pool to return freed nodes to
+ *  threads, number of threads this call may use
+ *
+ *  return value:
+ *  Root of the intersection
+ */
+template <typename T, class Compare>
+AVLNode<T>* AVLTree<T, Compare>::intersectNodes(AVLNode<T> *t1, const AVLNode<T> *t2,
+                                       AVLNodePool<T> &nodePool, unsigned threads){
+    if (!t1 || !t2){
+        destroyNodes(t1, nodePool);
+        return nullptr;
+    }
+    size_t work = static_cast<size_t>(t1->size + t2->size);
+    AVLNode<T> *l1, *r1;
+    AVLNode<T>* middle = splitNode(t1, t2->data, l1, r1);
+    AVLNode<T> *l, *r;
+    if (threads > 1 && work >= PARALLEL_CUTOFF){
+        AVLNodePool<T> leftPool(nodePool.usesHugePages());
+        thread worker([&](){ l = intersectNodes(l1, t2->left, leftPool, threads / 2); });
+        r = intersectNodes(r1, t2->right, nodePool, threads - threads / 2);
+        worker.join();
+        nodePool.splice(leftPool);
+    }
+    else {
+        l = intersectNodes(l1, t2->left, nodePool, 1);
+        r = intersectNodes(r1, t2->right, nodePool, 1);
+    }
+    if (middle){
+        return joinNodes(l, middle, r);
+    }
+    return concatNodes(l, r);
+}
+
+/* differenceNodes(AVLNode<T>*, const AVLNode<T>*, AVLNodePool<T>&, unsigned)
+ * Removes the keys of a subtree of another tree from a subtree of this tree
+ *  parameters:
+ *  t1, subtree of this tree; its nodes are reused or freed
+ *  t2, subtree of the other tree; it is not changed
+ *  nodePool, pool to return freed nodes to
+ *  threads, number of threads this call may use
+ *
+ *  return value:
+ *  Root of the difference
+ */
+template <typename T, class Compare>
+AVLNode<T>* AVLTree<T, Compare>::differenceNodes(AVLNode<T> *t1, const AVLNode<T> *t2,
+                                        AVLNodePool<T> &nodePool, unsigned threads){
+    if (!t1 || !t2){
+        return t1;
+    }
+    size_t work = static_cast<size_t>(t1->size + t2->size);
+    AVLNode<T> *l1, *r1;
+    AVLNode<T>* middle = splitNode(t1, t2->data, l1, r1);
+    if (middle){
+        nodePool.deallocate(middle);
+    }
+    AVLNode<T> *l, *r;
+    if (threads > 1 && work >= PARALLEL_CUTOFF){
+        AVLNodePool<T> leftPool(nodePool.usesHugePages());
+        thread worker([&](){ l = differenceNodes(l1, t2->left, leftPool, threads / 2); });
+        r = differenceNodes(r1, t2->right, nodePool, threads - threads / 2);
+        worker.join();
+        nodePool.splice(leftPool);
+    }
+    else {
+        l = differenceNodes(l1, t2->left, nodePool, 1);
+        r = differenceNodes(r1, t2->right, nodePool, 1);
+    }
+    return concatNodes(l, r);
+}
+
+/* minNode() const
+ * Returns a pointer to the node with the minimum value of the given node
+ *  parameters:
+ *
+ *  return value:
+ *  Pointer to the node with the minimum value
+ */
+template <typename T>
+const AVLNode<T>* AVLNode<T>::minNode() const{
+    if (!this->left){
+        return this;
+    }
+    AVLNode* that = this->left;
+    while (that->left){
+        that = that->left;
+    }
+    return that;
+}
+
+/* maxNode() const
+ * Returns a pointer to the node with the maximum value of the given node
+ *  parameters:
+ *
+ *  return value:
+ *  Pointer to the node with the maximum value
+ */
+template <typename T>
+const AVLNode<T>* AVLNode<T>::maxNode() const{
+    if (!this->right){
+        return this;
+    }
+    AVLNode* that = this->right;
+    while (that->right){
+        that = that->right;
+    }
+    return that;
+}
+
+/* successor() const
+ * Returns a pointer to the node that follows this one in key order
+ *  parameters:
+ *
+ *  return value:
+ *  Pointer to the next node, or nullptr if this node holds the largest key
+ */
+template <typename T>
+const AVLNode<T>* AVLNode<T>::successor() const{
+    if (this->right){
+        return this->right->minNode();
+    }
+    const AVLNode* that = this;
+    while (that->parent && that->parent->right == that){
+        that = that->parent;
+    }
+    return that->parent;
+}
+
+/* predecessor() const
+ * Returns a pointer to the node that precedes this one in key order
+ *  parameters:
+ *
+ *  return value:
+ *  Pointer to the previous node, or nullptr if this node holds the smallest key
+ */
+template <typename T>
+const AVLNode<T>* AVLNode<T>::predecessor() const{
+    if (this->left){
+        return this->left->maxNode();
+    }
+    const AVLNode* that = this;
+    while (that->parent && that->parent->left == that){
+        that = that->parent;
+    }
+    return that->parent;
+}
+
+/* verifyBalanceFactors() const
+ * Asserts that every stored balance factor matches the heights of the two
+ * subtrees, counted from the leaves up, and is within the AVL limit
+ *  parameters:
+ *
+ *  return value:
+ *  The height of the subtree rooted at this node
+ */
+template <typename T>
+int AVLNode<T>::verifyBalanceFactors() const{
+    int hl = this->left ? this->left->verifyBalanceFactors() : -1;
+    int hr = this->right ? this->right->verifyBalanceFactors() : -1;
+    assert(this->balance == hr - hl);
+    assert(this->size == (unsigned)(getSize(this->left) + getSize(this->right) + 1));
+    return (hl > hr ? hl : hr) + 1;
+}
+
+/* singleRotateLeft(int)
+ * Performs a single rotation to the left on the AVL Node. With x this node,
+ * z its right child and b the balance factors, x' = x - 1 - max(z, 0) and
+ * z' = z - 1 + min(x', 0), since x loses z and its taller side to z
+ * parameters:
+ *   b, this node's balance factor as it is now (may be 2)
+ *
+ * return value:
+ *   Pointer to the node that becomes the new "root" after rotation
+ */
+template <typename T>
+AVLNode<T>* AVLNode<T>::singleRotateLeft(int b){
+    if (!this->right){
+        return this;
+    }
+    AVLNode* temp = this->right;
+    this->right = temp->left;
+    if (this->right){
+        this->right->parent = this;
+    }
+    temp->left = this;
+    temp->parent = this->parent;
+    this->parent = temp;
+    int tb = temp->balance;
+    int nb = b - 1 - (tb > 0 ? tb : 0);
+    this->balance = nb;
+    temp->balance = tb - 1 + (nb < 0 ? nb : 0);
+    this->updateSize();
+    temp->updateSize();
+    return temp;
+}
+
+/* singleRotateRight(int)
+ * Performs a single rotation to the right on the AVL Node; the mirror image
+ * of singleRotateLeft(), so x' = x + 1 - min(z, 0) and z' = z + 1 + max(x', 0)
+ * parameters:
+ *   b, this node's balance factor as it is now (may be -2)
+ *
+ * return value:
+ *   Pointer to the node that becomes the new "root" after rotation
+ */
+template <typename T>
+AVLNode<T>* AVLNode<T>::singleRotateRight(int b){
+    if (!this->left){
+        return this;
+    }
+    AVLNode* temp = this->left;
+    this->left = temp->right;
+    if (this->left){
+        this->left->parent = this;
+    }
+    temp->right = this;
+    temp->parent = this->parent;
+    this->parent = temp;
+    int tb = temp->balance;
+    int nb = b + 1 - (tb < 0 ? tb : 0);
+    this->balance = nb;
+    temp->balance = tb + 1 + (nb > 0 ? nb : 0);
+    this->updateSize();
+    temp->updateSize();
+    return temp;
+}
+
+/* doubleRotateLeftRight(int)
+ * Performs a double rotation (left-right) on the AVL Node, left rotation on
+ * its left child, and right rotation on "root" location. The two single
+ * rotations are done in one step, since between them the grandchild could
+ * lean by 2; its old balance factor decides the new ones
+ * parameters:
+ *   b, this node's balance factor as it is now (must be -2, with the left
+ *      child's 1)
+ *
+ * return value:
+ *   pointer to the node that becomes the new "root" after rotation
+ */
+template <typename T>
+AVLNode<T>* AVLNode<T>::doubleRotateLeftRight(int b){
+    AVLNode* child = this->left;
+    AVLNode* temp = child->right;
+    assert(b == -2 && child->balance == 1);
+    int tb = temp->balance;
+    child->right = temp->left;
+    if (child->right){
+        child->right->parent = child;
+    }
+    this->left = temp->right;
+    if (this->left){
+        this->left->parent = this;
+    }
+    temp->left = child;
+    temp->right = this;
+    temp->parent = this->parent;
+    child->parent = temp;
+    this->parent = temp;
+    child->balance = tb > 0 ? -1 : 0;
+    this->balance = tb < 0 ? 1 : 0;
+    temp->balance = 0;
+    child->updateSize();
+    this->updateSize();
+    temp->updateSize();
+    return temp;
+}
+
+/* doubleRotateRightLeft(int)
+ * Performs a double rotation (right-left) on the AVL Node, right rotation on
+ * its right child, and left rotation on "root" location; the mirror image of
+ * doubleRotateLeftRight()
+ * parameters:
+ *   b, this node's balance factor as it is now (must be 2, with the right
+ *      child's -1)
+ *
+ * return value:
+ *   pointer to the node that becomes the new "root" after rotation
+ */
+template <typename T>
+AVLNode<T>* AVLNode<T>::doubleRotateRightLeft(int b){
+    AVLNode* child = this->right;
+    AVLNode* temp = child->left;
+    assert(b == 2 && child->balance == -1);
+    int tb = temp->balance;
+    child->left = temp->right;
+    if (child->left){
+        child->left->parent = child;
+    }
+    this->right = temp->left;
+    if (this->right){
+        this->right->parent = this;
+    }
+    temp->right = child;
+    temp->left = this;
+    temp->parent = this->parent;
+    child->parent = temp;
+    this->parent = temp;
+    child->balance = tb < 0 ? 1 : 0;
+    this->balance = tb > 0 ? -1 : 0;
+    temp->balance = 0;
+    child->updateSize();
+    this->updateSize();
+    temp->updateSize();
+    return temp;
+}
+
+/* insert(const T&)
+ * Inserts a new node with the given item into the AVL Tree
+ *  parameters:
+ *  item, value to be inserted into the AVL Tree
+ *
+ *  return value:
+ *  Pair of an iterator to the node holding item, which stays valid until item
+ *  is removed, and true if the node is new (false if item was already there)
+ */
+template <typename T, class Compare>
+pair<typename AVLTree<T, Compare>::const_iterator, bool> AVLTree<T, Compare>::insert(const T &item){
+    if (!this->root){
+        this->root = this->pool.allocate(item);
+        this->shapeVersion++;
+        return make_pair(const_iterator(this->root, this), true);
+    }
+    AVLNode<T>* path[MAX_HEIGHT];
+    int length = 0;
+    AVLNode<T>* temp = this->root;
+    AVLNode<T>* added = nullptr;
+    KeyPrefix<T> key = prefixOf(item);
+    while (!added){
+        path[length++] = temp;
+        int order = AVLTree::order(item, key, temp);
+        if (order < 0){
+            if (!temp->left){
+                checkSize(this->size() + 1);
+                added = temp->left = this->pool.allocate(item);
+            }
+            temp = temp->left;
+        }
+        else if (order > 0){
+            if (!temp->right){
+                checkSize(this->size() + 1);
+                added = temp->right = this->pool.allocate(item);
+            }
+            temp = temp->right;
+        }
+        else {
+            return make_pair(const_iterator(temp, this), false);
+        }
+    }
+    added->parent = path[length - 1];
+    this->rebalancePathToRoot(path, length, path[length - 1]->left == added, true);
+    return make_pair(const_iterator(added, this), true);
+}
+
+/* verifySearchOrder(false_type) const
+ * Asserts that the keys are in increasing order under Compare, for a tree
+ * whose Compare is not operator< (AVLNode::verifySearchOrder() uses
+ * operator<). The in-order walk visits every key once, so this is O(n)
+ *  parameters:
+ *
+ *  return value:
+ *
+ */
+template <typename T, class Compare>
+void AVLTree<T, Compare>::verifySearchOrder(false_type) const{
+    const_iterator prev = this->end();
+    for (const_iterator it = this->begin(); it != this->end(); prev = it++){
+        assert(prev == this->end() || lessThan(*prev, *it));
+    }
+}
+
+/* findNode(const Key&) const
+ * Searches the AVL Tree for the given item, for find() and contains()
+ *  parameters:
+ *  item, value to be searched for; a T, or with a transparent Compare any
+ *        key Compare can compare with a T
+ *
+ *  return value:
+ *  Pointer to the node holding item, or nullptr if item is not in the tree
+ */
+template <typename T, class Compare>
+template <class Key>
+const AVLNode<T>* AVLTree<T, Compare>::findNode(const Key &item) const{
+    const AVLNode<T>* temp = this->root;
+    KeyPrefix<T> key = prefixOf(item);
+    while (temp){
+        int order = AVLTree::order(item, key, temp);
+        if (order < 0){
+            temp = temp->left;
+        }
+        else if (order > 0){
+            temp = temp->right;
+        }
+        else {
+            break;
+        }
+    }
+    return temp;
+}
+
+/* lowerBound(const T&) const
+ * Finds the first key in the AVL Tree that is not less than the given item
+ *  parameters:
+ *  item, value to be searched for
+ *
+ *  return value:
+ *  Iterator to the first node whose data is not less than item, or end()
+ */
+template <typename T, class Compare>
+typename AVLTree<T, Compare>::const_iterator AVLTree<T, Compare>::lowerBound(const T &item) const{
+    const AVLNode<T>* temp = this->root;
+    const AVLNode<T>* found = nullptr;
+    while (temp){
+        if (lessThan(temp->data, item)){
+            temp = temp->right;
+        }
+        else {
+            found = temp;
+            temp = temp->left;
+        }
+    }
+    return const_iterator(found, this);
+}
+
+/* upperBound(const T&) const
+ * Finds the first key in the AVL Tree that is greater than the given item
+ *  parameters:
+ *  item, value to be searched for
+ *
+ *  return value:
+ *  Iterator to the first node whose data is greater than item, or end()
+ */
+template <typename T, class Compare>
+typename AVLTree<T, Compare>::const_iterator AVLTree<T, Compare>::upperBound(const T &item) const{
+    const AVLNode<T>* temp = this->root;
+    const AVLNode<T>* found = nullptr;
+    while (temp){
+        if (lessThan(item, temp->data)){
+            found = temp;
+            temp = temp->left;
+        }
+        else {
+            temp = temp->right;
+        }
+    }
+    return const_iterator(found, this);
+}
+
+/* countInRange(const T&, const T&) const
+ * Counts the keys in the AVL Tree between lo and hi, inclusive
+ *  parameters:
+ *  lo, smallest value in the range
+ *  hi, largest value in the range
+ *
+ *  return value:
+ *  Number of keys k with lo <= k <= hi
+ */
+template <typename T, class Compare>
+size_t AVLTree<T, Compare>::countInRange(const T &lo, const T &hi) const{
+    if (lessThan(hi, lo)){
+        return 0;
+    }
+    size_t count = this->rank(hi) - this->rank(lo);
+    if (this->find(hi) != this->end()){
+        count++;
+    }
+    return count;
+}
+
+/* select(size_t) const
+ * Finds the key of the given rank using the subtree sizes
+ *  parameters:
+ *  k, rank of the key to find (0 for the smallest key)
+ *
+ *  return value:
+ *  Iterator to the node holding the k-th smallest key, or end() if k >= size()
+ */
+template <typename T, class Compare>
+typename AVLTree<T, Compare>::const_iterator AVLTree<T, Compare>::select(size_t k) const{
+    const AVLNode<T>* temp = this->root;
+    while (temp){
+        size_t leftSize = AVLNode<T>::getSize(temp->left);
+        if (k < leftSize){
+            temp = temp->left;
+        }
+        else if (k > leftSize){
+            k -= leftSize + 1;
+            temp = temp->right;
+        }
+        else {
+            break;
+        }
+    }
+    return const_iterator(temp, this);
+}
+
+/* rank(const T&) const
+ * Counts the keys in the AVL Tree that are less than the given item
+ *  parameters:
+ *  item, value to be ranked (need not be in the tree)
+ *
+ *  return value:
+ *  Number of keys less than item, which is item's rank if it is in the tree
+ */
+template <typename T, class Compare>
+size_t AVLTree<T, Compare>::rank(const T &item) const{
+    size_t count = 0;
+    const AVLNode<T>* temp = this->root;
+    while (temp){
+        if (lessThan(temp->data, item)){
+            count += AVLNode<T>::getSize(temp->left) + 1;
+            temp = temp->right;
+        }
+        else {
+            temp = temp->left;
+        }
+    }
+    return count;
+}
+
+/* forEachInRange(const T&, const T&, Function) const
+ * Calls fn on each key in the AVL Tree between lo and hi, inclusive, in order
+ *  parameters:
+ *  lo, smallest value in the range
+ *  hi, largest value in the range
+ *  fn, callable taking a const T&
+ *
+ *  return value:
+ *
+ */
+template <typename T, class Compare>
+template <class Function>
+void AVLTree<T, Compare>::forEachInRange(const T &lo, const T &hi, Function fn) const{
+    for (const_iterator it = this->lowerBound(lo); it != this->end() && !lessThan(hi, *it); ++it){
+        fn(*it);
+    }
+}
+
+/* rebalancePathToRoot(AVLNode<T>* const*, int, bool, bool)
+ * Retraces the path from the deepest changed node back toward the root. Each
+ * node's balance factor moves one step for the side whose height changed; a
+ * node that would lean by 2 is rotated instead and its parent relinked. The
+ * walk stops at the first subtree whose height is the same as before the
+ * change, since nothing above it can have changed either. After an insert that
+ * is a node that comes out even, or the first rotation; after a remove it is a
+ * node that was even, or a rotation around an even child. The ancestors above
+ * that point still have their sizes refreshed. Every insert and remove passes
+ * through here, so this is also where shapeVersion moves on.
+ * parameters:
+ *   path, nodes from the root (path[0]) down to the deepest node whose child
+ *         changed; balance factors on the path must still be the pre-change
+ *         values
+ *   length, number of nodes in path
+ *   fromLeft, true if the left subtree of path[length - 1] changed height,
+ *             false if the right one did
+ *   grew, true if that subtree got one taller, false if it got one shorter
+ * return value:
+ *
+ */
+template <typename T, class Compare>
+void AVLTree<T, Compare>::rebalancePathToRoot(AVLNode<T>* const *path, int length, bool fromLeft,
+                                     bool grew){
+    this->shapeVersion++;
+    for (int i = length - 1; i >= 0; i--){
+        AVLNode<T>* temp = path[i];
+        bool parentFromLeft = i > 0 && path[i - 1]->left == temp;
+        int balance = temp->balance + (fromLeft == grew ? -1 : 1);
+        AVLNode<T>* subRoot = temp;
+        bool changed;
+        if (balance > 1){
+            int childBalance = temp->right->balance;
+            if (childBalance >= 0){
+                subRoot = temp->singleRotateLeft(balance);
+            }
+            else {
+                subRoot = temp->doubleRotateRightLeft(balance);
+            }
+            changed = !grew && childBalance != 0;
+        }
+        else if (balance < -1){
+            int childBalance = temp->left->balance;
+            if (childBalance <= 0){
+                subRoot = temp->singleRotateRight(balance);
+            }
+            else {
+                subRoot = temp->doubleRotateLeftRight(balance);
+            }
+            changed = !grew && childBalance != 0;
+        }
+        else {
+            temp->balance = balance;
+            temp->updateSize();
+            changed = grew ? balance != 0 : balance == 0;
+        }
+        if (subRoot != temp){
+            if (i == 0){
+                this->root = subRoot;
+            }
+            else if (parentFromLeft){
+                path[i - 1]->left = subRoot;
+            }
+            else {
+                path[i - 1]->right = subRoot;
+            }
+        }
+        if (!changed){
+            for (i--; i >= 0; i--){
+                path[i]->updateSize();
+            }
+            return;
+        }
+        fromLeft = parentFromLeft;
+    }
+}
+
+/* removeKey(const Key&)
+ * Removes a node with the given item from the AVL Tree, for remove()
+ *  parameters:
+ *  item, value to be removed from the AVL Tree; a T, or with a transparent
+ *        Compare any key Compare can compare with a T
+ *
+ *  return value:
+ *
+ */
+template <typename T, class Compare>
+template <class Key>
+void AVLTree<T, Compare>::removeKey(const Key &item){
+    AVLNode<T>* path[MAX_HEIGHT];
+    int length = 0;
+    AVLNode<T>* toRemove = this->root;
+    KeyPrefix<T> key = prefixOf(item);
+    while (toRemove){
+        int order = AVLTree::order(item, key, toRemove);
+        if (order < 0){
+            path[length++] = toRemove;
+            toRemove = toRemove->left;
+        }
+        else if (order > 0){
+            path[length++] = toRemove;
+            toRemove = toRemove->right;
+        }
+        else {
+            break;
+        }
+    }
+    if (toRemove){
+        this->removeNode(toRemove, path, length);
+    }
+}
+
+/* erase(const_iterator)
+ * Removes the node an iterator refers to. The path to the root is recovered
+ * from parent links, so no key comparisons are made
+ *  parameters:
+ *  position, valid dereferenceable iterator into this tree (e.g. from insert)
+ *
+ *  return value:
+ *  Iterator to the node that followed the removed one, or end()
+ */
+template <typename T, class Compare>
+typename AVLTree<T, Compare>::const_iterator AVLTree<T, Compare>::erase(const_iterator position){
+    AVLNode<T>* toRemove = const_cast<AVLNode<T>*>(position.node);
+    const_iterator next(toRemove->successor(), this);
+    AVLNode<T>* path[MAX_HEIGHT];
+    int length = 0;
+    for (AVLNode<T>* temp = toRemove->parent; temp; temp = temp->parent){
+        length++;
+    }
+    int ndx = length;
+    for (AVLNode<T>* temp = toRemove->parent; temp; temp = temp->parent){
+        path[--ndx] = temp;
+    }
+    this->removeNode(toRemove, path, length);
+    return next;
+}
+
+/* removeNode(AVLNode<T>*, AVLNode<T>**, int)
+ * Unlinks and frees a node, then rebalances. A node with two children is
+ * replaced by its in-order successor node, which takes over the removed
+ * node's place (and, for retracing, its old balance factor), so no other node's data
+ * moves and iterators to other nodes stay valid
+ *  parameters:
+ *  toRemove, node to be removed
+ *  path, nodes from the root down to toRemove's parent (extended here)
+ *  length, number of nodes in path
+ *
+ *  return value:
+ *
+ */
+template <typename T, class Compare>
+void AVLTree<T, Compare>::removeNode(AVLNode<T> *toRemove, AVLNode<T> **path, int length){
+    AVLNode<T>* parent = toRemove->parent;
+    AVLNode<T>* child = nullptr;
+    bool fromLeft = parent && parent->left == toRemove;
+    if (toRemove->left && toRemove->right){
+        int ndx = length++;
+        AVLNode<T>* childParent = toRemove;
+        child = toRemove->right;
+        while (child->left){
+            path[length++] = child;
+            childParent = child;
+            child = child->left;
+        }
+        if (childParent != toRemove){
+            childParent->left = child->right;
+            if (child->right){
+                child->right->parent = childParent;
+            }
+            child->right = toRemove->right;
+            child->right->parent = child;
+        }
+        child->left = toRemove->left;
+        child->left->parent = child;
+        child->balance = toRemove->balance;
+        path[ndx] = child;
+        fromLeft = childParent != toRemove;
+    }
+    else if (toRemove->left){
+        child = toRemove->left;
+    }
+    else {
+        child = toRemove->right;
+    }
+    if (child){
+        child->parent = parent;
+    }
+    if (!parent){
+        this->root = child;
+    }
+    else if (parent->left == toRemove){
+        parent->left = child;
+    }
+    else {
+        parent->right = child;
+    }
+    this->pool.deallocate(toRemove);
+    this->rebalancePathToRoot(path, length, fromLeft, false);
+}
+
+
+
+/* printLevelOrder(ostream&) const
+ * Prints the data of the AVLNodes in level order, 20 to a line, with a NULL
+ * for each missing child. One pass over a queue of the real nodes: each node
+ * taken off the queue prints its two children (or NULLs) and queues the real
+ * ones, so no NULL is ever stored. The text is gathered in blocks of
+ * PRINT_BLOCK bytes before it is written to os
+ *  parameters:
+ *  os, ostream reference for output
+ *
+ *  return value:
+ *
+ */
+const int countMAX = 19;
+template <typename T, class Compare>
+void AVLTree<T, Compare>::printLevelOrder(ostream &os) const{
+    if (!this->root){
+        os << "NULL" << endl;
+        return;
+    }
+    // the root, then two slots for every node: 2n + 1 items, the last a NULL
+    size_t remaining = 2 * this->size() + 1;
+    int count = 0;
+    ostringstream block;
+    queue<const AVLNode<T>*> nodes;
+    const AVLNode<T>* slot = this->root;
+    nodes.push(this->root);
+    while (true){
+        if (slot){
+            block << slot->data;
+        }
+        else {
+            block << "NULL";
+        }
+        remaining--;
+        if (remaining > 0 && count < countMAX){
+            block << ' ';
+        }
+        count++;
+        if (count > countMAX){
+            block << '\n';
+            count = 0;
+        }
+        if (block.tellp() >= static_cast<streamoff>(PRINT_BLOCK)){
+            os << block.str();
+            block.str(string());
+        }
+        if (remaining == 0){
+            break;
+        }
+        // the slots after the root come in pairs, left then right, from the
+        // front node of the queue
+        if (remaining % 2 == 0){
+            slot = nodes.front()->left;
+        }
+        else {
+            slot = nodes.front()->right;
+            nodes.pop();
+        }
+        if (slot){
+            nodes.push(slot);
+        }
+    }
+    os << block.str() << endl;
+    return;
+}
+
+
+/* writeShape(ostream&) const
+ * Writes the AVL Tree as a shape snapshot: a header, two bits per node in
+ * level order telling whether it has a left and a right child, and the keys
+ * in the same order
+ *  parameters:
+ *  os, stream to write to (opened in binary mode)
+ *
+ *  return value:
+ *
+ */
+template <typename T, class Compare>
+void AVLTree<T, Compare>::writeShape(ostream &os) const{
+    uint64_t header[4] = { 0, this->size(), KeyCodec<T>::WIDTH, 0 };
+    memcpy(header, "AVLSHAPE", 8);
+    vector<unsigned char> bits((2 * this->size() + 7) / 8);
+    queue<const AVLNode<T>*> nodes;
+    if (this->root){
+        nodes.push(this->root);
+    }
+    for (size_t i = 0; !nodes.empty(); i++){
+        const AVLNode<T>* temp = nodes.front();
+        nodes.pop();
+        if (temp->left){
+            bits[2 * i / 8] |= 1 << (2 * i % 8);
+            nodes.push(temp->left);
+        }
+        if (temp->right){
+            bits[2 * i / 8] |= 2 << (2 * i % 8);
+            nodes.push(temp->right);
+        }
+        header[3] += KeyCodec<T>::size(temp->data);
+    }
+    os.write(reinterpret_cast<const char *>(header), sizeof(header));
+    os.write(reinterpret_cast<const char *>(bits.data()), bits.size());
+    string block;
+    if (this->root){
+        nodes.push(this->root);
+    }
+    while (!nodes.empty()){
+        const AVLNode<T>* temp = nodes.front();
+        nodes.pop();
+        if (temp->left){
+            nodes.push(temp->left);
+        }
+        if (temp->right){
+            nodes.push(temp->right);
+        }
+        KeyCodec<T>::append(block, temp->data);
+        if (block.size() >= SHAPE_BLOCK || nodes.empty()){
+            os.write(block.data(), block.size());
+            block.clear();
+        }
+    }
+}
+
+/* readShape(const char*, size_t)
+ * Replaces the contents of the AVL Tree with the tree in a shape snapshot.
+ * The child bits are checked and the heights worked out from them walking
+ * the level order backwards, since every child comes after its parent; then
+ * the nodes are built in one run of a pool of their own and linked up the
+ * same way. While linking, each node is compared with the largest key of its
+ * left subtree and the smallest of its right subtree, which checks the whole
+ * key order in n - 1 comparisons. The tree's old nodes are only freed once
+ * the snapshot has passed every check
+ *  parameters:
+ *  bytes, start of the snapshot
+ *  length, size of the snapshot in bytes
+ *
+ *  return value:
+ *  true if the tree was loaded
+ *  false if the snapshot is malformed, in which case the tree is unchanged
+ */
+template <typename T, class Compare>
+bool AVLTree<T, Compare>::readShape(const char *bytes, size_t length){
+    uint64_t header[4];
+    if (length < sizeof(header)){
+        return false;
+    }
+    memcpy(header, bytes, sizeof(header));
+    size_t n = header[1];
+    if (memcmp(bytes, "AVLSHAPE", 8) != 0 || header[2] != KeyCodec<T>::WIDTH ||
+        n > MAX_SIZE || length - sizeof(header) < (2 * n + 7) / 8 ||
+        length - sizeof(header) - (2 * n + 7) / 8 != header[3]){
+        return false;
+    }
+    const unsigned char *bits = reinterpret_cast<const unsigned char *>(bytes + sizeof(header));
+    const char *keys = bytes + sizeof(header) + (2 * n + 7) / 8;
+    const char *keysEnd = bytes + length;
+
+    vector<signed char> height(n);
+    size_t next = n;
+    for (size_t i = n; i-- > 0; ){
+        int childBits = bits[2 * i / 8] >> (2 * i % 8) & 3;
+        int hr = -1, hl = -1;
+        if (childBits & 2){
+            if (next <= i + 1){
+                return false;
+            }
+            hr = height[--next];
+        }
+        if (childBits & 1){
+            if (next <= i + 1){
+                return false;
+            }
+            hl = height[--next];
+        }
+        if (hr - hl > 1 || hl - hr > 1){
+            return false;
+        }
+        height[i] = 1 + (hl > hr ? hl : hr);
+    }
+    if (n > 0 && next != 1){
+        return false;
+    }
+    const char *at = keys;
+    for (size_t i = 0; i < n; i++){
+        size_t used = KeyCodec<T>::length(at, keysEnd);
+        if (used == 0){
+            return false;
+        }
+        at += used;
+    }
+    if (at != keysEnd){
+        return false;
+    }
+
+    if (n == 0){
+        this->clear();
+        return true;
+    }
+    AVLNodePool<T> loaded(this->pool.usesHugePages());
+    AVLNode<T>* nodes = loaded.allocateRun(n);
+    at = keys;
+    for (size_t i = 0; i < n; i++){
+        new (nodes + i) AVLNode<T>(KeyCodec<T>::make(at));
+        at += KeyCodec<T>::length(at, keysEnd);
+    }
+    // the level order indexes of the smallest and largest key of each subtree
+    vector<uint32_t> lowest(n), highest(n);
+    bool ordered = true;
+    next = n;
+    for (size_t i = n; i-- > 0 && ordered; ){
+        int childBits = bits[2 * i / 8] >> (2 * i % 8) & 3;
+        AVLNode<T>* temp = nodes + i;
+        lowest[i] = highest[i] = i;
+        if (childBits & 2){
+            temp->right = nodes + --next;
+            temp->right->parent = temp;
+            ordered = lessThan(temp->data, nodes[lowest[next]].data);
+            highest[i] = highest[next];
+        }
+        if (childBits & 1){
+            temp->left = nodes + --next;
+            temp->left->parent = temp;
+            ordered = ordered && lessThan(nodes[highest[next]].data, temp->data);
+            lowest[i] = lowest[next];
+        }
+        temp->balance = (temp->right ? height[temp->right - nodes] : -1) -
+                        (temp->left ? height[temp->left - nodes] : -1);
+        temp->updateSize();
+    }
+    if (!ordered){
+        for (size_t i = 0; i < n; i++){
+            nodes[i].~AVLNode<T>();
+        }
+        return false;
+    }
+    this->clear();
+    this->pool.splice(loaded);
+    this->root = nodes;
+    this->shapeVersion++;
+    return true;
+}
+
+/* saveShape(const string&) const
+ * Writes a shape snapshot of the AVL Tree to a file
+ *  parameters:
+ *  fileName, name of the file to write
+ *
+ *  return value:
+ *  true if the whole snapshot was written
+ *  false otherwise
+ */
+template <typename T, class Compare>
+bool AVLTree<T, Compare>::saveShape(const string &fileName) const{
+    ofstream file(fileName.c_str(), ios::binary);
+    this->writeShape(file);
+    file.close();
+    return !file.fail();
+}
+
+/* loadShape(const string&)
+ * Replaces the contents of the AVL Tree with the shape snapshot in a file,
+ * which is memory-mapped rather than read where the platform allows it
+ *  parameters:
+ *  fileName, name of the file to read
+ *
+ *  return value:
+ *  true if the tree was loaded
+ *  false if the file can't be read or is malformed, in which case the tree
+ *  is unchanged
+ */
+template <typename T, class Compare>
+bool AVLTree<T, Compare>::loadShape(const string &fileName){
+#ifdef __linux__
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0){
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0){
+        close(fd);
+        return false;
+    }
+    void *mapped = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED){
+        return false;
+    }
+    madvise(mapped, info.st_size, MADV_SEQUENTIAL);
+    bool loaded = this->readShape(static_cast<const char *>(mapped), info.st_size);
+    munmap(mapped, info.st_size);
+    return loaded;
+#else
+    ifstream file(fileName.c_str(), ios::binary);
+    string contents((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    return file.good() || file.eof() ? this->readShape(contents.data(), contents.size()) : false;
+#endif
+}
+
+
+/* printPreorder(ostream&, const string&) const
+ * Prints the data of the AVLNode and its children in preorder traversal, one
+ * per line, indented two spaces per level
+ *  parameters:
+ *  os, ostream reference for output
+ *  indent, string printed at the start of every line
+ *
+ *  return value:
+ *
+ */
+template <typename T>
+void AVLNode<T>::printPreorder(ostream &os, const string &indent) const{
+    static const string spaces(2 * (MAX_HEIGHT + 2), ' ');
+    ostringstream block;
+    this->visitPreorder([&](const T *item, int depth){
+        block << indent;
+        block.write(spaces.data(), 2 * depth);
+        if (item){
+            block << *item;
+        }
+        else {
+            block << "NULL";
+        }
+        block << '\n';
+        if (block.tellp() >= static_cast<streamoff>(PRINT_BLOCK)){
+            os << block.str();
+            block.str(string());
+        }
+    });
+    os << block.str();
+    os.flush();
+    return;
+}
+
+/* visitPreorder(Function) const
+ * Calls fn on the AVLNode and its children in preorder traversal, including
+ * the missing children, using an explicit stack instead of recursion
+ *  parameters:
+ *  fn, callable taking a const T* (NULL for a missing child) and an int depth
+ *      (0 for this node)
+ *
+ *  return value:
+ *
+ */
+template <typename T>
+template <class Function>
+void AVLNode<T>::visitPreorder(Function fn) const{
+    const AVLNode<T>* stack[MAX_HEIGHT + 2];
+    int depths[MAX_HEIGHT + 2];
+    int top = 0;
+    stack[top] = this;
+    depths[top++] = 0;
+    while (top > 0){
+        top--;
+        const AVLNode<T>* temp = stack[top];
+        int depth = depths[top];
+        if (!temp){
+            fn(static_cast<const T*>(nullptr), depth);
+            continue;
+        }
+        fn(&temp->data, depth);
+        assert(top + 2 <= MAX_HEIGHT + 2);
+        stack[top] = temp->right;
+        depths[top++] = depth + 1;
+        stack[top] = temp->left;
+        depths[top++] = depth + 1;
+    }
+}
+
+/* encrypt(const T&) const
+ * Encrypts the given item and returns its code path, answering from the code
+ * cache when it is on and holds a current entry
+ *  parameters:
+ *      item - value to be encrypted
+ *
+ *  return value:
+ *  Encrypted code path as a string
+ *  Returns '?' if item is not in tree
+ */
+template <typename T, class Compare>
+string EncryptionTree<T, Compare>::encrypt(const T &item) const{
+    if (!this->cache){
+        return encryptFrom(this->root, item);
+    }
+    auto found = this->cache->codes.find(item);
+    if (found != this->cache->codes.end()){
+        if (found->second.version == this->shapeVersion){
+            return found->second.code;
+        }
+        found->second.code = encryptFrom(this->root, item);
+        found->second.version = this->shapeVersion;
+        return found->second.code;
+    }
+    if (this->cache->codes.size() >= this->cache->capacity){
+        this->cache->codes.clear();
+    }
+    typename CodeCache::CodeEntry entry;
+    entry.code = encryptFrom(this->root, item);
+    entry.version = this->shapeVersion;
+    return this->cache->codes.emplace(item, entry).first->second.code;
+}
+
+/* toString() const
+ * Writes a PathCode in the text form used by encrypt()
+ *  parameters:
+ *
+ *  return value:
+ *  'r' followed by one '0' or '1' per step, or '?' if the code is invalid
+ */
+inline string PathCode::toString() const{
+    if (!this->valid()){
+        return "?";
+    }
+    string text(this->length + 1, 'r');
+    for (unsigned i = 0; i < this->length; i++){
+        text[i + 1] = static_cast<char>('0' + this->step(i));
+    }
+    return text;
+}
+
+/* fromString(const string&)
+ * Reads a code path in the text form accepted by decrypt()
+ *  parameters:
+ *  text, code path as text
+ *
+ *  return value:
+ *  The PathCode for text; an invalid code if text does not start with 'r'
+ *  or has more steps than CAPACITY
+ */
+inline PathCode PathCode::fromString(const string &text){
+    PathCode code;
+    if (!text.empty() && text[0] != 'r'){
+        return code;
+    }
+    unsigned depth = 0;
+    for (size_t i = 0; i < text.length(); i++){
+        if (text[i] != '0' && text[i] != '1'){
+            continue;
+        }
+        if (depth == CAPACITY){
+            for (unsigned w = 0; w < WORDS; w++){
+                code.words[w] = 0;
+            }
+            return code;
+        }
+        code.words[depth >> 6] |= static_cast<unsigned long long>(text[i] - '0') << (depth & 63);
+        depth++;
+    }
+    code.length = depth;
+    return code;
+}
+
+/* encryptFrom(const AVLNode<T>*, const Key&)
+ * Encrypts the given item against the tree under the given root
+ *  parameters:
+ *      root - root of the tree to search
+ *      item - value to be encrypted; a T, or with a transparent Compare any
+ *             key Compare can compare with a T
+ *
+ *  return value:
+ *  Encrypted code path as a string
+ *  Returns '?' if item is not in tree
+ */
+template <typename T, class Compare>
+template <class Key>
+string EncryptionTree<T, Compare>::encryptFrom(const AVLNode<T> *root, const Key &item){
+    if (!root){
         return "?";
     }
-    string code;
-    const AVLNode<T>* temp = this->root;
+    string code;
+    const AVLNode<T>* temp = root;
+    KeyPrefix<T> key = EncryptionTree::prefixOf(item);
+    while (true){
+        int order = EncryptionTree::order(item, key, temp);
+        if (order == 0){
+            if (code.empty()){
+                code += 'r';
+            }
+            return code;
+        }
+        else if (order < 0){
+            if (code.empty()){
+                code += 'r';
+            }
+            if (temp->getLeft()){
+                code += '0';
+                temp = temp->getLeft();
+            }
+            else {
+                return "?";
+            }
+        }
+        else {
+            if (code.empty()){
+                code += 'r';
+            }
+            if (temp->getRight()){
+                code += '1';
+                temp = temp->getRight();
+            }
+            else {
+                return "?";
+            }
+        }
+    }
+}
+
+/* decrypt(const string&) const
+ * Decrypts the code path and returns the corresponding item, answering from
+ * the code cache when it is on and holds a current entry
+ *  parameters:
+ *  path, code path to be decrypted
+ *
+ *  return value:
+ *  Pointer to the decrypted item
+ *  Nullptr if path is invalid
+ */
+template <typename T, class Compare>
+const T* EncryptionTree<T, Compare>::decrypt(const string &path) const{
+    if (!this->cache){
+        return decryptFrom(this->root, path);
+    }
+    auto found = this->cache->items.find(path);
+    if (found != this->cache->items.end()){
+        if (found->second.version != this->shapeVersion){
+            found->second.item = decryptFrom(this->root, path);
+            found->second.version = this->shapeVersion;
+        }
+        return found->second.item;
+    }
+    if (this->cache->items.size() >= this->cache->capacity){
+        this->cache->items.clear();
+    }
+    typename CodeCache::ItemEntry entry;
+    entry.item = decryptFrom(this->root, path);
+    entry.version = this->shapeVersion;
+    this->cache->items.emplace(path, entry);
+    return entry.item;
+}
+
+/* enableCache(size_t)
+ * Turns on the code cache used by encrypt() and decrypt(), starting empty
+ *  parameters:
+ *  capacity, number of entries each direction may hold before it is emptied
+ *
+ *  return value:
+ *
+ */
+template <typename T, class Compare>
+void EncryptionTree<T, Compare>::enableCache(size_t capacity){
+    this->cache.reset(new CodeCache(capacity > 0 ? capacity : 1));
+}
+
+/* decryptFrom(const AVLNode<T>*, const Path&)
+ * Decrypts the code path against the tree under the given root
+ *  parameters:
+ *  root, root of the tree to walk
+ *  path, code path to be decrypted (a string, or a string_view or any other
+ *        type with empty(), length() and at())
+ *
+ *  return value:
+ *  Pointer to the decrypted item
+ *  Nullptr if path is invalid
+ */
+template <typename T, class Compare>
+template <class Path>
+const T* EncryptionTree<T, Compare>::decryptFrom(const AVLNode<T> *root, const Path &path){
+    if (!root){
+        return nullptr;
+    }
+    if (!path.empty() && path.at(0) != 'r'){
+        return nullptr;
+    }
+    const AVLNode<T>* temp = root;
+    for (size_t i = 0; i < path.length(); i++){
+        if (path.at(i) == '0'){
+            if (temp->getLeft()){
+                temp = temp->getLeft();
+            }
+            else {
+                return nullptr;
+            }
+        }
+        else if (path.at(i) == '1'){
+            if (temp->getRight()){
+                temp = temp->getRight();
+            }
+            else {
+                return nullptr;
+            }
+        }
+    }
+    return &temp->getData();
+}
+
+/* encryptBitsFrom(const AVLNode<T>*, const Key&)
+ * Encrypts the given item against the tree under the given root into a
+ * PathCode, with the same path encryptFrom() gives
+ *  parameters:
+ *  root, root of the tree to search
+ *  item, value to be encrypted; a T, or with a transparent Compare any key
+ *        Compare can compare with a T
+ *
+ *  return value:
+ *  Code path of item; an invalid code if item is not in tree
+ */
+template <typename T, class Compare>
+template <class Key>
+PathCode EncryptionTree<T, Compare>::encryptBitsFrom(const AVLNode<T> *root, const Key &item){
+    PathCode code;
+    const AVLNode<T>* temp = root;
+    unsigned depth = 0;
+    KeyPrefix<T> key = EncryptionTree::prefixOf(item);
+    while (temp){
+        int order = EncryptionTree::order(item, key, temp);
+        if (order < 0){
+            temp = temp->getLeft();
+        }
+        else if (order > 0){
+            code.words[depth >> 6] |= 1ULL << (depth & 63);
+            temp = temp->getRight();
+        }
+        else {
+            code.length = depth;
+            return code;
+        }
+        depth++;
+        assert(depth < PathCode::CAPACITY);
+    }
+    for (unsigned i = 0; i < PathCode::WORDS; i++){
+        code.words[i] = 0;
+    }
+    return code;
+}
+
+/* decryptBits(const PathCode&) const
+ * Decrypts a PathCode by following one bit per level
+ *  parameters:
+ *  code, code path to be decrypted
+ *
+ *  return value:
+ *  Pointer to the decrypted item
+ *  Nullptr if code is invalid or leaves the tree
+ */
+template <typename T, class Compare>
+const T* EncryptionTree<T, Compare>::decryptBits(const PathCode &code) const{
+    if (!code.valid() || !this->root){
+        return nullptr;
+    }
+    const AVLNode<T>* temp = this->root;
+    unsigned left = code.length;
+    for (unsigned w = 0; left > 0; w++){
+        unsigned long long bits = code.words[w];
+        unsigned n = left < 64 ? left : 64;
+        left -= n;
+        for (unsigned i = 0; i < n; i++){
+            temp = (bits & 1) ? temp->getRight() : temp->getLeft();
+            if (!temp){
+                return nullptr;
+            }
+            bits >>= 1;
+        }
+    }
+    return &temp->getData();
+}
+
+/* decryptByRank(size_t) const
+ * Decrypts a rank code, returning the key with that rank
+ *  parameters:
+ *  k, rank of the key (0 for the smallest key)
+ *
+ *  return value:
+ *  Pointer to the k-th smallest item
+ *  Nullptr if the tree holds k or fewer items
+ */
+template <typename T, class Compare>
+const T* EncryptionTree<T, Compare>::decryptByRank(size_t k) const{
+    typename AVLTree<T, Compare>::const_iterator it = this->select(k);
+    if (it == this->end()){
+        return nullptr;
+    }
+    return &*it;
+}
+
+/* encryptRange(const T&, const T&) const
+ * Encrypts every key between lo and hi, inclusive
+ *  parameters:
+ *  lo, smallest value in the range
+ *  hi, largest value in the range
+ *
+ *  return value:
+ *  Keys in the range, in order, each paired with its code path
+ */
+template <typename T, class Compare>
+vector<pair<T, string> > EncryptionTree<T, Compare>::encryptRange(const T &lo, const T &hi) const{
+    vector<pair<T, string> > out;
+    string code = "r";
+    this->encryptRange(this->root, lo, hi, code, out);
+    return out;
+}
+
+/* encryptEach(const vector<Key>&, unsigned) const
+ * Encrypts every item of a message, in parallel if it is long enough, for
+ * encryptMany()
+ *  parameters:
+ *  items, values to be encrypted; Ts, or with a transparent Compare any keys
+ *         Compare can compare with a T
+ *  threads, number of threads to use (0 for one per hardware thread)
+ *
+ *  return value:
+ *  Code path of each item, in the same order; '?' for items not in tree
+ */
+template <typename T, class Compare>
+template <class Key>
+vector<string> EncryptionTree<T, Compare>::encryptEach(const vector<Key> &items, unsigned threads) const{
+    vector<string> codes(items.size());
+    const AVLNode<T>* start = this->root;
+    forEachIndex(items.size(), threads, [&](size_t i){
+        codes[i] = encryptFrom(start, items[i]);
+    });
+    return codes;
+}
+
+/* decryptMany(const vector<Path>&, unsigned) const
+ * Decrypts every code path of a message, in parallel if it is long enough
+ *  parameters:
+ *  paths, code paths to be decrypted
+ *  threads, number of threads to use (0 for one per hardware thread)
+ *
+ *  return value:
+ *  Pointer to the item for each path, in the same order; nullptr for
+ *  invalid paths
+ */
+template <typename T, class Compare>
+template <class Path>
+vector<const T*> EncryptionTree<T, Compare>::decryptMany(const vector<Path> &paths, unsigned threads) const{
+    vector<const T*> items(paths.size());
+    const AVLNode<T>* start = this->root;
+    forEachIndex(paths.size(), threads, [&](size_t i){
+        items[i] = decryptFrom(start, paths[i]);
+    });
+    return items;
+}
+
+/* forEachIndex(size_t, unsigned, Function)
+ * Calls fn(i) once for each i in [0, n). Below PARALLEL_CUTOFF this is a
+ * plain loop; otherwise a group of threads claims blocks of MANY_CHUNK
+ * indices from a shared counter until every index is taken
+ *  parameters:
+ *  n, number of indices
+ *  threads, number of threads to use (0 for one per hardware thread)
+ *  fn, function called with each index; calls for different indices may run
+ *      at the same time
+ *
+ *  return value:
+ *
+ */
+template <typename T, class Compare>
+template <class Function>
+void EncryptionTree<T, Compare>::forEachIndex(size_t n, unsigned threads, Function fn){
+    threads = AVLTree<T, Compare>::threadCount(threads);
+    if (threads <= 1 || n < AVLTree<T, Compare>::PARALLEL_CUTOFF){
+        for (size_t i = 0; i < n; i++){
+            fn(i);
+        }
+        return;
+    }
+    size_t chunks = (n + MANY_CHUNK - 1) / MANY_CHUNK;
+    if (threads > chunks){
+        threads = chunks;
+    }
+    atomic<size_t> next(0);
+    auto work = [&](){
+        size_t first;
+        while ((first = next.fetch_add(MANY_CHUNK)) < n){
+            size_t last = first + MANY_CHUNK < n ? first + MANY_CHUNK : n;
+            for (size_t i = first; i < last; i++){
+                fn(i);
+            }
+        }
+    };
+    vector<thread> workers;
+    for (unsigned t = 1; t < threads; t++){
+        workers.push_back(thread(work));
+    }
+    work();
+    for (size_t t = 0; t < workers.size(); t++){
+        workers[t].join();
+    }
+}
+
+/* encryptRange(const AVLNode<T>*, const T&, const T&, string&, vector&) const
+ * Appends the keys of a subtree that lie in [lo, hi] with their code paths.
+ * Subtrees that cannot hold a key in the range are not visited, and code is
+ * extended by one character per level and trimmed back on the way out
+ *  parameters:
+ *  node, root of the subtree to search
+ *  lo, smallest value in the range
+ *  hi, largest value in the range
+ *  code, code path of node
+ *  out, vector the (key, code) pairs are appended to
+ *
+ *  return value:
+ *
+ */
+template <typename T, class Compare>
+void EncryptionTree<T, Compare>::encryptRange(const AVLNode<T> *node, const T &lo, const T &hi,
+                                     string &code, vector<pair<T, string> > &out) const{
+    if (!node){
+        return;
+    }
+    bool aboveLo = this->lessThan(lo, node->getData());
+    bool belowHi = this->lessThan(node->getData(), hi);
+    if (aboveLo && node->getLeft()){
+        code += '0';
+        this->encryptRange(node->getLeft(), lo, hi, code, out);
+        code.erase(code.length() - 1);
+    }
+    if ((aboveLo || !this->lessThan(node->getData(), lo)) &&
+        (belowHi || !this->lessThan(hi, node->getData()))){
+        out.push_back(make_pair(node->getData(), code));
+    }
+    if (belowHi && node->getRight()){
+        code += '1';
+        this->encryptRange(node->getRight(), lo, hi, code, out);
+        code.erase(code.length() - 1);
+    }
+}
+
+/* freeze() const
+ * Copies the tree into a FrozenEncryptionTree, numbering the nodes in
+ * breadth-first order
+ *  parameters:
+ *
+ *  return value:
+ *  Read-only copy of the tree with the same shape, and so the same codes
+ */
+template <typename T, class Compare>
+FrozenEncryptionTree<T, Compare> EncryptionTree<T, Compare>::freeze() const{
+    FrozenEncryptionTree<T, Compare> frozen;
+    size_t n = this->size();
+    vector<const AVLNode<T>*> order;
+    order.reserve(n);
+    frozen.keys.reserve(n);
+    frozen.children.assign(2 * n, static_cast<int>(FrozenEncryptionTree<T, Compare>::NONE));
+    if (this->root){
+        order.push_back(this->root);
+    }
+    for (size_t i = 0; i < order.size(); i++){
+        const AVLNode<T>* temp = order[i];
+        frozen.keys.push_back(temp->getData());
+        if (temp->getLeft()){
+            frozen.children[2 * i] = static_cast<int>(order.size());
+            order.push_back(temp->getLeft());
+        }
+        if (temp->getRight()){
+            frozen.children[2 * i + 1] = static_cast<int>(order.size());
+            order.push_back(temp->getRight());
+        }
+    }
+    return frozen;
+}
+
+/* search(const T&, PathCode*) const
+ * Walks from the root to the bottom of the tree, going right when the node's
+ * key is less than item and left otherwise, and remembers the last node where
+ * it went left; that node holds item if any node does
+ *  parameters:
+ *  item, value to be searched for
+ *  code, if not NULL, set to the code path of item (invalid if not found)
+ *
+ *  return value:
+ *  Position of the node holding item, or NONE if item is not in the tree
+ */
+template <typename T, class Compare>
+int FrozenEncryptionTree<T, Compare>::search(const T &item, PathCode *code) const{
+    const T* key = this->keys.data();
+    const int* child = this->children.data();
+    unsigned long long bits[PathCode::WORDS] = {};
+    int i = this->keys.empty() ? NONE : 0;
+    int candidate = NONE;
+    unsigned depth = 0, candidateDepth = 0;
+    while (i != NONE){
+        int right = Compare()(key[i], item);
+        int next = child[2 * i + right];
+#ifdef __GNUC__
+        int ahead = next < 0 ? 0 : next;
+        __builtin_prefetch(key + ahead);
+        __builtin_prefetch(child + 2 * ahead);
+#endif
+        candidate = right ? candidate : i;
+        candidateDepth = right ? candidateDepth : depth;
+        bits[depth >> 6] |= static_cast<unsigned long long>(right) << (depth & 63);
+        depth++;
+        assert(depth < PathCode::CAPACITY);
+        i = next;
+    }
+    if (candidate == NONE || Compare()(item, key[candidate])){
+        return NONE;
+    }
+    if (code){
+        for (unsigned w = 0; w < PathCode::WORDS; w++){
+            unsigned used = candidateDepth > 64 * w ? candidateDepth - 64 * w : 0;
+            code->words[w] = used >= 64 ? bits[w] : bits[w] & ((1ULL << used) - 1);
+        }
+        code->length = candidateDepth;
+    }
+    return candidate;
+}
+
+/* encryptBits(const T&) const
+ * Encrypts the given item into a PathCode
+ *  parameters:
+ *  item, value to be encrypted
+ *
+ *  return value:
+ *  Code path of item, the same as the live tree's; an invalid code if item
+ *  is not in the tree
+ */
+template <typename T, class Compare>
+PathCode FrozenEncryptionTree<T, Compare>::encryptBits(const T &item) const{
+    PathCode code;
+    this->search(item, &code);
+    return code;
+}
+
+/* decryptBits(const PathCode&) const
+ * Decrypts a PathCode by following one bit per level
+ *  parameters:
+ *  code, code path to be decrypted
+ *
+ *  return value:
+ *  Pointer to the decrypted item
+ *  Nullptr if code is invalid or leaves the tree
+ */
+template <typename T, class Compare>
+const T* FrozenEncryptionTree<T, Compare>::decryptBits(const PathCode &code) const{
+    if (!code.valid() || this->keys.empty()){
+        return nullptr;
+    }
+    const int* child = this->children.data();
+    int i = 0;
+    unsigned left = code.length;
+    for (unsigned w = 0; left > 0; w++){
+        unsigned long long bits = code.words[w];
+        unsigned n = left < 64 ? left : 64;
+        left -= n;
+        for (unsigned j = 0; j < n; j++){
+            i = child[2 * i + static_cast<int>(bits & 1)];
+            if (i == NONE){
+                return nullptr;
+            }
+            bits >>= 1;
+        }
+    }
+    return &this->keys[i];
+}
+
+/* containsMany(const vector<T>&) const
+ * Checks a batch of items, running several searches side by side
+ *  parameters:
+ *  items, values to be searched for
+ *
+ *  return value:
+ *  For each item, in order, whether it is in the tree
+ */
+template <typename T, class Compare>
+vector<bool> FrozenEncryptionTree<T, Compare>::containsMany(const vector<T> &items) const{
+    vector<bool> found(items.size());
+    this->containsLanes(items, found, integral_constant<int, SIMD_LANES>());
+    return found;
+}
+
+/* containsLanes(const vector<T>&, vector<bool>&, integral_constant<int, 0>) const
+ * Runs the searches LANES at a time, taking one step of each in turn, so
+ * that the loads of different searches are in flight together
+ *  parameters:
+ *  items, values to be searched for
+ *  found, set to whether each item is in the tree
+ *
+ *  return value:
+ *
+ */
+template <typename T, class Compare>
+void FrozenEncryptionTree<T, Compare>::containsLanes(const vector<T> &items, vector<bool> &found,
+                                            integral_constant<int, 0>) const{
+    const T* key = this->keys.data();
+    const int* child = this->children.data();
+    int node[LANES], candidate[LANES];
+    for (size_t first = 0; first < items.size(); first += LANES){
+        size_t lanes = items.size() - first < LANES ? items.size() - first : LANES;
+        for (size_t l = 0; l < lanes; l++){
+            node[l] = this->keys.empty() ? NONE : 0;
+            candidate[l] = NONE;
+        }
+        bool active = !this->keys.empty();
+        while (active){
+            active = false;
+            for (size_t l = 0; l < lanes; l++){
+                int i = node[l];
+                if (i == NONE){
+                    continue;
+                }
+                int right = Compare()(key[i], items[first + l]);
+                candidate[l] = right ? candidate[l] : i;
+                node[l] = child[2 * i + right];
+#ifdef __GNUC__
+                __builtin_prefetch(key + (node[l] < 0 ? 0 : node[l]));
+#endif
+                active = true;
+            }
+        }
+        for (size_t l = 0; l < lanes; l++){
+            found[first + l] = candidate[l] != NONE && !Compare()(items[first + l], key[candidate[l]]);
+        }
+    }
+}
+
+#ifdef __AVX2__
+/* containsLanes(const vector<T>&, vector<bool>&, integral_constant<int, 8>) const
+ * Runs the searches for 32-bit integer keys 8 at a time in AVX2 registers.
+ * Unsigned keys have their top bit flipped so that a signed compare orders
+ * them correctly
+ *  parameters:
+ *  items, values to be searched for
+ *  found, set to whether each item is in the tree
+ *
+ *  return value:
+ *
+ */
+template <typename T, class Compare>
+void FrozenEncryptionTree<T, Compare>::containsLanes(const vector<T> &items, vector<bool> &found,
+                                            integral_constant<int, 8>) const{
+    const int* key = reinterpret_cast<const int*>(this->keys.data());
+    const int* child = this->children.data();
+    const __m256i none = _mm256_set1_epi32(NONE);
+    const __m256i flip = _mm256_set1_epi32(is_signed<T>::value ? 0 : static_cast<int>(0x80000000u));
+    const __m256i start = this->keys.empty() ? none : _mm256_setzero_si256();
+    size_t first = 0;
+    for (; first + 8 <= items.size(); first += 8){
+        __m256i target = _mm256_xor_si256(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(items.data() + first)), flip);
+        __m256i node = start;
+        __m256i candidate = none;
+        while (true){
+            __m256i active = _mm256_cmpgt_epi32(node, none);
+            if (_mm256_testz_si256(active, active)){
+                break;
+            }
+            __m256i k = _mm256_xor_si256(
+                _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), key, node, active, 4), flip);
+            __m256i right = _mm256_and_si256(_mm256_cmpgt_epi32(target, k), active);
+            candidate = _mm256_blendv_epi8(candidate, node, _mm256_andnot_si256(right, active));
+            __m256i index = _mm256_add_epi32(_mm256_add_epi32(node, node), _mm256_srli_epi32(right, 31));
+            node = _mm256_mask_i32gather_epi32(none, child, index, active, 4);
+        }
+        int lanes[8];
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), candidate);
+        for (size_t l = 0; l < 8; l++){
+            found[first + l] = lanes[l] != NONE && !(items[first + l] < this->keys[lanes[l]]);
+        }
+    }
+    for (; first < items.size(); first++){
+        found[first] = this->contains(items[first]);
+    }
+}
+
+/* containsLanes(const vector<T>&, vector<bool>&, integral_constant<int, 4>) const
+ * Runs the searches for 64-bit integer keys 4 at a time in AVX2 registers,
+ * as the 32-bit version does
+ *  parameters:
+ *  items, values to be searched for
+ *  found, set to whether each item is in the tree
+ *
+ *  return value:
+ *
+ */
+template <typename T, class Compare>
+void FrozenEncryptionTree<T, Compare>::containsLanes(const vector<T> &items, vector<bool> &found,
+                                            integral_constant<int, 4>) const{
+    const long long* key = reinterpret_cast<const long long*>(this->keys.data());
+    const int* child = this->children.data();
+    const __m256i none = _mm256_set1_epi64x(NONE);
+    const __m256i flip = _mm256_set1_epi64x(is_signed<T>::value ? 0 : static_cast<long long>(1ULL << 63));
+    const __m256i pack = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+    const __m256i start = this->keys.empty() ? none : _mm256_setzero_si256();
+    size_t first = 0;
+    for (; first + 4 <= items.size(); first += 4){
+        __m256i target = _mm256_xor_si256(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(items.data() + first)), flip);
+        __m256i node = start;
+        __m256i candidate = none;
+        while (true){
+            __m256i active = _mm256_cmpgt_epi64(node, none);
+            if (_mm256_testz_si256(active, active)){
+                break;
+            }
+            __m256i k = _mm256_xor_si256(
+                _mm256_mask_i64gather_epi64(_mm256_setzero_si256(), key, node, active, 8), flip);
+            __m256i right = _mm256_and_si256(_mm256_cmpgt_epi64(target, k), active);
+            candidate = _mm256_blendv_epi8(candidate, node, _mm256_andnot_si256(right, active));
+            __m256i index = _mm256_add_epi64(_mm256_add_epi64(node, node), _mm256_srli_epi64(right, 63));
+            __m128i activeLow = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(active, pack));
+            node = _mm256_cvtepi32_epi64(
+                _mm256_mask_i64gather_epi32(_mm_set1_epi32(NONE), child, index, activeLow, 4));
+        }
+        long long lanes[4];
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), candidate);
+        for (size_t l = 0; l < 4; l++){
+            found[first + l] = lanes[l] != NONE && !(items[first + l] < this->keys[lanes[l]]);
+        }
+    }
+    for (; first < items.size(); first++){
+        found[first] = this->contains(items[first]);
+    }
+}
+#endif
+
+/* Snapshot(const SnapshotEncryptionTree<T>&)
+ * Pins the current version of the tree for reading. A free announcement slot
+ * is claimed with a compare-and-swap that stores the current epoch in it, and
+ * only then is the root read, so the writer cannot free any node of it. If
+ * every slot is taken it waits for one to be given up, unless this thread
+ * holds them all, which is a caller bug it could never get out of
+ *  parameters:
+ *  t, tree to take the snapshot of
+ *
+ *  return value:
+ *
+ */
+template <typename T>
+SnapshotEncryptionTree<T>::Snapshot::Snapshot(const SnapshotEncryptionTree<T> &t) : tree(&t){
+    thread::id self = this_thread::get_id();
+    size_t ndx = hash<thread::id>()(self) % MAX_READERS;
+    while (true){
+        for (size_t i = 0; i < MAX_READERS; i++){
+            unsigned long long expected = 0;
+            if (t.readers[ndx].epoch.compare_exchange_strong(expected, t.epoch.load())){
+                t.readers[ndx].owner.store(self);
+                this->slot = ndx;
+                this->root = t.root.load();
+                return;
+            }
+            ndx = (ndx + 1) % MAX_READERS;
+        }
+        bool allMine = true;
+        for (size_t i = 0; i < MAX_READERS && allMine; i++){
+            allMine = t.readers[i].owner.load() == self;
+        }
+        assert(!allMine);
+        this_thread::yield();
+    }
+}
+
+/* ~Snapshot()
+ * Unpins the version, giving up the announcement slot
+ */
+template <typename T>
+SnapshotEncryptionTree<T>::Snapshot::~Snapshot(){
+    this->tree->readers[this->slot].owner.store(thread::id());
+    this->tree->readers[this->slot].epoch.store(0);
+}
+
+/* contains(const T&) const
+ * Checks whether the pinned version of the tree holds the given item
+ *  parameters:
+ *  item, value to be searched for
+ *
+ *  return value:
+ *  true if item is in this version, false otherwise
+ */
+template <typename T>
+bool SnapshotEncryptionTree<T>::Snapshot::contains(const T &item) const{
+    const AVLNode<T>* temp = this->root;
+    KeyPrefix<T> key(item);
+    while (temp){
+        int order = temp->compareTo(item, key);
+        if (order < 0){
+            temp = temp->getLeft();
+        }
+        else if (order > 0){
+            temp = temp->getRight();
+        }
+        else {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* ~SnapshotEncryptionTree()
+ * Destroys the current version and every retired node; the pool then frees
+ * the memory in one step
+ */
+template <typename T>
+SnapshotEncryptionTree<T>::~SnapshotEncryptionTree(){
+    if (is_trivially_destructible<T>::value){
+        return;
+    }
+    AVLNode<T>* temp = const_cast<AVLNode<T>*>(this->root.load());
+    while (temp){
+        if (temp->left){
+            AVLNode<T>* child = temp->left;
+            temp->left = child->right;
+            child->right = temp;
+            temp = child;
+        }
+        else {
+            AVLNode<T>* next = temp->right;
+            temp->~AVLNode<T>();
+            temp = next;
+        }
+    }
+    for (size_t i = 0; i < this->retired.size(); i++){
+        for (size_t j = 0; j < this->retired[i].second.size(); j++){
+            const_cast<AVLNode<T>*>(this->retired[i].second[j])->~AVLNode<T>();
+        }
+    }
+}
+
+/* insert(const T&)
+ * Inserts item into a new version of the tree and publishes it
+ *  parameters:
+ *  item, value to be inserted
+ *
+ *  return value:
+ *
+ */
+template <typename T>
+void SnapshotEncryptionTree<T>::insert(const T &item){
+    lock_guard<mutex> guard(this->writeLock);
+    bool grew = false;
+    AVLNode<T>* newRoot = this->insertInto(this->root.load(), item, grew);
+    if (newRoot){
+        this->publish(newRoot);
+    }
+}
+
+/* remove(const T&)
+ * Removes item from a new version of the tree and publishes it
+ *  parameters:
+ *  item, value to be removed
+ *
+ *  return value:
+ *
+ */
+template <typename T>
+void SnapshotEncryptionTree<T>::remove(const T &item){
+    lock_guard<mutex> guard(this->writeLock);
+    const AVLNode<T>* oldRoot = this->root.load();
+    bool shrank = false;
+    const AVLNode<T>* newRoot = this->removeFrom(oldRoot, item, shrank);
+    if (newRoot != oldRoot){
+        this->publish(newRoot);
+    }
+}
+
+/* copyOf(const AVLNode<T>*)
+ * Makes an unpublished copy of a node, which may then be changed freely, and
+ * retires the original, since the new version will not use it
+ *  parameters:
+ *  n, node to copy
+ *
+ *  return value:
+ *  Pointer to the copy
+ */
+template <typename T>
+AVLNode<T>* SnapshotEncryptionTree<T>::copyOf(const AVLNode<T> *n){
+    AVLNode<T>* temp = this->pool.allocate(n->data);
+    temp->left = n->left;
+    temp->right = n->right;
+    temp->balance = n->balance;
+    temp->size = n->size;
+    this->replaced.push_back(n);
+    return temp;
+}
+
+/* rotateLeft(AVLNode<T>*, int)
+ * Single rotation to the left, as AVLNode::singleRotateLeft() does, except
+ * that the right child moving up is copied rather than changed
+ *  parameters:
+ *  n, unpublished node to rotate
+ *  b, n's balance factor as it is now (may be 2)
+ *
+ *  return value:
+ *  Pointer to the node that takes n's place
+ */
+template <typename T>
+AVLNode<T>* SnapshotEncryptionTree<T>::rotateLeft(AVLNode<T> *n, int b){
+    AVLNode<T>* temp = this->copyOf(n->right);
+    n->right = temp->left;
+    temp->left = n;
+    int tb = temp->balance;
+    int nb = b - 1 - (tb > 0 ? tb : 0);
+    n->balance = nb;
+    temp->balance = tb - 1 + (nb < 0 ? nb : 0);
+    n->updateSize();
+    temp->updateSize();
+    return temp;
+}
+
+/* rotateRight(AVLNode<T>*, int)
+ * Single rotation to the right, as AVLNode::singleRotateRight() does, except
+ * that the left child moving up is copied rather than changed
+ *  parameters:
+ *  n, unpublished node to rotate
+ *  b, n's balance factor as it is now (may be -2)
+ *
+ *  return value:
+ *  Pointer to the node that takes n's place
+ */
+template <typename T>
+AVLNode<T>* SnapshotEncryptionTree<T>::rotateRight(AVLNode<T> *n, int b){
+    AVLNode<T>* temp = this->copyOf(n->left);
+    n->left = temp->right;
+    temp->right = n;
+    int tb = temp->balance;
+    int nb = b + 1 - (tb < 0 ? tb : 0);
+    n->balance = nb;
+    temp->balance = tb + 1 + (nb > 0 ? nb : 0);
+    n->updateSize();
+    temp->updateSize();
+    return temp;
+}
+
+/* rotateRightLeft(AVLNode<T>*)
+ * Double rotation, as AVLNode::doubleRotateRightLeft() does, except that the
+ * right child and its left child are copied rather than changed
+ *  parameters:
+ *  n, unpublished node leaning right by 2, whose right child leans left
+ *
+ *  return value:
+ *  Pointer to the node that takes n's place
+ */
+template <typename T>
+AVLNode<T>* SnapshotEncryptionTree<T>::rotateRightLeft(AVLNode<T> *n){
+    AVLNode<T>* child = this->copyOf(n->right);
+    AVLNode<T>* temp = this->copyOf(child->left);
+    int tb = temp->balance;
+    child->left = temp->right;
+    n->right = temp->left;
+    temp->right = child;
+    temp->left = n;
+    child->balance = tb < 0 ? 1 : 0;
+    n->balance = tb > 0 ? -1 : 0;
+    temp->balance = 0;
+    child->updateSize();
+    n->updateSize();
+    temp->updateSize();
+    return temp;
+}
+
+/* rotateLeftRight(AVLNode<T>*)
+ * Mirror image of rotateRightLeft()
+ *  parameters:
+ *  n, unpublished node leaning left by 2, whose left child leans right
+ *
+ *  return value:
+ *  Pointer to the node that takes n's place
+ */
+template <typename T>
+AVLNode<T>* SnapshotEncryptionTree<T>::rotateLeftRight(AVLNode<T> *n){
+    AVLNode<T>* child = this->copyOf(n->left);
+    AVLNode<T>* temp = this->copyOf(child->right);
+    int tb = temp->balance;
+    child->right = temp->left;
+    n->left = temp->right;
+    temp->left = child;
+    temp->right = n;
+    child->balance = tb > 0 ? -1 : 0;
+    n->balance = tb < 0 ? 1 : 0;
+    temp->balance = 0;
+    child->updateSize();
+    n->updateSize();
+    temp->updateSize();
+    return temp;
+}
+
+/* rebalance(AVLNode<T>*, int, bool, bool&)
+ * Moves the balance factor of an unpublished node whose children are final
+ * one step, and rotates it if it would lean by 2, by the same rules as
+ * AVLTree::rebalancePathToRoot() so that both trees end up the same shape
+ *  parameters:
+ *  n, unpublished node to rebalance
+ *  delta, -1 if n's left subtree grew or its right one shrank, 1 otherwise
+ *  grew, true for an insert, false for a remove
+ *  changed, set to whether the subtree's height changed, so whether the
+ *           caller must rebalance too
+ *
+ *  return value:
+ *  Pointer to the node that takes n's place
+ */
+template <typename T>
+AVLNode<T>* SnapshotEncryptionTree<T>::rebalance(AVLNode<T> *n, int delta, bool grew,
+                                                 bool &changed){
+    int balance = n->balance + delta;
+    if (balance > 1){
+        int childBalance = n->right->balance;
+        changed = !grew && childBalance != 0;
+        if (childBalance < 0){
+            return this->rotateRightLeft(n);
+        }
+        return this->rotateLeft(n, balance);
+    }
+    if (balance < -1){
+        int childBalance = n->left->balance;
+        changed = !grew && childBalance != 0;
+        if (childBalance > 0){
+            return this->rotateLeftRight(n);
+        }
+        return this->rotateRight(n, balance);
+    }
+    n->balance = balance;
+    n->updateSize();
+    changed = grew ? balance != 0 : balance == 0;
+    return n;
+}
+
+/* insertInto(const AVLNode<T>*, const T&, bool&)
+ * Inserts item below n by copying every node on the path to it
+ *  parameters:
+ *  n, root of the subtree to insert into
+ *  item, value to be inserted
+ *  grew, set to whether the subtree got taller
+ *
+ *  return value:
+ *  Root of the new version of the subtree, or nullptr if item was already there
+ */
+template <typename T>
+AVLNode<T>* SnapshotEncryptionTree<T>::insertInto(const AVLNode<T> *n, const T &item, bool &grew){
+    if (!n){
+        // nothing has been copied yet, so refusing here changes nothing
+        if (static_cast<size_t>(AVLNode<T>::getSize(this->root.load())) >= AVLNode<T>::MAX_SIZE){
+            throw length_error("SnapshotEncryptionTree: more than MAX_SIZE keys");
+        }
+        grew = true;
+        return this->pool.allocate(item);
+    }
+    AVLNode<T>* child = nullptr;
+    if (item < n->data){
+        child = this->insertInto(n->left, item, grew);
+        if (!child){
+            return nullptr;
+        }
+        AVLNode<T>* temp = this->copyOf(n);
+        temp->left = child;
+        if (!grew){
+            temp->updateSize();
+            return temp;
+        }
+        return this->rebalance(temp, -1, true, grew);
+    }
+    if (n->data < item){
+        child = this->insertInto(n->right, item, grew);
+        if (!child){
+            return nullptr;
+        }
+        AVLNode<T>* temp = this->copyOf(n);
+        temp->right = child;
+        if (!grew){
+            temp->updateSize();
+            return temp;
+        }
+        return this->rebalance(temp, 1, true, grew);
+    }
+    return nullptr;
+}
+
+/* removeFrom(const AVLNode<T>*, const T&, bool&)
+ * Removes item from below n by copying every node on the path to it. A node
+ * with two children is replaced by a copy of its in-order successor, as in
+ * AVLTree::remove()
+ *  parameters:
+ *  n, root of the subtree to remove from
+ *  item, value to be removed
+ *  shrank, set to whether the subtree got shorter
+ *
+ *  return value:
+ *  Root of the new version of the subtree, or n itself if item was not there
+ */
+template <typename T>
+AVLNode<T>* SnapshotEncryptionTree<T>::removeFrom(const AVLNode<T> *n, const T &item,
+                                                  bool &shrank){
+    if (!n){
+        shrank = false;
+        return nullptr;
+    }
+    if (item < n->data){
+        AVLNode<T>* child = this->removeFrom(n->left, item, shrank);
+        if (child == n->left){
+            return const_cast<AVLNode<T>*>(n);
+        }
+        AVLNode<T>* temp = this->copyOf(n);
+        temp->left = child;
+        if (!shrank){
+            temp->updateSize();
+            return temp;
+        }
+        return this->rebalance(temp, 1, false, shrank);
+    }
+    if (n->data < item){
+        AVLNode<T>* child = this->removeFrom(n->right, item, shrank);
+        if (child == n->right){
+            return const_cast<AVLNode<T>*>(n);
+        }
+        AVLNode<T>* temp = this->copyOf(n);
+        temp->right = child;
+        if (!shrank){
+            temp->updateSize();
+            return temp;
+        }
+        return this->rebalance(temp, -1, false, shrank);
+    }
+    this->replaced.push_back(n);
+    shrank = true;
+    if (!n->left){
+        return n->right;
+    }
+    if (!n->right){
+        return n->left;
+    }
+    const AVLNode<T>* minimum = nullptr;
+    AVLNode<T>* right = this->removeMin(n->right, minimum, shrank);
+    AVLNode<T>* temp = this->pool.allocate(minimum->data);
+    temp->left = n->left;
+    temp->right = right;
+    temp->balance = n->balance;
+    if (!shrank){
+        temp->updateSize();
+        return temp;
+    }
+    return this->rebalance(temp, -1, false, shrank);
+}
+
+/* removeMin(const AVLNode<T>*, const AVLNode<T>*&, bool&)
+ * Removes the smallest node from below n by copying the path to it
+ *  parameters:
+ *  n, root of a non-empty subtree
+ *  minimum, set to the removed (retired) node, which stays readable until the
+ *           write is published
+ *  shrank, set to whether the subtree got shorter
+ *
+ *  return value:
+ *  Root of the new version of the subtree
+ */
+template <typename T>
+AVLNode<T>* SnapshotEncryptionTree<T>::removeMin(const AVLNode<T> *n, const AVLNode<T> *&minimum,
+                                                 bool &shrank){
+    if (!n->left){
+        minimum = n;
+        this->replaced.push_back(n);
+        shrank = true;
+        return n->right;
+    }
+    AVLNode<T>* temp = this->copyOf(n);
+    temp->left = this->removeMin(n->left, minimum, shrank);
+    if (!shrank){
+        temp->updateSize();
+        return temp;
+    }
+    return this->rebalance(temp, 1, false, shrank);
+}
+
+/* publish(const AVLNode<T>*)
+ * Makes a new version visible to readers, retires the nodes it replaced under
+ * the next epoch, and frees whatever no reader can still reach
+ *  parameters:
+ *  newRoot, root of the new version
+ *
+ *  return value:
+ *
+ */
+template <typename T>
+void SnapshotEncryptionTree<T>::publish(const AVLNode<T> *newRoot){
+    this->root.store(newRoot);
+    unsigned long long tag = this->epoch.fetch_add(1) + 1;
+    if (!this->replaced.empty()){
+        this->retired.push_back(make_pair(tag, vector<const AVLNode<T>*>()));
+        this->retired.back().second.swap(this->replaced);
+    }
+    this->reclaim();
+}
+
+/* reclaim()
+ * Frees every retired batch whose tag is no newer than the oldest epoch a
+ * reader has announced; with no readers active, every batch is freed
+ *  parameters:
+ *
+ *  return value:
+ *
+ */
+template <typename T>
+void SnapshotEncryptionTree<T>::reclaim(){
+    unsigned long long oldest = ~0ULL;
+    for (size_t i = 0; i < MAX_READERS; i++){
+        unsigned long long e = this->readers[i].epoch.load();
+        if (e && e < oldest){
+            oldest = e;
+        }
+    }
+    while (!this->retired.empty() && this->retired.front().first <= oldest){
+        vector<const AVLNode<T>*>& batch = this->retired.front().second;
+        for (size_t i = 0; i < batch.size(); i++){
+            this->pool.deallocate(const_cast<AVLNode<T>*>(batch[i]));
+        }
+        this->retired.pop_front();
+    }
+}
+
+/* Pin(const ConcurrentEncryptionTree<T>&)
+ * Announces that the calling thread is using the tree, by storing the current
+ * epoch in a free slot, so that no node it can reach is deleted under it. If
+ * every slot is taken it waits for one to be given up, unless this thread
+ * holds them all, which it could never get out of
+ *  parameters:
+ *  t, tree about to be used
+ *
+ *  return value:
+ *
+ */
+template <typename T>
+ConcurrentEncryptionTree<T>::Pin::Pin(const ConcurrentEncryptionTree<T> &t) : tree(&t){
+    thread::id self = this_thread::get_id();
+    size_t ndx = hash<thread::id>()(self) % MAX_THREADS;
+    while (true){
+        for (size_t i = 0; i < MAX_THREADS; i++){
+            unsigned long long expected = 0;
+            if (t.threads[ndx].epoch.compare_exchange_strong(expected, t.epoch.load())){
+                t.threads[ndx].owner.store(self);
+                this->slot = ndx;
+                return;
+            }
+            ndx = (ndx + 1) % MAX_THREADS;
+        }
+        bool allMine = true;
+        for (size_t i = 0; i < MAX_THREADS && allMine; i++){
+            allMine = t.threads[i].owner.load() == self;
+        }
+        assert(!allMine);
+        this_thread::yield();
+    }
+}
+
+/* ~Pin()
+ * Withdraws the announcement made by the constructor
+ */
+template <typename T>
+ConcurrentEncryptionTree<T>::Pin::~Pin(){
+    this->tree->threads[this->slot].owner.store(thread::id());
+    this->tree->threads[this->slot].epoch.store(0);
+}
+
+/* ~ConcurrentEncryptionTree()
+ * Deletes every node still in the tree and every retired node
+ */
+template <typename T>
+ConcurrentEncryptionTree<T>::~ConcurrentEncryptionTree(){
+    vector<Node*> stack;
+    if (this->rootHolder.right.load()){
+        stack.push_back(this->rootHolder.right.load());
+    }
+    while (!stack.empty()){
+        Node* temp = stack.back();
+        stack.pop_back();
+        if (temp->left.load()){
+            stack.push_back(temp->left.load());
+        }
+        if (temp->right.load()){
+            stack.push_back(temp->right.load());
+        }
+        delete temp;
+    }
+    for (size_t i = 0; i < this->retired.size(); i++){
+        delete this->retired[i].second;
+    }
+}
+
+/* insert(const T&)
+ * Inserts item into the tree, retrying until no concurrent change interferes
+ *  parameters:
+ *  item, value to be inserted
+ *
+ *  return value:
+ *  true if item was added, false if it was already there
+ */
+template <typename T>
+bool ConcurrentEncryptionTree<T>::insert(const T &item){
+    Pin pin(*this);
+    Result result;
+    do {
+        result = this->attemptInsert(item, &this->rootHolder, 1, this->rootHolder.version.load());
+    } while (result == RETRY);
+    return result == FOUND;
+}
+
+/* remove(const T&)
+ * Removes item from the tree, retrying until no concurrent change interferes
+ *  parameters:
+ *  item, value to be removed
+ *
+ *  return value:
+ *  true if item was removed, false if it was not there
+ */
+template <typename T>
+bool ConcurrentEncryptionTree<T>::remove(const T &item){
+    Pin pin(*this);
+    Result result;
+    do {
+        result = this->attemptRemove(item, &this->rootHolder, 1, this->rootHolder.version.load());
+    } while (result == RETRY);
+    return result == FOUND;
+}
+
+/* contains(const T&) const
+ * Searches the tree for item without taking any locks
+ *  parameters:
+ *  item, value to be searched for
+ *
+ *  return value:
+ *  true if item is in the tree, false otherwise
+ */
+template <typename T>
+bool ConcurrentEncryptionTree<T>::contains(const T &item) const{
+    Pin pin(*this);
+    Result result;
+    do {
+        result = this->attemptGet(item, &this->rootHolder, 1, this->rootHolder.version.load(), nullptr);
+    } while (result == RETRY);
+    return result == FOUND;
+}
+
+/* encrypt(const T&) const
+ * Encrypts the given item without taking any locks
+ *  parameters:
+ *  item, value to be encrypted
+ *
+ *  return value:
+ *  Encrypted code path as a string
+ *  Returns '?' if item is not in tree
+ */
+template <typename T>
+string ConcurrentEncryptionTree<T>::encrypt(const T &item) const{
+    Pin pin(*this);
+    string code;
+    Result result;
+    do {
+        code = "r";
+        result = this->attemptGet(item, &this->rootHolder, 1, this->rootHolder.version.load(), &code);
+    } while (result == RETRY);
+    return result == FOUND ? code : "?";
+}
+
+/* decrypt(const string&, T&) const
+ * Decrypts the code path without taking any locks. Like
+ * EncryptionTree::decrypt(), only '0' and '1' characters after the leading
+ * 'r' choose a direction
+ *  parameters:
+ *  path, code path to be decrypted
+ *  item, set to the decrypted item
+ *
+ *  return value:
+ *  true if the path leads to a key, false if it is invalid
+ */
+template <typename T>
+bool ConcurrentEncryptionTree<T>::decrypt(const string &path, T &item) const{
+    if (!path.empty() && path.at(0) != 'r'){
+        return false;
+    }
+    Pin pin(*this);
+    Result result;
+    do {
+        result = this->attemptDecrypt(path, 0, &this->rootHolder, 1, this->rootHolder.version.load(), item);
+    } while (result == RETRY);
+    return result == FOUND;
+}
+
+/* size() const
+ * Counts the keys in the tree; only safe while no other thread uses it
+ *  parameters:
+ *
+ *  return value:
+ *  Number of keys in the tree
+ */
+template <typename T>
+size_t ConcurrentEncryptionTree<T>::size() const{
+    size_t count = 0;
+    vector<const Node*> stack;
+    if (this->rootHolder.right.load()){
+        stack.push_back(this->rootHolder.right.load());
+    }
+    while (!stack.empty()){
+        const Node* temp = stack.back();
+        stack.pop_back();
+        if (temp->present.load()){
+            count++;
+        }
+        if (temp->left.load()){
+            stack.push_back(temp->left.load());
+        }
+        if (temp->right.load()){
+            stack.push_back(temp->right.load());
+        }
+    }
+    return count;
+}
+
+/* verifySearchOrder() const
+ * Asserts that every node, routing nodes included, is in search order and
+ * that parent links match; only safe while no other thread uses the tree
+ *  parameters:
+ *
+ *  return value:
+ *
+ */
+template <typename T>
+void ConcurrentEncryptionTree<T>::verifySearchOrder() const{
+    const Node* previous = nullptr;
+    vector<const Node*> stack;
+    const Node* temp = this->rootHolder.right.load();
+    assert(!temp || temp->parent.load() == &this->rootHolder);
+    while (temp || !stack.empty()){
+        while (temp){
+            stack.push_back(temp);
+            const Node* next = temp->left.load();
+            assert(!next || next->parent.load() == temp);
+            temp = next;
+        }
+        temp = stack.back();
+        stack.pop_back();
+        assert(!previous || previous->key < temp->key);
+        previous = temp;
+        const Node* next = temp->right.load();
+        assert(!next || next->parent.load() == temp);
+        temp = next;
+    }
+}
+
+/* verifyBalance() const
+ * Asserts that every stored height is correct and that the AVL balance
+ * property holds; only safe while no other thread uses the tree
+ *  parameters:
+ *
+ *  return value:
+ *
+ */
+template <typename T>
+void ConcurrentEncryptionTree<T>::verifyBalance() const{
+    vector<pair<const Node*, bool> > stack;
+    if (this->rootHolder.right.load()){
+        stack.push_back(make_pair(this->rootHolder.right.load(), false));
+    }
+    while (!stack.empty()){
+        const Node* temp = stack.back().first;
+        if (!stack.back().second){
+            stack.back().second = true;
+            if (temp->left.load()){
+                stack.push_back(make_pair(temp->left.load(), false));
+            }
+            if (temp->right.load()){
+                stack.push_back(make_pair(temp->right.load(), false));
+            }
+            continue;
+        }
+        stack.pop_back();
+        int hL = getHeight(temp->left.load()), hR = getHeight(temp->right.load());
+        assert(abs(hL - hR) <= 1);
+        assert(temp->height.load() == (hL > hR ? hL : hR) + 1);
+    }
+}
+
+/* waitUntilNotChanging(Node*)
+ * Waits for a rotation in progress at a node to finish. Rotations happen
+ * under the node's lock, so after a short spin the lock is used to wait
+ *  parameters:
+ *  n, node that may be changing
+ *
+ *  return value:
+ *
+ */
+template <typename T>
+void ConcurrentEncryptionTree<T>::waitUntilNotChanging(Node *n){
+    for (int spins = 0; spins < 100; spins++){
+        if (!(n->version.load() & SHRINKING)){
+            return;
+        }
+    }
+    lock_guard<mutex> guard(n->lock);
+}
+
+/* attemptGet(const T&, Node*, int, unsigned long long, string*) const
+ * Looks for item in the subtree on side dir of node. node's version must
+ * still be nodeVersion for anything read below it to count
+ *  parameters:
+ *  item, value to be searched for
+ *  node, node to search below
+ *  dir, side of node to search (-1 for left, 1 for right)
+ *  nodeVersion, version of node seen when it was reached
+ *  code, if not nullptr, extended with the code path of each step taken
+ *
+ *  return value:
+ *  FOUND or NOT_FOUND, or RETRY if node changed and the caller must retry
+ */
+template <typename T>
+typename ConcurrentEncryptionTree<T>::Result ConcurrentEncryptionTree<T>::attemptGet(
+        const T &item, Node *node, int dir, unsigned long long nodeVersion, string *code) const{
+    size_t length = code ? code->length() : 0;
+    while (true){
+        Node* child = node->child(dir);
+        if (!child){
+            return node->version.load() != nodeVersion ? RETRY : NOT_FOUND;
+        }
+        if (code){
+            code->resize(length);
+            if (node != &this->rootHolder){
+                code->push_back(dir < 0 ? '0' : '1');
+            }
+        }
+        int cmp = compare(item, child->key);
+        if (cmp == 0){
+            return child->present.load() ? FOUND : NOT_FOUND;
+        }
+        unsigned long long childVersion = child->version.load();
+        if (isShrinkingOrUnlinked(childVersion)){
+            waitUntilNotChanging(child);
+            if (node->version.load() != nodeVersion){
+                return RETRY;
+            }
+        }
+        else if (child != node->child(dir)){
+            if (node->version.load() != nodeVersion){
+                return RETRY;
+            }
+        }
+        else {
+            if (node->version.load() != nodeVersion){
+                return RETRY;
+            }
+            Result result = this->attemptGet(item, child, cmp, childVersion, code);
+            if (result != RETRY){
+                return result;
+            }
+        }
+    }
+}
+
+/* attemptDecrypt(const string&, size_t, Node*, int, unsigned long long, T&) const
+ * Follows the rest of a code path from the child on side dir of node,
+ * validating each step the way attemptGet() does
+ *  parameters:
+ *  path, code path being decrypted
+ *  pos, index in path of the next character to use
+ *  node, node whose child the walk continues at
+ *  dir, side of node to continue on (-1 for left, 1 for right)
+ *  nodeVersion, version of node seen when it was reached
+ *  item, set to the key the path ends at
+ *
+ *  return value:
+ *  FOUND or NOT_FOUND, or RETRY if node changed and the caller must retry
+ */
+template <typename T>
+typename ConcurrentEncryptionTree<T>::Result ConcurrentEncryptionTree<T>::attemptDecrypt(
+        const string &path, size_t pos, Node *node, int dir, unsigned long long nodeVersion,
+        T &item) const{
+    while (pos < path.length() && path.at(pos) != '0' && path.at(pos) != '1'){
+        pos++;
+    }
     while (true){
-        if (!(item < temp->getData()) && !(temp->getData() < item)){
-            if (code.empty()){
-                code += 'r';
-            }
-            return code;
+        Node* child = node->child(dir);
+        if (!child){
+            return node->version.load() != nodeVersion ? RETRY : NOT_FOUND;
         }
-        else if (item < temp->getData()){
-            if (code.empty()){
-                code += 'r';
-            }
-            if (temp->getLeft()){
-                code += '0';
-                temp = temp->getLeft();
+        unsigned long long childVersion = child->version.load();
+        if (isShrinkingOrUnlinked(childVersion)){
+            waitUntilNotChanging(child);
+            if (node->version.load() != nodeVersion){
+                return RETRY;
             }
-            else {
-                return "?";
+        }
+        else if (child != node->child(dir)){
+            if (node->version.load() != nodeVersion){
+                return RETRY;
             }
         }
         else {
-            if (code.empty()){
-                code += 'r';
+            if (node->version.load() != nodeVersion){
+                return RETRY;
             }
-            if (temp->getRight()){
-                code += '1';
-                temp = temp->getRight();
+            if (pos == path.length()){
+                if (!child->present.load()){
+                    return NOT_FOUND;
+                }
+                item = child->key;
+                return FOUND;
             }
-            else {
-                return "?";
+            Result result = this->attemptDecrypt(path, pos + 1, child, path.at(pos) == '0' ? -1 : 1,
+                                                 childVersion, item);
+            if (result != RETRY){
+                return result;
             }
         }
     }
 }
 
-/* decrypt(const string&) const
- * Decrypts the code path and returns the corresponding item
+/* attemptInsert(const T&, Node*, int, unsigned long long)
+ * Inserts item into the subtree on side dir of node, either by linking a new
+ * leaf under a locked parent or by marking a routing node present again
  *  parameters:
- *  path, code path to be decrypted
+ *  item, value to be inserted
+ *  node, node to insert below
+ *  dir, side of node to insert on (-1 for left, 1 for right)
+ *  nodeVersion, version of node seen when it was reached
  *
  *  return value:
- *  Pointer to the decrypted item
- *  Nullptr if path is invalid
+ *  FOUND if item was added, NOT_FOUND if it was already there, or RETRY
  */
 template <typename T>
-const T* EncryptionTree<T>::decrypt(const string &path) const{
-    if (!this->root){
-        return nullptr;
+typename ConcurrentEncryptionTree<T>::Result ConcurrentEncryptionTree<T>::attemptInsert(
+        const T &item, Node *node, int dir, unsigned long long nodeVersion){
+    while (true){
+        Node* child = node->child(dir);
+        if (node->version.load() != nodeVersion){
+            return RETRY;
+        }
+        if (!child){
+            bool linked = false;
+            {
+                lock_guard<mutex> guard(node->lock);
+                if (node->version.load() != nodeVersion){
+                    return RETRY;
+                }
+                if (!node->child(dir)){
+                    node->setChild(dir, new Node(item, true, node, 1));
+                    linked = true;
+                }
+            }
+            if (linked){
+                this->fixHeightAndRebalance(node);
+                return FOUND;
+            }
+            continue;
+        }
+        int cmp = compare(item, child->key);
+        if (cmp == 0){
+            lock_guard<mutex> guard(child->lock);
+            if (isUnlinked(child->version.load())){
+                continue;
+            }
+            if (child->present.load()){
+                return NOT_FOUND;
+            }
+            child->present.store(true);
+            return FOUND;
+        }
+        unsigned long long childVersion = child->version.load();
+        if (isShrinkingOrUnlinked(childVersion)){
+            waitUntilNotChanging(child);
+        }
+        else if (child == node->child(dir)){
+            if (node->version.load() != nodeVersion){
+                return RETRY;
+            }
+            Result result = this->attemptInsert(item, child, cmp, childVersion);
+            if (result != RETRY){
+                return result;
+            }
+        }
     }
-    const AVLNode<T>* temp = this->root;
-    for (int i = 0; i < path.length(); i++){
-        if(path.at(0) != 'r'){
-            return nullptr;
+}
+
+/* attemptRemove(const T&, Node*, int, unsigned long long)
+ * Finds item in the subtree on side dir of node and removes it
+ *  parameters:
+ *  item, value to be removed
+ *  node, node to search below
+ *  dir, side of node to search (-1 for left, 1 for right)
+ *  nodeVersion, version of node seen when it was reached
+ *
+ *  return value:
+ *  FOUND if item was removed, NOT_FOUND if it was not there, or RETRY
+ */
+template <typename T>
+typename ConcurrentEncryptionTree<T>::Result ConcurrentEncryptionTree<T>::attemptRemove(
+        const T &item, Node *node, int dir, unsigned long long nodeVersion){
+    while (true){
+        Node* child = node->child(dir);
+        if (node->version.load() != nodeVersion){
+            return RETRY;
         }
-        else if (path.at(i) == '0'){
-            if (temp->getLeft()){
-                temp = temp->getLeft();
+        if (!child){
+            return NOT_FOUND;
+        }
+        int cmp = compare(item, child->key);
+        if (cmp == 0){
+            Result result = this->attemptRemoveNode(node, child);
+            if (result != RETRY){
+                return result;
             }
-            else {
-                return nullptr;
+            continue;
+        }
+        unsigned long long childVersion = child->version.load();
+        if (isShrinkingOrUnlinked(childVersion)){
+            waitUntilNotChanging(child);
+        }
+        else if (child == node->child(dir)){
+            if (node->version.load() != nodeVersion){
+                return RETRY;
+            }
+            Result result = this->attemptRemove(item, child, cmp, childVersion);
+            if (result != RETRY){
+                return result;
             }
         }
-        else if (path.at(i) == '1'){
-            if (temp->getRight()){
-                temp = temp->getRight();
+    }
+}
+
+/* attemptRemoveNode(Node*, Node*)
+ * Removes the key held by n. A node with two children becomes a routing
+ * node under its own lock; otherwise it is unlinked under its parent's lock
+ * and the tree above is repaired
+ *  parameters:
+ *  parent, parent of n when n was reached
+ *  n, node holding the key to remove
+ *
+ *  return value:
+ *  FOUND if the key was removed, NOT_FOUND if it was not there, or RETRY
+ */
+template <typename T>
+typename ConcurrentEncryptionTree<T>::Result ConcurrentEncryptionTree<T>::attemptRemoveNode(
+        Node *parent, Node *n){
+    if (!n->present.load()){
+        return NOT_FOUND;
+    }
+    if (n->left.load() && n->right.load()){
+        lock_guard<mutex> guard(n->lock);
+        if (isUnlinked(n->version.load()) || !n->left.load() || !n->right.load()){
+            return RETRY;
+        }
+        if (!n->present.load()){
+            return NOT_FOUND;
+        }
+        n->present.store(false);
+        return FOUND;
+    }
+    {
+        lock_guard<mutex> parentGuard(parent->lock);
+        if (isUnlinked(parent->version.load()) || n->parent.load() != parent){
+            return RETRY;
+        }
+        lock_guard<mutex> guard(n->lock);
+        if (!n->present.load()){
+            return NOT_FOUND;
+        }
+        n->present.store(false);
+        if (n->left.load() && n->right.load()){
+            return FOUND;
+        }
+        this->attemptUnlink(parent, n);
+    }
+    this->fixHeightAndRebalance(parent);
+    return FOUND;
+}
+
+/* nodeCondition(Node*)
+ * Decides what repair a node needs, reading it without locks
+ *  parameters:
+ *  node, node to look at
+ *
+ *  return value:
+ *  UNLINK_REQUIRED for a routing node with at most one child,
+ *  REBALANCE_REQUIRED if its children's heights differ by more than one,
+ *  the height it should have if only that is wrong, or NOTHING_REQUIRED
+ */
+template <typename T>
+int ConcurrentEncryptionTree<T>::nodeCondition(Node *node){
+    Node* nL = node->left.load();
+    Node* nR = node->right.load();
+    if ((!nL || !nR) && !node->present.load()){
+        return UNLINK_REQUIRED;
+    }
+    int hN = node->height.load();
+    int hL0 = getHeight(nL), hR0 = getHeight(nR);
+    int hNRepl = 1 + (hL0 > hR0 ? hL0 : hR0);
+    int balance = hL0 - hR0;
+    if (balance < -1 || balance > 1){
+        return REBALANCE_REQUIRED;
+    }
+    return hN != hNRepl ? hNRepl : NOTHING_REQUIRED;
+}
+
+/* fixHeightAndRebalance(Node*)
+ * Repairs the tree from a damaged node up toward the root, locking only the
+ * nodes each repair step changes, until a node needs nothing done. A
+ * rotation may hand back a node below it that still needs work, so the
+ * parent of every rotated node is revisited once that work is done. Other
+ * threads can keep changing the tree meanwhile, so the number of parents
+ * waiting has no fixed bound and they are kept on a growable stack, which
+ * allocates nothing until the first rotation
+ *  parameters:
+ *  node, node whose subtree was changed
+ *
+ *  return value:
+ *
+ */
+template <typename T>
+void ConcurrentEncryptionTree<T>::fixHeightAndRebalance(Node *node){
+    vector<Node*> pending;
+    while (true){
+        int condition = NOTHING_REQUIRED;
+        if (node && node->parent.load() && !isUnlinked(node->version.load())){
+            condition = nodeCondition(node);
+        }
+        if (condition == NOTHING_REQUIRED){
+            if (pending.empty()){
+                return;
             }
-            else {
-                return nullptr;
+            node = pending.back();
+            pending.pop_back();
+        }
+        else if (condition != UNLINK_REQUIRED && condition != REBALANCE_REQUIRED){
+            lock_guard<mutex> guard(node->lock);
+            node = this->fixHeight(node);
+        }
+        else {
+            Node* nParent = node->parent.load();
+            lock_guard<mutex> parentGuard(nParent->lock);
+            if (!isUnlinked(nParent->version.load()) && node->parent.load() == nParent){
+                lock_guard<mutex> guard(node->lock);
+                pending.push_back(nParent);
+                node = this->rebalance(nParent, node);
             }
         }
     }
-    return &temp->getData();
+}
+
+/* fixHeight(Node*)
+ * Corrects the height of a locked node if that is all it needs
+ *  parameters:
+ *  node, locked node
+ *
+ *  return value:
+ *  The next node to repair: node itself if it needs more than a height fix,
+ *  its parent if its height changed, or nullptr if nothing changed
+ */
+template <typename T>
+typename ConcurrentEncryptionTree<T>::Node* ConcurrentEncryptionTree<T>::fixHeight(Node *node){
+    int condition = nodeCondition(node);
+    if (condition == REBALANCE_REQUIRED || condition == UNLINK_REQUIRED){
+        return node;
+    }
+    if (condition == NOTHING_REQUIRED){
+        return nullptr;
+    }
+    node->height.store(condition);
+    return node->parent.load();
+}
+
+/* rebalance(Node*, Node*)
+ * Unlinks, rotates or fixes the height of a node, with it and its parent locked
+ *  parameters:
+ *  nParent, locked parent of n
+ *  n, locked node to repair
+ *
+ *  return value:
+ *  The next node to repair, or nullptr if the repair is finished
+ */
+template <typename T>
+typename ConcurrentEncryptionTree<T>::Node* ConcurrentEncryptionTree<T>::rebalance(Node *nParent, Node *n){
+    Node* nL = n->left.load();
+    Node* nR = n->right.load();
+    if ((!nL || !nR) && !n->present.load()){
+        if (this->attemptUnlink(nParent, n)){
+            return this->fixHeight(nParent);
+        }
+        return n;
+    }
+    int hN = n->height.load();
+    int hL0 = getHeight(nL), hR0 = getHeight(nR);
+    int hNRepl = 1 + (hL0 > hR0 ? hL0 : hR0);
+    int balance = hL0 - hR0;
+    if (balance > 1){
+        return this->rebalanceToRight(nParent, n, nL, hR0);
+    }
+    if (balance < -1){
+        return this->rebalanceToLeft(nParent, n, nR, hL0);
+    }
+    if (hNRepl != hN){
+        n->height.store(hNRepl);
+        return this->fixHeight(nParent);
+    }
+    return nullptr;
+}
+
+/* rebalanceToRight(Node*, Node*, Node*, int)
+ * Moves height from the left of n to its right with a single or double
+ * rotation, locking the left child and, for a double rotation, its right child
+ *  parameters:
+ *  nParent, locked parent of n
+ *  n, locked node that is too tall on the left
+ *  nL, left child of n
+ *  hR0, height of n's right subtree
+ *
+ *  return value:
+ *  The next node to repair, or nullptr if the repair is finished
+ */
+template <typename T>
+typename ConcurrentEncryptionTree<T>::Node* ConcurrentEncryptionTree<T>::rebalanceToRight(
+        Node *nParent, Node *n, Node *nL, int hR0){
+    lock_guard<mutex> leftGuard(nL->lock);
+    int hL = nL->height.load();
+    if (hL - hR0 <= 1){
+        return n;
+    }
+    Node* nLR = nL->right.load();
+    int hLL0 = getHeight(nL->left.load());
+    int hLR0 = getHeight(nLR);
+    if (hLL0 >= hLR0){
+        return this->rotateRight(nParent, n, nL, hR0, hLL0, nLR, hLR0);
+    }
+    {
+        lock_guard<mutex> grandGuard(nLR->lock);
+        int hLR = nLR->height.load();
+        if (hLL0 >= hLR){
+            return this->rotateRight(nParent, n, nL, hR0, hLL0, nLR, hLR);
+        }
+        int hLRL = getHeight(nLR->left.load());
+        int balance = hLL0 - hLRL;
+        if (balance >= -1 && balance <= 1){
+            return this->rotateRightOverLeft(nParent, n, nL, hR0, hLL0, nLR, hLRL);
+        }
+    }
+    return this->rebalanceToLeft(n, nL, nLR, hLL0);
+}
+
+/* rebalanceToLeft(Node*, Node*, Node*, int)
+ * Mirror image of rebalanceToRight()
+ *  parameters:
+ *  nParent, locked parent of n
+ *  n, locked node that is too tall on the right
+ *  nR, right child of n
+ *  hL0, height of n's left subtree
+ *
+ *  return value:
+ *  The next node to repair, or nullptr if the repair is finished
+ */
+template <typename T>
+typename ConcurrentEncryptionTree<T>::Node* ConcurrentEncryptionTree<T>::rebalanceToLeft(
+        Node *nParent, Node *n, Node *nR, int hL0){
+    lock_guard<mutex> rightGuard(nR->lock);
+    int hR = nR->height.load();
+    if (hL0 - hR >= -1){
+        return n;
+    }
+    Node* nRL = nR->left.load();
+    int hRL0 = getHeight(nRL);
+    int hRR0 = getHeight(nR->right.load());
+    if (hRR0 >= hRL0){
+        return this->rotateLeft(nParent, n, hL0, nR, nRL, hRL0, hRR0);
+    }
+    {
+        lock_guard<mutex> grandGuard(nRL->lock);
+        int hRL = nRL->height.load();
+        if (hRR0 >= hRL){
+            return this->rotateLeft(nParent, n, hL0, nR, nRL, hRL, hRR0);
+        }
+        int hRLR = getHeight(nRL->right.load());
+        int balance = hRR0 - hRLR;
+        if (balance >= -1 && balance <= 1){
+            return this->rotateLeftOverRight(nParent, n, hL0, nR, nRL, hRR0, hRLR);
+        }
+    }
+    return this->rebalanceToRight(n, nR, nRL, hRR0);
+}
+
+/* rotateRight(Node*, Node*, Node*, int, int, Node*, int)
+ * Single rotation to the right at n, with nParent, n and nL locked. n moves
+ * down, so it is marked as shrinking while its links change
+ *  parameters:
+ *  nParent, locked parent of n
+ *  n, locked node to rotate
+ *  nL, locked left child of n, which takes n's place
+ *  hR, height of n's right subtree
+ *  hLL, height of nL's left subtree
+ *  nLR, right child of nL, which moves under n
+ *  hLR, height of nLR
+ *
+ *  return value:
+ *  The next node to repair, or nullptr if the repair is finished
+ */
+template <typename T>
+typename ConcurrentEncryptionTree<T>::Node* ConcurrentEncryptionTree<T>::rotateRight(
+        Node *nParent, Node *n, Node *nL, int hR, int hLL, Node *nLR, int hLR){
+    unsigned long long nodeVersion = n->version.load();
+    Node* nPL = nParent->left.load();
+    n->version.store(beginChange(nodeVersion));
+    n->left.store(nLR);
+    if (nLR){
+        nLR->parent.store(n);
+    }
+    nL->right.store(n);
+    n->parent.store(nL);
+    if (nPL == n){
+        nParent->left.store(nL);
+    }
+    else {
+        nParent->right.store(nL);
+    }
+    nL->parent.store(nParent);
+    int hNRepl = 1 + (hLR > hR ? hLR : hR);
+    n->height.store(hNRepl);
+    nL->height.store(1 + (hLL > hNRepl ? hLL : hNRepl));
+    n->version.store(endChange(nodeVersion));
+
+    int balanceN = hLR - hR;
+    if (balanceN < -1 || balanceN > 1){
+        return n;
+    }
+    if ((!nLR || hR == 0) && !n->present.load()){
+        return n;
+    }
+    int balanceL = hLL - hNRepl;
+    if (balanceL < -1 || balanceL > 1){
+        return nL;
+    }
+    if (hLL == 0 && !nL->present.load()){
+        return nL;
+    }
+    return this->fixHeight(nParent);
+}
+
+/* rotateLeft(Node*, Node*, int, Node*, Node*, int, int)
+ * Mirror image of rotateRight()
+ *  parameters:
+ *  nParent, locked parent of n
+ *  n, locked node to rotate
+ *  hL, height of n's left subtree
+ *  nR, locked right child of n, which takes n's place
+ *  nRL, left child of nR, which moves under n
+ *  hRL, height of nRL
+ *  hRR, height of nR's right subtree
+ *
+ *  return value:
+ *  The next node to repair, or nullptr if the repair is finished
+ */
+template <typename T>
+typename ConcurrentEncryptionTree<T>::Node* ConcurrentEncryptionTree<T>::rotateLeft(
+        Node *nParent, Node *n, int hL, Node *nR, Node *nRL, int hRL, int hRR){
+    unsigned long long nodeVersion = n->version.load();
+    Node* nPL = nParent->left.load();
+    n->version.store(beginChange(nodeVersion));
+    n->right.store(nRL);
+    if (nRL){
+        nRL->parent.store(n);
+    }
+    nR->left.store(n);
+    n->parent.store(nR);
+    if (nPL == n){
+        nParent->left.store(nR);
+    }
+    else {
+        nParent->right.store(nR);
+    }
+    nR->parent.store(nParent);
+    int hNRepl = 1 + (hL > hRL ? hL : hRL);
+    n->height.store(hNRepl);
+    nR->height.store(1 + (hNRepl > hRR ? hNRepl : hRR));
+    n->version.store(endChange(nodeVersion));
+
+    int balanceN = hRL - hL;
+    if (balanceN < -1 || balanceN > 1){
+        return n;
+    }
+    if ((!nRL || hL == 0) && !n->present.load()){
+        return n;
+    }
+    int balanceR = hRR - hNRepl;
+    if (balanceR < -1 || balanceR > 1){
+        return nR;
+    }
+    if (hRR == 0 && !nR->present.load()){
+        return nR;
+    }
+    return this->fixHeight(nParent);
+}
+
+/* rotateRightOverLeft(Node*, Node*, Node*, int, int, Node*, int)
+ * Double rotation at n that lifts nLR, the right child of n's left child,
+ * into n's place. n and nL both move down and are marked as shrinking
+ *  parameters:
+ *  nParent, locked parent of n
+ *  n, locked node to rotate
+ *  nL, locked left child of n
+ *  hR, height of n's right subtree
+ *  hLL, height of nL's left subtree
+ *  nLR, locked right child of nL, which takes n's place
+ *  hLRL, height of nLR's left subtree
+ *
+ *  return value:
+ *  The next node to repair, or nullptr if the repair is finished
+ */
+template <typename T>
+typename ConcurrentEncryptionTree<T>::Node* ConcurrentEncryptionTree<T>::rotateRightOverLeft(
+        Node *nParent, Node *n, Node *nL, int hR, int hLL, Node *nLR, int hLRL){
+    unsigned long long nodeVersion = n->version.load();
+    unsigned long long leftVersion = nL->version.load();
+    Node* nPL = nParent->left.load();
+    Node* nLRL = nLR->left.load();
+    Node* nLRR = nLR->right.load();
+    int hLRR = getHeight(nLRR);
+    n->version.store(beginChange(nodeVersion));
+    nL->version.store(beginChange(leftVersion));
+    n->left.store(nLRR);
+    if (nLRR){
+        nLRR->parent.store(n);
+    }
+    nL->right.store(nLRL);
+    if (nLRL){
+        nLRL->parent.store(nL);
+    }
+    nLR->left.store(nL);
+    nL->parent.store(nLR);
+    nLR->right.store(n);
+    n->parent.store(nLR);
+    if (nPL == n){
+        nParent->left.store(nLR);
+    }
+    else {
+        nParent->right.store(nLR);
+    }
+    nLR->parent.store(nParent);
+    int hNRepl = 1 + (hLRR > hR ? hLRR : hR);
+    n->height.store(hNRepl);
+    int hLRepl = 1 + (hLL > hLRL ? hLL : hLRL);
+    nL->height.store(hLRepl);
+    nLR->height.store(1 + (hLRepl > hNRepl ? hLRepl : hNRepl));
+    n->version.store(endChange(nodeVersion));
+    nL->version.store(endChange(leftVersion));
+
+    int balanceN = hLRR - hR;
+    if (balanceN < -1 || balanceN > 1){
+        return n;
+    }
+    if ((!nLRR || hR == 0) && !n->present.load()){
+        return n;
+    }
+    if ((!nLRL || hLL == 0) && !nL->present.load()){
+        return nL;
+    }
+    int balanceLR = hLRepl - hNRepl;
+    if (balanceLR < -1 || balanceLR > 1){
+        return nLR;
+    }
+    return this->fixHeight(nParent);
+}
+
+/* rotateLeftOverRight(Node*, Node*, int, Node*, Node*, int, int)
+ * Mirror image of rotateRightOverLeft()
+ *  parameters:
+ *  nParent, locked parent of n
+ *  n, locked node to rotate
+ *  hL, height of n's left subtree
+ *  nR, locked right child of n
+ *  nRL, locked left child of nR, which takes n's place
+ *  hRR, height of nR's right subtree
+ *  hRLR, height of nRL's right subtree
+ *
+ *  return value:
+ *  The next node to repair, or nullptr if the repair is finished
+ */
+template <typename T>
+typename ConcurrentEncryptionTree<T>::Node* ConcurrentEncryptionTree<T>::rotateLeftOverRight(
+        Node *nParent, Node *n, int hL, Node *nR, Node *nRL, int hRR, int hRLR){
+    unsigned long long nodeVersion = n->version.load();
+    unsigned long long rightVersion = nR->version.load();
+    Node* nPL = nParent->left.load();
+    Node* nRLL = nRL->left.load();
+    Node* nRLR = nRL->right.load();
+    int hRLL = getHeight(nRLL);
+    n->version.store(beginChange(nodeVersion));
+    nR->version.store(beginChange(rightVersion));
+    n->right.store(nRLL);
+    if (nRLL){
+        nRLL->parent.store(n);
+    }
+    nR->left.store(nRLR);
+    if (nRLR){
+        nRLR->parent.store(nR);
+    }
+    nRL->right.store(nR);
+    nR->parent.store(nRL);
+    nRL->left.store(n);
+    n->parent.store(nRL);
+    if (nPL == n){
+        nParent->left.store(nRL);
+    }
+    else {
+        nParent->right.store(nRL);
+    }
+    nRL->parent.store(nParent);
+    int hNRepl = 1 + (hL > hRLL ? hL : hRLL);
+    n->height.store(hNRepl);
+    int hRRepl = 1 + (hRLR > hRR ? hRLR : hRR);
+    nR->height.store(hRRepl);
+    nRL->height.store(1 + (hNRepl > hRRepl ? hNRepl : hRRepl));
+    n->version.store(endChange(nodeVersion));
+    nR->version.store(endChange(rightVersion));
+
+    int balanceN = hRLL - hL;
+    if (balanceN < -1 || balanceN > 1){
+        return n;
+    }
+    if ((!nRLL || hL == 0) && !n->present.load()){
+        return n;
+    }
+    if ((!nRLR || hRR == 0) && !nR->present.load()){
+        return nR;
+    }
+    int balanceRL = hRRepl - hNRepl;
+    if (balanceRL < -1 || balanceRL > 1){
+        return nRL;
+    }
+    return this->fixHeight(nParent);
+}
+
+/* attemptUnlink(Node*, Node*)
+ * Takes a node with at most one child out of the tree, with it and its
+ * parent locked, and retires it
+ *  parameters:
+ *  parent, locked parent of n
+ *  n, locked node to unlink
+ *
+ *  return value:
+ *  true if n was unlinked, false if it is no longer parent's child or has
+ *  gained a second child
+ */
+template <typename T>
+bool ConcurrentEncryptionTree<T>::attemptUnlink(Node *parent, Node *n){
+    Node* parentL = parent->left.load();
+    Node* parentR = parent->right.load();
+    if (parentL != n && parentR != n){
+        return false;
+    }
+    Node* nL = n->left.load();
+    Node* nR = n->right.load();
+    if (nL && nR){
+        return false;
+    }
+    Node* splice = nL ? nL : nR;
+    if (parentL == n){
+        parent->left.store(splice);
+    }
+    else {
+        parent->right.store(splice);
+    }
+    if (splice){
+        splice->parent.store(parent);
+    }
+    n->version.store(UNLINKED);
+    n->present.store(false);
+    this->retire(n);
+    return true;
+}
+
+/* retire(Node*)
+ * Queues an unlinked node for deletion under the next epoch, and now and
+ * then deletes the nodes no thread can still be reading
+ *  parameters:
+ *  n, node that has just been unlinked
+ *
+ *  return value:
+ *
+ */
+template <typename T>
+void ConcurrentEncryptionTree<T>::retire(Node *n){
+    lock_guard<mutex> guard(this->retireLock);
+    this->retired.push_back(make_pair(this->epoch.fetch_add(1) + 1, n));
+    if (this->retired.size() % RECLAIM_BATCH == 0){
+        this->reclaim();
+    }
+}
+
+/* reclaim()
+ * Deletes the retired nodes whose epoch is no newer than the oldest epoch any
+ * thread has announced; retireLock must be held
+ *  parameters:
+ *
+ *  return value:
+ *
+ */
+template <typename T>
+void ConcurrentEncryptionTree<T>::reclaim(){
+    unsigned long long oldest = ~0ULL;
+    for (size_t i = 0; i < MAX_THREADS; i++){
+        unsigned long long e = this->threads[i].epoch.load();
+        if (e && e < oldest){
+            oldest = e;
+        }
+    }
+    while (!this->retired.empty() && this->retired.front().first <= oldest){
+        delete this->retired.front().second;
+        this->retired.pop_front();
+    }
 }
 
 #endif
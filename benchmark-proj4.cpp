@@ -0,0 +1,99 @@
+/* CSI 3334
+ * Project 4 -- AVL Tree
+ * Filename: benchmark-proj4.cpp
+ * Name: Eugene Pak
+ * Version 1.0
+ * This program measures how a ConcurrentEncryptionTree scales from one thread
+ * up to many, against an AVLTree that every thread shares behind one mutex.
+ */
+
+#include <iostream>
+#include <chrono>
+#include <random>
+#include "avl-tree-student-proj4.h"
+
+using namespace std;
+
+const int KEY_RANGE = 1 << 16;
+const int OPS_PER_THREAD = 200000;
+
+/* runWorkload
+ * Starts the given number of threads, each doing OPS_PER_THREAD random
+ * operations on keys below KEY_RANGE: half searches, a quarter inserts and a
+ * quarter removes
+ *  parameters:
+ *      threads -- the number of threads to run
+ *      doInsert, doRemove, doFind -- the operations on the tree being timed
+ *  return value: the total operations per second
+ */
+template <typename Insert, typename Remove, typename Find>
+double runWorkload(unsigned threads, Insert doInsert, Remove doRemove, Find doFind){
+    vector<thread> workers;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (unsigned t = 0; t < threads; t++){
+        workers.push_back(thread([&, t](){
+            mt19937 rng(t + 1);
+            for (int i = 0; i < OPS_PER_THREAD; i++){
+                int key = rng() % KEY_RANGE;
+                unsigned op = rng() % 4;
+                if (op == 0){
+                    doInsert(key);
+                }
+                else if (op == 1){
+                    doRemove(key);
+                }
+                else {
+                    doFind(key);
+                }
+            }
+        }));
+    }
+    for (size_t t = 0; t < workers.size(); t++){
+        workers[t].join();
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    return threads * (double)OPS_PER_THREAD / elapsed.count();
+}
+
+/* main
+ * Prefills both trees with half of the key range, then times the same mixed
+ * workload on each for every thread count from 1 to N and prints one line per
+ * thread count
+ *  parameters:
+ *      argc -- the number of arguments from the command line
+ *      argv -- argv[1], if given, is N; otherwise N is the number of cores
+ *  return value: 0 (indicating a successful run)
+ */
+int main(int argc, char**argv) {
+    unsigned maxThreads = thread::hardware_concurrency();
+    if (argc > 1){
+        maxThreads = atoi(argv[1]);
+    }
+    if (maxThreads == 0){
+        maxThreads = 1;
+    }
+
+    cout << "threads\tglobal lock ops/s\tconcurrent ops/s" << endl;
+    for (unsigned threads = 1; threads <= maxThreads; threads++){
+        AVLTree<int> locked;
+        mutex treeLock;
+        ConcurrentEncryptionTree<int> concurrent;
+        for (int key = 0; key < KEY_RANGE; key += 2){
+            locked.insert(key);
+            concurrent.insert(key);
+        }
+
+        double lockedRate = runWorkload(threads,
+            [&](int key) { lock_guard<mutex> guard(treeLock); locked.insert(key); },
+            [&](int key) { lock_guard<mutex> guard(treeLock); locked.remove(key); },
+            [&](int key) { lock_guard<mutex> guard(treeLock); locked.find(key); });
+        double concurrentRate = runWorkload(threads,
+            [&](int key) { concurrent.insert(key); },
+            [&](int key) { concurrent.remove(key); },
+            [&](int key) { concurrent.contains(key); });
+
+        cout << threads << '\t' << (long long)lockedRate << '\t' << (long long)concurrentRate << endl;
+    }
+
+    return 0;
+}
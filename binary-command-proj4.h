@@ -0,0 +1,337 @@
+#ifndef BINARY_COMMAND_PROJ4
+#define BINARY_COMMAND_PROJ4
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <sstream>
+#include <cstdint>
+#include "avl-tree-student-proj4.h"
+#include "command-io-proj4.h"
+
+using namespace std;
+
+/* The binary command format carries the same commands as the driver's text
+ * format, without any parsing. Every command is one record: the command
+ * letter ('i', 'r', 'e', 'd', 'p', 'l' or 'q') in one byte, then the length
+ * of the payload as a 4-byte little-endian number, then the payload:
+ *
+ *    i, r      the word to insert or remove
+ *    e         the words of the message, each as a 4-byte length then bytes
+ *    d         the code paths of the message, the same way
+ *    p, l, q   nothing
+ *
+ * Commands that print something get one response record, in the same order
+ * and the same layout (letter, length, payload):
+ *
+ *    e         the code path of each word, each as a 4-byte length then bytes
+ *    d         the word for each path, the same way; an invalid path has the
+ *              length 0xFFFFFFFF and no bytes
+ *    p, l      the text printPreorder() or printLevelOrder() writes
+ *
+ * Unlike the text driver's output, responses keep no record of spacing, so
+ * a message with a trailing space gets the same response as one without.
+ *
+ * The BinaryExecutor class runs a binary command stream against a tree. It
+ * reads the records through a CommandReader and collects runs of adjacent
+ * commands of the same kind into one group before running them: a run of
+ * inserts goes to insertBatch() if it has at least WordTree::BATCH_MIN words,
+ * a run of removes goes through remove() one after another, and a run of e
+ * or d commands is answered with one encryptMany() or decryptMany() over all
+ * of its words, which is then split back into one response per command. A
+ * group is also run once it holds CommandReader::GROUP_BYTES bytes of words,
+ * so a stream of any length is handled in bounded memory. Cutting a run of
+ * removes, e or d commands into several groups does not change the results.
+ * A run of inserts longer than that goes to insertBatch() in parts, which can
+ * leave the tree in a different (still balanced) shape than one batch would,
+ * and so change the code paths of later e commands; the text driver cuts its
+ * runs of inserts the same way.
+ *
+ * The run() method returns false if the stream is malformed: an unknown
+ * command letter, a record cut off by the end of the input, or an e or d
+ * payload whose lengths do not add up. Commands before the bad record have
+ * been run and answered by then.
+ *
+ * textToBinary() converts a text command stream, as read by the driver, into
+ * the binary format, so old command logs can be replayed through the
+ * executor. It stops after a q, as the driver does.
+ */
+typedef EncryptionTree<string, less<> > WordTree;
+
+class BinaryExecutor {
+  protected:
+    WordTree &tree;
+    ostream &out;
+
+    // the current group: its command letter, the bytes of all its words,
+    // where each word ends, and how many words each command has
+    char kind;
+    string bytes;
+    vector<size_t> wordEnds;
+    vector<size_t> wordCounts;
+
+    bool addCommand(char command, string_view payload);
+    void runGroup();
+
+    // disallow copying, since the executor refers to a tree and a stream
+    BinaryExecutor(const BinaryExecutor &other) : tree(other.tree), out(other.out) { assert(false); }
+    BinaryExecutor &operator=(const BinaryExecutor &) { assert(false); return *this; }
+
+  public:
+    BinaryExecutor(WordTree &tree, ostream &out) : tree(tree), out(out), kind(0) {}
+
+    bool run(CommandReader &in);
+};
+
+void putLength(ostream &out, uint32_t length);
+uint32_t getLength(const char *bytes);
+void textToBinary(CommandReader &in, ostream &out);
+
+/* putLength(ostream&, uint32_t)
+ * Writes a length as 4 little-endian bytes
+ *  parameters:
+ *  out, stream to write to
+ *  length, value to write
+ *
+ *  return value:
+ *  none
+ */
+inline void putLength(ostream &out, uint32_t length){
+    char bytes[4] = { char(length), char(length >> 8), char(length >> 16), char(length >> 24) };
+    out.write(bytes, 4);
+}
+
+/* getLength(const char*)
+ * Reads a length stored as 4 little-endian bytes
+ *  parameters:
+ *  bytes, start of the 4 bytes
+ *
+ *  return value:
+ *  The length
+ */
+inline uint32_t getLength(const char *bytes){
+    const unsigned char *b = reinterpret_cast<const unsigned char *>(bytes);
+    return b[0] | (b[1] << 8) | (b[2] << 16) | (uint32_t(b[3]) << 24);
+}
+
+/* addCommand(char, string_view)
+ * Adds the words of an i, r, e or d command to the current group, running
+ * the group first if it is of another kind or already full
+ *  parameters:
+ *  command, letter of the command
+ *  payload, payload of the command's record
+ *
+ *  return value:
+ *  true if the command was added
+ *  false if an e or d payload is malformed
+ */
+inline bool BinaryExecutor::addCommand(char command, string_view payload){
+    if (command != this->kind || this->bytes.size() >= CommandReader::GROUP_BYTES){
+        this->runGroup();
+        this->kind = command;
+    }
+    if (command == 'i' || command == 'r'){
+        this->bytes.append(payload.data(), payload.size());
+        this->wordEnds.push_back(this->bytes.size());
+        this->wordCounts.push_back(1);
+        return true;
+    }
+    size_t count = 0;
+    size_t at = 0;
+    while (at < payload.size()){
+        if (payload.size() - at < 4){
+            return false;
+        }
+        uint32_t length = getLength(payload.data() + at);
+        at += 4;
+        if (payload.size() - at < length){
+            return false;
+        }
+        this->bytes.append(payload.data() + at, length);
+        this->wordEnds.push_back(this->bytes.size());
+        at += length;
+        count++;
+    }
+    this->wordCounts.push_back(count);
+    return true;
+}
+
+/* runGroup()
+ * Runs the commands of the current group against the tree, writes their
+ * responses, and empties the group
+ *  parameters:
+ *  none
+ *
+ *  return value:
+ *  none
+ */
+inline void BinaryExecutor::runGroup(){
+    vector<string_view> words;
+    words.reserve(this->wordEnds.size());
+    size_t start = 0;
+    for (size_t i = 0; i < this->wordEnds.size(); i++){
+        words.push_back(string_view(this->bytes).substr(start, this->wordEnds[i] - start));
+        start = this->wordEnds[i];
+    }
+
+    if (this->kind == 'i'){
+        if (words.size() >= WordTree::BATCH_MIN){
+            this->tree.insertBatch(vector<string>(words.begin(), words.end()));
+        }
+        else {
+            for (size_t i = 0; i < words.size(); i++){
+                this->tree.insert(string(words[i]));
+            }
+        }
+    }
+    else if (this->kind == 'r'){
+        for (size_t i = 0; i < words.size(); i++){
+            this->tree.remove(words[i]);
+        }
+    }
+    else if (this->kind == 'e'){
+        vector<string> codes = this->tree.encryptMany(words);
+        size_t next = 0;
+        for (size_t c = 0; c < this->wordCounts.size(); c++){
+            size_t length = 0;
+            for (size_t i = next; i < next + this->wordCounts[c]; i++){
+                length += 4 + codes[i].size();
+            }
+            this->out.put('e');
+            putLength(this->out, length);
+            for (size_t i = next; i < next + this->wordCounts[c]; i++){
+                putLength(this->out, codes[i].size());
+                this->out.write(codes[i].data(), codes[i].size());
+            }
+            next += this->wordCounts[c];
+        }
+    }
+    else if (this->kind == 'd'){
+        vector<const string *> decoded = this->tree.decryptMany(words);
+        size_t next = 0;
+        for (size_t c = 0; c < this->wordCounts.size(); c++){
+            size_t length = 0;
+            for (size_t i = next; i < next + this->wordCounts[c]; i++){
+                length += 4 + (decoded[i] ? decoded[i]->size() : 0);
+            }
+            this->out.put('d');
+            putLength(this->out, length);
+            for (size_t i = next; i < next + this->wordCounts[c]; i++){
+                if (decoded[i]){
+                    putLength(this->out, decoded[i]->size());
+                    this->out.write(decoded[i]->data(), decoded[i]->size());
+                }
+                else {
+                    putLength(this->out, 0xFFFFFFFF);
+                }
+            }
+            next += this->wordCounts[c];
+        }
+    }
+
+    this->kind = 0;
+    this->bytes.clear();
+    this->wordEnds.clear();
+    this->wordCounts.clear();
+}
+
+/* run(CommandReader&)
+ * Runs every command in a binary command stream, up to a q or the end of
+ * the input, and writes the responses
+ *  parameters:
+ *  in, reader for the binary command stream
+ *
+ *  return value:
+ *  true if the whole stream was run
+ *  false if a malformed record stopped it
+ */
+inline bool BinaryExecutor::run(CommandReader &in){
+    string_view letter, header, payload;
+    bool ok = true;
+    while (in.nextBytes(1, letter)){
+        char command = letter[0];
+        if (!in.nextBytes(4, header) || !in.nextBytes(getLength(header.data()), payload)){
+            ok = false;
+            break;
+        }
+        if (command == 'i' || command == 'r' || command == 'e' || command == 'd'){
+            if (!this->addCommand(command, payload)){
+                ok = false;
+                break;
+            }
+            continue;
+        }
+        this->runGroup();
+        if (command == 'p' || command == 'l'){
+            ostringstream text;
+            if (command == 'p'){
+                this->tree.printPreorder(text);
+            }
+            else {
+                this->tree.printLevelOrder(text);
+            }
+            string printed = text.str();
+            this->out.put(command);
+            putLength(this->out, printed.size());
+            this->out.write(printed.data(), printed.size());
+        }
+        else if (command == 'q'){
+            break;
+        }
+        else {
+            ok = false;
+            break;
+        }
+    }
+    this->runGroup();
+    return ok;
+}
+
+/* textToBinary(CommandReader&, ostream&)
+ * Converts a text command stream into the binary command format
+ *  parameters:
+ *  in, reader for the text command stream
+ *  out, stream to write the binary commands to
+ *
+ *  return value:
+ *  none
+ */
+inline void textToBinary(CommandReader &in, ostream &out){
+    char instruction;
+    string_view token, line;
+    while (in.nextChar(instruction)){
+        if (instruction == 'i' || instruction == 'r'){
+            if (in.nextToken(token)){
+                out.put(instruction);
+                putLength(out, token.size());
+                out.write(token.data(), token.size());
+            }
+        }
+        else if (instruction == 'e' || instruction == 'd'){
+            string_view content;
+            if (in.restOfLine(line) && line.length() >= 2){
+                content = line.substr(1, line.length() - 2);
+            }
+            vector<string_view> words = splitWords(content);
+            size_t length = 0;
+            for (size_t i = 0; i < words.size(); i++){
+                length += 4 + words[i].size();
+            }
+            out.put(instruction);
+            putLength(out, length);
+            for (size_t i = 0; i < words.size(); i++){
+                putLength(out, words[i].size());
+                out.write(words[i].data(), words[i].size());
+            }
+        }
+        else if (instruction == 'p' || instruction == 'l' || instruction == 'q'){
+            out.put(instruction);
+            putLength(out, 0);
+            if (instruction == 'q'){
+                return;
+            }
+        }
+    }
+}
+
+#endif
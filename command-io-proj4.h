@@ -0,0 +1,472 @@
+#ifndef COMMAND_IO_PROJ4
+#define COMMAND_IO_PROJ4
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <streambuf>
+#include <cassert>
+#include <cstring>
+#include <cctype>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+
+/* The CommandReader class reads the driver's command stream from a file
+ * descriptor without going through an istream. If the descriptor is a
+ * regular file (including stdin redirected from a file), the whole file is
+ * memory-mapped and read in place; pages that the cursor has moved past are
+ * handed back to the kernel every RELEASE_SIZE bytes, so even a very large
+ * file is read in roughly constant memory. Otherwise (a pipe or a terminal)
+ * the input is read in blocks of BLOCK_SIZE bytes into one buffer that only
+ * grows if a single line does not fit.
+ *
+ * The tokens returned by nextToken() and restOfLine() are views into the
+ * mapping or the buffer, so they are only valid until the next call on the
+ * reader. Copy them (into a string) if they must live longer.
+ *
+ * The methods follow the istream operations the driver used before:
+ * nextChar() is "cin >> c", nextToken() is "cin >> word", and restOfLine()
+ * is "cin.get(); getline(cin, line)". nextBytes() reads a fixed number of
+ * raw bytes, for binary input.
+ *
+ * The reader does not own the file descriptor; the caller closes it.
+ *
+ * A caller that gathers words from the reader before acting on them (a run of
+ * inserts, say) should act once it holds GROUP_BYTES bytes of them, so that
+ * its memory stays bounded however long the stream is.
+ */
+class CommandReader {
+  public:
+    static const size_t GROUP_BYTES = 16 << 20;
+
+  protected:
+    static const size_t BLOCK_SIZE = 1 << 20;
+    static const size_t RELEASE_SIZE = 64 << 20;
+
+    int fd;
+    char *mapped;
+    size_t mappedLength;
+    vector<char> buffer;
+    const char *data;
+    size_t pos, end, released;
+    bool eof;
+
+    bool fill();
+    bool available();
+    void release();
+
+    // disallow copying, since the reader refers to a mapping
+    CommandReader(const CommandReader &) { assert(false); }
+    CommandReader &operator=(const CommandReader &) { assert(false); return *this; }
+
+  public:
+    explicit CommandReader(int fd);
+    ~CommandReader();
+
+    bool nextChar(char &c);
+    bool nextToken(string_view &token);
+    bool restOfLine(string_view &line);
+    bool nextBytes(size_t length, string_view &bytes);
+};
+
+vector<string_view> splitWords(string_view line);
+
+/* The OutputBuffer class is a streambuf that collects everything written to
+ * it in one large buffer and writes it to a file descriptor only when the
+ * buffer fills, when flushAll() is called, or when it is destroyed. Unlike
+ * cout, it ignores flush requests (so endl costs no more than '\n'), which
+ * means output may not appear until the program finishes or the buffer fills.
+ * Writes larger than the buffer go straight to the descriptor. good() turns
+ * false for good once a write to the descriptor fails.
+ *
+ * Wrap it in an ostream to use it:
+ *
+ *    OutputBuffer outBuffer(1);
+ *    ostream out(&outBuffer);
+ */
+class OutputBuffer : public streambuf {
+  protected:
+    int fd;
+    vector<char> buffer;
+    bool writeFailed;
+
+    void writeOut(const char *bytes, size_t length);
+
+    virtual int_type overflow(int_type c);
+    virtual streamsize xsputn(const char *s, streamsize n);
+    virtual int sync() { return 0; }
+
+    // disallow copying, since the buffer would be written twice
+    OutputBuffer(const OutputBuffer &) : streambuf() { assert(false); }
+    OutputBuffer &operator=(const OutputBuffer &) { assert(false); return *this; }
+
+  public:
+    explicit OutputBuffer(int fd, size_t capacity = 1 << 20);
+    ~OutputBuffer() { flushAll(); }
+
+    void flushAll();
+    bool good() const { return !writeFailed; }
+};
+
+/* CommandReader(int)
+ * Maps the file behind the descriptor if it is a non-empty regular file,
+ * otherwise sets up an empty block buffer
+ *  parameters:
+ *  fd, file descriptor to read the commands from
+ *
+ *  return value:
+ *  none
+ */
+inline CommandReader::CommandReader(int fd) : fd(fd), mapped(NULL), mappedLength(0),
+        data(NULL), pos(0), end(0), released(0), eof(false){
+#ifdef __linux__
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0){
+        void *region = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (region != MAP_FAILED){
+            madvise(region, info.st_size, MADV_SEQUENTIAL);
+            this->mapped = static_cast<char *>(region);
+            this->mappedLength = info.st_size;
+            this->data = this->mapped;
+            this->end = this->mappedLength;
+            this->eof = true;
+            return;
+        }
+    }
+#endif
+    this->buffer.resize(BLOCK_SIZE);
+    this->data = this->buffer.data();
+}
+
+/* ~CommandReader()
+ * Unmaps the file, if it was mapped
+ *  parameters:
+ *  none
+ *
+ *  return value:
+ *  none
+ */
+inline CommandReader::~CommandReader(){
+#ifdef __linux__
+    if (this->mapped){
+        munmap(this->mapped, this->mappedLength);
+    }
+#endif
+}
+
+/* fill()
+ * Moves the unread bytes to the front of the block buffer (growing it if it
+ * is full) and reads the next block after them
+ *  parameters:
+ *  none
+ *
+ *  return value:
+ *  true if any bytes were read
+ *  false at the end of the input
+ */
+inline bool CommandReader::fill(){
+    if (this->eof){
+        return false;
+    }
+    if (this->pos > 0){
+        memmove(this->buffer.data(), this->buffer.data() + this->pos, this->end - this->pos);
+        this->end -= this->pos;
+        this->pos = 0;
+    }
+    if (this->end == this->buffer.size()){
+        this->buffer.resize(this->buffer.size() * 2);
+    }
+    this->data = this->buffer.data();
+    ssize_t got;
+    do {
+        got = read(this->fd, this->buffer.data() + this->end, this->buffer.size() - this->end);
+    } while (got < 0 && errno == EINTR);
+    if (got <= 0){
+        this->eof = true;
+        return false;
+    }
+    this->end += got;
+    return true;
+}
+
+/* available()
+ * Makes sure there is at least one unread byte, reading more if needed
+ *  parameters:
+ *  none
+ *
+ *  return value:
+ *  true if there is an unread byte at pos
+ *  false at the end of the input
+ */
+inline bool CommandReader::available(){
+    return this->pos < this->end || this->fill();
+}
+
+/* release()
+ * Tells the kernel it can drop the mapped pages the cursor has moved past,
+ * once at least RELEASE_SIZE bytes of them have piled up
+ *  parameters:
+ *  none
+ *
+ *  return value:
+ *  none
+ */
+inline void CommandReader::release(){
+#ifdef __linux__
+    if (this->mapped && this->pos - this->released >= RELEASE_SIZE){
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t upTo = this->pos / page * page;
+        madvise(this->mapped + this->released, upTo - this->released, MADV_DONTNEED);
+        this->released = upTo;
+    }
+#endif
+}
+
+/* nextChar(char&)
+ * Skips whitespace and reads the next character
+ *  parameters:
+ *  c, set to the character read
+ *
+ *  return value:
+ *  true if a character was read
+ *  false at the end of the input
+ */
+inline bool CommandReader::nextChar(char &c){
+    this->release();
+    while (this->available() && isspace(static_cast<unsigned char>(this->data[this->pos]))){
+        this->pos++;
+    }
+    if (!this->available()){
+        return false;
+    }
+    c = this->data[this->pos++];
+    return true;
+}
+
+/* nextToken(string_view&)
+ * Skips whitespace and reads the next run of non-whitespace characters
+ *  parameters:
+ *  token, set to a view of the characters read
+ *
+ *  return value:
+ *  true if a token was read
+ *  false at the end of the input
+ */
+inline bool CommandReader::nextToken(string_view &token){
+    while (this->available() && isspace(static_cast<unsigned char>(this->data[this->pos]))){
+        this->pos++;
+    }
+    if (!this->available()){
+        return false;
+    }
+    size_t start = this->pos;
+    while (true){
+        while (this->pos < this->end && !isspace(static_cast<unsigned char>(this->data[this->pos]))){
+            this->pos++;
+        }
+        if (this->pos < this->end){
+            break;
+        }
+        // fill() moves the token to the front of the buffer
+        size_t length = this->pos - start;
+        this->pos = start;
+        bool more = this->fill();
+        start = this->pos;
+        this->pos = start + length;
+        if (!more){
+            break;
+        }
+    }
+    token = string_view(this->data + start, this->pos - start);
+    return true;
+}
+
+/* restOfLine(string_view&)
+ * Skips one character and reads up to the end of the line; the newline is
+ * consumed but not included
+ *  parameters:
+ *  line, set to a view of the characters read
+ *
+ *  return value:
+ *  true if the character after the command could be skipped
+ *  false at the end of the input
+ */
+inline bool CommandReader::restOfLine(string_view &line){
+    if (!this->available()){
+        return false;
+    }
+    this->pos++;
+    size_t start = this->pos;
+    size_t scanned = start;
+    while (true){
+        const void *newline = memchr(this->data + scanned, '\n', this->end - scanned);
+        if (newline){
+            size_t at = static_cast<const char *>(newline) - this->data;
+            line = string_view(this->data + start, at - start);
+            this->pos = at + 1;
+            return true;
+        }
+        // fill() moves the line to the front of the buffer
+        size_t length = this->end - start;
+        this->pos = start;
+        bool more = this->fill();
+        start = this->pos;
+        scanned = start + length;
+        if (!more){
+            line = string_view(this->data + start, length);
+            this->pos = this->end;
+            return true;
+        }
+    }
+}
+
+/* nextBytes(size_t, string_view&)
+ * Reads exactly the given number of bytes, whitespace included
+ *  parameters:
+ *  length, number of bytes to read
+ *  bytes, set to a view of the bytes read
+ *
+ *  return value:
+ *  true if the bytes were read
+ *  false if the input ends first
+ */
+inline bool CommandReader::nextBytes(size_t length, string_view &bytes){
+    this->release();
+    while (this->end - this->pos < length){
+        if (!this->fill()){
+            return false;
+        }
+    }
+    bytes = string_view(this->data + this->pos, length);
+    this->pos += length;
+    return true;
+}
+
+/* splitWords(string_view)
+ * Splits a line into its whitespace-separated words, as views into the line
+ *  parameters:
+ *  line, the line to split
+ *
+ *  return value:
+ *  The words in order
+ */
+inline vector<string_view> splitWords(string_view line){
+    vector<string_view> words;
+    size_t start = 0;
+    while (start < line.length()){
+        while (start < line.length() && isspace(static_cast<unsigned char>(line[start]))){
+            start++;
+        }
+        size_t end = start;
+        while (end < line.length() && !isspace(static_cast<unsigned char>(line[end]))){
+            end++;
+        }
+        if (end > start){
+            words.push_back(line.substr(start, end - start));
+        }
+        start = end;
+    }
+    return words;
+}
+
+/* OutputBuffer(int, size_t)
+ * Sets up an empty buffer of the given capacity
+ *  parameters:
+ *  fd, file descriptor to write the output to
+ *  capacity, number of bytes to collect before writing
+ *
+ *  return value:
+ *  none
+ */
+inline OutputBuffer::OutputBuffer(int fd, size_t capacity) : fd(fd), buffer(capacity > 0 ? capacity : 1),
+        writeFailed(false){
+    this->setp(this->buffer.data(), this->buffer.data() + this->buffer.size());
+}
+
+/* writeOut(const char*, size_t)
+ * Writes all the given bytes to the descriptor, retrying partial writes
+ *  parameters:
+ *  bytes, start of the bytes to write
+ *  length, number of bytes to write
+ *
+ *  return value:
+ *  none
+ */
+inline void OutputBuffer::writeOut(const char *bytes, size_t length){
+    while (length > 0){
+        ssize_t written = write(this->fd, bytes, length);
+        if (written < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            this->writeFailed = true;
+            return;
+        }
+        bytes += written;
+        length -= written;
+    }
+}
+
+/* flushAll()
+ * Writes out everything collected so far
+ *  parameters:
+ *  none
+ *
+ *  return value:
+ *  none
+ */
+inline void OutputBuffer::flushAll(){
+    this->writeOut(this->pbase(), this->pptr() - this->pbase());
+    this->setp(this->buffer.data(), this->buffer.data() + this->buffer.size());
+}
+
+/* overflow(int_type)
+ * Writes out the full buffer and starts it over with the given character
+ *  parameters:
+ *  c, character that did not fit, or eof
+ *
+ *  return value:
+ *  c, or something other than eof if c was eof
+ */
+inline OutputBuffer::int_type OutputBuffer::overflow(int_type c){
+    this->flushAll();
+    if (traits_type::eq_int_type(c, traits_type::eof())){
+        return traits_type::not_eof(c);
+    }
+    *this->pptr() = traits_type::to_char_type(c);
+    this->pbump(1);
+    return c;
+}
+
+/* xsputn(const char*, streamsize)
+ * Copies the characters into the buffer, or writes them straight out if
+ * they are at least as large as the buffer
+ *  parameters:
+ *  s, start of the characters
+ *  n, number of characters
+ *
+ *  return value:
+ *  n
+ */
+inline streamsize OutputBuffer::xsputn(const char *s, streamsize n){
+    size_t length = n;
+    if (length > static_cast<size_t>(this->epptr() - this->pptr())){
+        this->flushAll();
+        if (length >= this->buffer.size()){
+            this->writeOut(s, length);
+            return n;
+        }
+    }
+    memcpy(this->pptr(), s, length);
+    this->pbump(static_cast<int>(length));
+    return n;
+}
+
+#endif
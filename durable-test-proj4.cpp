@@ -0,0 +1,257 @@
+/* CSI 3334
+ * Project 4 -- AVL Tree
+ * Filename: durable-test-proj4.cpp
+ * Name: Eugene Pak
+ * Version 1.0
+ * This program checks the recovery paths of DurableEncryptionTree: that a
+ * tree reopened after commit() (even by a process that died with changes
+ * still pending) has exactly the committed changes and shape, that a torn
+ * end of the log is cut off, that checkpoint() leaves an empty log behind a
+ * snapshot that reopens to the same tree, and that a damaged snapshot makes
+ * open() fail. It works in a new directory under /tmp and removes it after.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <random>
+#include <sys/wait.h>
+#include "durable-tree-proj4.h"
+
+using namespace std;
+
+typedef DurableEncryptionTree<string> DurableTree;
+
+const int CHANGES = 20000;
+const int KEY_RANGE = 5000;
+
+int failures = 0;
+
+/* check
+ * Counts and reports a failed check
+ *  parameters:
+ *      ok -- whether the check passed
+ *      what -- what was checked
+ *  return value: none
+ */
+void check(bool ok, const char *what){
+    if (!ok){
+        failures++;
+        cerr << "check failed: " << what << endl;
+    }
+}
+
+/* readFile
+ * Reads a whole file
+ *  parameters:
+ *      fileName -- the file to read
+ *  return value: the bytes of the file (empty if it can't be read)
+ */
+string readFile(const string &fileName){
+    ifstream in(fileName.c_str(), ios::binary);
+    return string((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+}
+
+/* writeFile
+ * Replaces the contents of a file
+ *  parameters:
+ *      fileName -- the file to write
+ *      bytes -- the new contents
+ *  return value: none
+ */
+void writeFile(const string &fileName, const string &bytes){
+    ofstream out(fileName.c_str(), ios::binary | ios::trunc);
+    out.write(bytes.data(), bytes.size());
+}
+
+/* shapeOf
+ * Prints a tree in preorder, which shows its keys and its exact shape
+ *  parameters:
+ *      tree -- the tree to print
+ *  return value: the printed tree
+ */
+string shapeOf(const AVLTree<string> &tree){
+    ostringstream out;
+    tree.printPreorder(out);
+    return out.str();
+}
+
+/* applyChanges
+ * Makes the same random inserts and removes to a durable tree and to a plain
+ * one
+ *  parameters:
+ *      durable -- the open durable tree, or NULL to change only reference
+ *      reference -- the tree that gets the same changes
+ *      rng -- the source of the changes
+ *      count -- the number of changes
+ *  return value: none
+ */
+void applyChanges(DurableTree *durable, EncryptionTree<string> &reference, mt19937 &rng, int count){
+    for (int i = 0; i < count; i++){
+        string key = to_string(rng() % KEY_RANGE);
+        if (rng() % 3){
+            if (durable){
+                durable->insert(key);
+            }
+            reference.insert(key);
+        }
+        else {
+            if (durable){
+                durable->remove(key);
+            }
+            reference.remove(key);
+        }
+    }
+}
+
+/* testReopenAfterCommit
+ * Commits changes, then lets a child process commit more and die without
+ * committing its last ones; reopening must give the committed tree
+ *  parameters:
+ *      directory -- the tree's directory
+ *      reference -- set to the committed tree
+ *  return value: none
+ */
+void testReopenAfterCommit(const string &directory, EncryptionTree<string> &reference){
+    mt19937 rng(1);
+    {
+        DurableTree tree;
+        check(tree.open(directory), "open a new directory");
+        applyChanges(&tree, reference, rng, CHANGES);
+        check(tree.commit(), "commit");
+    }
+    {
+        DurableTree tree;
+        check(tree.open(directory), "reopen after commit");
+        check(shapeOf(tree.getTree()) == shapeOf(reference), "reopened tree has the same shape");
+    }
+
+    mt19937 childRng(2);
+    pid_t child = fork();
+    if (child == 0){
+        DurableTree tree(DurableTree::SYNC_NEVER);
+        EncryptionTree<string> ignored;
+        if (!tree.open(directory)){
+            _exit(1);
+        }
+        applyChanges(&tree, ignored, childRng, CHANGES / 4);
+        bool committed = tree.commit();
+        tree.insert("never committed");
+        _exit(committed ? 0 : 1);
+    }
+    int status = 0;
+    waitpid(child, &status, 0);
+    check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "child committed");
+    applyChanges(NULL, reference, childRng, CHANGES / 4);
+
+    DurableTree tree;
+    check(tree.open(directory), "reopen after a crash");
+    check(shapeOf(tree.getTree()) == shapeOf(reference), "only committed changes survive a crash");
+    check(!tree.contains("never committed"), "pending change is lost");
+}
+
+/* testTornTail
+ * Appends a partial record to the log and cuts the last record short; each
+ * time reopening must cut the log back to its last whole record
+ *  parameters:
+ *      directory -- the tree's directory
+ *      reference -- the tree the directory holds
+ *  return value: none
+ */
+void testTornTail(const string &directory, const EncryptionTree<string> &reference){
+    string logName = directory + "/log";
+    string log = readFile(logName);
+    check(log.size() > 40, "log has records");
+    writeFile(logName, log + string("\x12\x34\x56", 3));
+    {
+        DurableTree tree;
+        check(tree.open(directory), "open with garbage after the log");
+        check(shapeOf(tree.getTree()) == shapeOf(reference), "garbage after the log is ignored");
+    }
+    check(readFile(logName) == log, "garbage after the log is cut off");
+
+    writeFile(logName, log.substr(0, log.size() - 3));
+    {
+        DurableTree tree;
+        check(tree.open(directory), "open with a torn last record");
+        tree.getTree().verifyBalance();
+        check(tree.size() + 1 == reference.size() || tree.size() == reference.size() + 1,
+              "torn last record is not applied");
+    }
+    check(readFile(logName).size() < log.size() - 3, "torn last record is cut off");
+    writeFile(logName, log);
+}
+
+/* testCheckpoint
+ * Checkpoints the tree; the log must then be empty and reopening must give
+ * the same tree from the snapshot alone
+ *  parameters:
+ *      directory -- the tree's directory
+ *      reference -- the tree the directory holds
+ *  return value: none
+ */
+void testCheckpoint(const string &directory, const EncryptionTree<string> &reference){
+    {
+        DurableTree tree;
+        check(tree.open(directory), "open before checkpoint");
+        check(tree.checkpoint(), "checkpoint");
+    }
+    check(readFile(directory + "/log").empty(), "log is empty after checkpoint");
+    DurableTree tree;
+    check(tree.open(directory), "reopen after checkpoint");
+    check(shapeOf(tree.getTree()) == shapeOf(reference), "snapshot has the same shape");
+}
+
+/* testCorruptSnapshot
+ * Flips one byte of the snapshot and then cuts it short; open() must refuse
+ * both rather than start from a wrong or empty tree
+ *  parameters:
+ *      directory -- the tree's directory
+ *  return value: none
+ */
+void testCorruptSnapshot(const string &directory){
+    string snapshotName = directory + "/snapshot";
+    string snapshot = readFile(snapshotName);
+    string damaged = snapshot;
+    damaged[damaged.size() / 2] ^= 1;
+    writeFile(snapshotName, damaged);
+    {
+        DurableTree tree;
+        check(!tree.open(directory) && !tree.isOpen(), "a flipped byte makes open() fail");
+    }
+    writeFile(snapshotName, snapshot.substr(0, snapshot.size() / 2));
+    {
+        DurableTree tree;
+        check(!tree.open(directory) && !tree.isOpen(), "a cut snapshot makes open() fail");
+    }
+    writeFile(snapshotName, snapshot);
+    DurableTree tree;
+    check(tree.open(directory), "open with the snapshot restored");
+}
+
+/* main
+ * Runs every recovery test in a new directory and removes it afterwards
+ *  parameters:
+ *      none
+ *  return value: 0 if every check passed, 1 otherwise
+ */
+int main() {
+    char directoryName[] = "/tmp/durable-test-XXXXXX";
+    if (!mkdtemp(directoryName)){
+        cerr << "cannot create a directory under /tmp" << endl;
+        return 1;
+    }
+    string directory = directoryName;
+
+    EncryptionTree<string> reference;
+    testReopenAfterCommit(directory, reference);
+    testTornTail(directory, reference);
+    testCheckpoint(directory, reference);
+    testCorruptSnapshot(directory);
+
+    unlink((directory + "/log").c_str());
+    unlink((directory + "/snapshot").c_str());
+    rmdir(directory.c_str());
+    cout << (failures == 0 ? "ok" : "FAILED") << endl;
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,566 @@
+#ifndef DURABLE_TREE_PROJ4
+#define DURABLE_TREE_PROJ4
+
+#include <string>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "avl-tree-student-proj4.h"
+#include "command-io-proj4.h"
+
+using namespace std;
+
+/* A DurableEncryptionTree is an EncryptionTree that survives restarts. It
+ * keeps two files in a directory of its own: "snapshot", a shape snapshot of
+ * the tree (see AVLTree::writeShape()), and "log", an append-only log of the
+ * inserts and removes made since that snapshot.
+ *
+ * open() recovers the tree from the directory, creating it if needed. It
+ * loads the snapshot, which rebuilds the exact tree that was saved without
+ * any rebalancing, and then replays the log records that came after it.
+ * Recovery therefore costs one snapshot load plus at most checkpointBytes of
+ * log, however long the tree's history is, and leaves the tree in exactly the
+ * shape it had, so every code path is the same as before the restart.
+ *
+ * insert() and remove() change the tree at once and add a record to a group
+ * of pending records in memory. Only changes that do something are logged. A
+ * change is durable once commit() has written its group to the log with one
+ * write() call; a group is also committed on its own when it reaches
+ * GROUP_BYTES. After a write, the log is flushed to the disk with fsync()
+ * according to the sync policy:
+ *
+ *    SYNC_ALWAYS     after every commit, so a committed change survives a
+ *                    power failure
+ *    SYNC_PERIODIC   at a commit at least syncInterval after the last one, so
+ *                    a power failure loses at most the changes committed since
+ *    SYNC_NEVER      never, leaving it to the operating system; a committed
+ *                    change survives the process crashing, but not the machine
+ *
+ * close() (and the destructor) commits and syncs whatever is left.
+ *
+ * Once the log holds checkpointBytes, commit() also calls checkpoint(), which
+ * can be called directly too. It writes a new snapshot to "snapshot.tmp",
+ * syncs it, renames it over "snapshot", and then empties the log. Every log
+ * record carries a sequence number and the snapshot records the last one it
+ * includes, so a crash between the rename and emptying the log is harmless:
+ * records already in the snapshot are skipped on recovery.
+ *
+ * The snapshot file starts with a 24-byte header: the magic "AVLDURAB", the
+ * sequence number of the last change it includes, and the checksum (32-bit
+ * FNV-1a, widened to 8 bytes) of the shape snapshot that follows. The checksum
+ * is worked out as the shape is written, and a snapshot whose checksum does
+ * not match is malformed.
+ *
+ * Each log record is a 4-byte checksum (32-bit FNV-1a of the rest of the
+ * record), the 8-byte sequence number, the command letter 'i' or 'r', and the
+ * 4-byte length of the key, which follows as written by KeyCodec. A record
+ * cut off by a crash, or one whose checksum does not match, ends the log;
+ * open() cuts it and anything after it off the file.
+ *
+ * open(), commit() and checkpoint() return false if a file can't be read or
+ * written. A commit that fails keeps its group pending and cuts the log back
+ * to where it was, so it can be tried again. A snapshot that is malformed
+ * makes open() fail rather than start from an empty tree.
+ *
+ * Reads go to the tree itself, through getTree() or the forwarding methods.
+ * They see changes that are not committed yet.
+ */
+template <class Base, class Compare = less<Base> >
+class DurableEncryptionTree {
+public:
+    enum SyncPolicy { SYNC_ALWAYS, SYNC_PERIODIC, SYNC_NEVER };
+
+    explicit DurableEncryptionTree(SyncPolicy policy = SYNC_ALWAYS,
+                                   chrono::milliseconds syncInterval = chrono::milliseconds(100),
+                                   size_t checkpointBytes = 16 << 20)
+        : policy(policy), syncInterval(syncInterval), checkpointBytes(checkpointBytes),
+          logFd(-1), logBytes(0), nextSequence(1), unsynced(false) {}
+    ~DurableEncryptionTree() { close(); }
+
+    bool open(const string &directory);
+    bool close();
+    bool isOpen() const { return logFd >= 0; }
+
+    void insert(const Base &item);
+    void remove(const Base &item);
+    bool commit();
+    bool checkpoint();
+
+    const EncryptionTree<Base, Compare> &getTree() const { return tree; }
+    string encrypt(const Base &item) const { return tree.encrypt(item); }
+    const Base *decrypt(const string &path) const { return tree.decrypt(path); }
+    bool contains(const Base &item) const { return tree.contains(item); }
+    size_t size() const { return tree.size(); }
+
+protected:
+    DurableEncryptionTree(const DurableEncryptionTree &t) { assert(false); }
+    const DurableEncryptionTree &operator=(const DurableEncryptionTree &t) { assert(false); return *this; }
+
+    static constexpr size_t GROUP_BYTES = 1 << 20;
+    static constexpr size_t RECORD_HEADER = 17;
+    static constexpr size_t SNAPSHOT_HEADER = 24;
+
+    // a streambuf that passes everything on to another one, keeping the
+    // checksum of what went through
+    class ChecksumBuffer : public streambuf {
+      protected:
+        streambuf &out;
+        uint32_t hash;
+
+        virtual int_type overflow(int_type c);
+        virtual streamsize xsputn(const char *s, streamsize n);
+
+      public:
+        explicit ChecksumBuffer(streambuf &out) : out(out), hash(2166136261u) {}
+
+        uint32_t value() const { return hash; }
+    };
+
+    bool loadSnapshot(uint64_t &sequence);
+    bool replayLog(uint64_t after);
+    void append(char command, const Base &item);
+    bool writePending();
+    bool syncLog(bool force);
+    bool syncDirectory() const;
+    string path(const char *name) const { return directory + "/" + name; }
+    static uint32_t checksum(const char *bytes, size_t length, uint32_t hash = 2166136261u);
+
+    EncryptionTree<Base, Compare> tree;
+    SyncPolicy policy;
+    chrono::milliseconds syncInterval;
+    size_t checkpointBytes;
+    string directory;
+    int logFd;
+    size_t logBytes;
+    string pending;
+    uint64_t nextSequence;
+    chrono::steady_clock::time_point lastSync;
+    bool unsynced;
+};
+
+/* open(const string&)
+ * Recovers the tree from a directory: loads its snapshot, replays the log
+ * after it, and cuts off a torn end of the log
+ *  parameters:
+ *  directory, directory holding the tree's files; created if it is missing
+ *
+ *  return value:
+ *  true if the tree was recovered and is ready for changes
+ *  false if the files can't be read or the snapshot is malformed
+ */
+template <class Base, class Compare>
+bool DurableEncryptionTree<Base, Compare>::open(const string &directory){
+    this->close();
+    this->directory = directory;
+    if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST){
+        return false;
+    }
+    unlink(this->path("snapshot.tmp").c_str());
+    uint64_t sequence = 0;
+    if (!this->loadSnapshot(sequence)){
+        return false;
+    }
+    this->logFd = ::open(this->path("log").c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (this->logFd < 0){
+        return false;
+    }
+    this->nextSequence = sequence + 1;
+    if (!this->replayLog(sequence)){
+        ::close(this->logFd);
+        this->logFd = -1;
+        return false;
+    }
+    this->lastSync = chrono::steady_clock::now();
+    return true;
+}
+
+/* close()
+ * Commits and syncs whatever is pending and closes the log
+ *  parameters:
+ *  none
+ *
+ *  return value:
+ *  true if everything was written and synced (or the tree was not open)
+ *  false otherwise
+ */
+template <class Base, class Compare>
+bool DurableEncryptionTree<Base, Compare>::close(){
+    if (this->logFd < 0){
+        return true;
+    }
+    bool ok = this->writePending() && this->syncLog(true);
+    ::close(this->logFd);
+    this->logFd = -1;
+    this->pending.clear();
+    return ok;
+}
+
+/* insert(const Base&)
+ * Inserts an item into the tree and logs it if it was not there yet
+ *  parameters:
+ *  item, value to be inserted
+ *
+ *  return value:
+ *
+ */
+template <class Base, class Compare>
+void DurableEncryptionTree<Base, Compare>::insert(const Base &item){
+    assert(this->logFd >= 0);
+    if (this->tree.insert(item).second){
+        this->append('i', item);
+    }
+}
+
+/* remove(const Base&)
+ * Removes an item from the tree and logs it if it was there
+ *  parameters:
+ *  item, value to be removed
+ *
+ *  return value:
+ *
+ */
+template <class Base, class Compare>
+void DurableEncryptionTree<Base, Compare>::remove(const Base &item){
+    assert(this->logFd >= 0);
+    size_t before = this->tree.size();
+    this->tree.remove(item);
+    if (this->tree.size() != before){
+        this->append('r', item);
+    }
+}
+
+/* commit()
+ * Writes the pending group to the log, syncs it as the policy says, and
+ * checkpoints if the log has grown to checkpointBytes
+ *  parameters:
+ *  none
+ *
+ *  return value:
+ *  true if the group was written (and synced, if the policy asked for it)
+ *  false otherwise
+ */
+template <class Base, class Compare>
+bool DurableEncryptionTree<Base, Compare>::commit(){
+    if (!this->writePending() || !this->syncLog(false)){
+        return false;
+    }
+    if (this->logBytes >= this->checkpointBytes){
+        return this->checkpoint();
+    }
+    return true;
+}
+
+/* checkpoint()
+ * Commits, writes a snapshot of the tree next to the old one, syncs it and
+ * renames it into place, then empties the log
+ *  parameters:
+ *  none
+ *
+ *  return value:
+ *  true if the new snapshot is in place and the log is empty
+ *  false otherwise; the old snapshot and the log are then still good
+ */
+template <class Base, class Compare>
+bool DurableEncryptionTree<Base, Compare>::checkpoint(){
+    assert(this->logFd >= 0);
+    if (!this->writePending()){
+        return false;
+    }
+    string temporary = this->path("snapshot.tmp");
+    int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0){
+        return false;
+    }
+    bool ok;
+    {
+        OutputBuffer buffer(fd);
+        uint64_t header[3] = { 0, this->nextSequence - 1, 0 };
+        memcpy(header, "AVLDURAB", 8);
+        buffer.sputn(reinterpret_cast<const char *>(header), sizeof(header));
+        ChecksumBuffer summed(buffer);
+        ostream os(&summed);
+        this->tree.writeShape(os);
+        buffer.flushAll();
+        header[2] = summed.value();
+        ssize_t written = pwrite(fd, &header[2], sizeof(header[2]), 16);
+        ok = buffer.good() && os.good() && written == static_cast<ssize_t>(sizeof(header[2]));
+    }
+    ok = fsync(fd) == 0 && ok;
+    ok = ::close(fd) == 0 && ok;
+    if (!ok || rename(temporary.c_str(), this->path("snapshot").c_str()) != 0 ||
+        !this->syncDirectory()){
+        unlink(temporary.c_str());
+        return false;
+    }
+    if (ftruncate(this->logFd, 0) != 0){
+        return false;
+    }
+    this->logBytes = 0;
+    return this->syncLog(true);
+}
+
+/* loadSnapshot(uint64_t&)
+ * Replaces the tree with the one in the snapshot file, or empties it if there
+ * is no snapshot yet
+ *  parameters:
+ *  sequence, set to the sequence number of the last change in the snapshot
+ *
+ *  return value:
+ *  true if the tree was loaded (or there was no snapshot)
+ *  false if the snapshot can't be read or is malformed
+ */
+template <class Base, class Compare>
+bool DurableEncryptionTree<Base, Compare>::loadSnapshot(uint64_t &sequence){
+    int fd = ::open(this->path("snapshot").c_str(), O_RDONLY);
+    if (fd < 0){
+        this->tree.clear();
+        sequence = 0;
+        return errno == ENOENT;
+    }
+    struct stat info;
+    bool ok = fstat(fd, &info) == 0 && info.st_size >= static_cast<off_t>(SNAPSHOT_HEADER);
+    if (ok){
+        CommandReader reader(fd);
+        string_view header, shape;
+        uint64_t sum = 0;
+        ok = reader.nextBytes(SNAPSHOT_HEADER, header) &&
+             memcmp(header.data(), "AVLDURAB", 8) == 0 &&
+             reader.nextBytes(info.st_size - SNAPSHOT_HEADER, shape);
+        if (ok){
+            memcpy(&sum, header.data() + 16, sizeof(sum));
+            ok = sum == checksum(shape.data(), shape.size()) &&
+                 this->tree.readShape(shape.data(), shape.size());
+        }
+        if (ok){
+            memcpy(&sequence, header.data() + 8, sizeof(sequence));
+        }
+    }
+    ::close(fd);
+    return ok;
+}
+
+/* replayLog(uint64_t)
+ * Applies the log records after the given sequence number to the tree, and
+ * cuts the log off after its last good record
+ *  parameters:
+ *  after, sequence number of the last change already in the tree
+ *
+ *  return value:
+ *  true if the log was replayed
+ *  false if the log can't be read or cut
+ */
+template <class Base, class Compare>
+bool DurableEncryptionTree<Base, Compare>::replayLog(uint64_t after){
+    struct stat info;
+    if (fstat(this->logFd, &info) != 0){
+        return false;
+    }
+    size_t good = 0;
+    {
+        CommandReader reader(this->logFd);
+        string_view header, key;
+        while (reader.nextBytes(RECORD_HEADER, header)){
+            uint32_t sum, length;
+            uint64_t sequence;
+            memcpy(&sum, header.data(), 4);
+            memcpy(&sequence, header.data() + 4, 8);
+            char command = header[12];
+            memcpy(&length, header.data() + 13, 4);
+            if (!reader.nextBytes(length, key)){
+                break;
+            }
+            uint32_t expected = checksum(key.data(), key.size(),
+                                         checksum(header.data() + 4, RECORD_HEADER - 4));
+            const char *keyEnd = key.data() + key.size();
+            if (expected != sum || (command != 'i' && command != 'r') ||
+                KeyCodec<Base>::length(key.data(), keyEnd) != length){
+                break;
+            }
+            if (sequence > after){
+                Base item = KeyCodec<Base>::make(key.data());
+                if (command == 'i'){
+                    this->tree.insert(item);
+                }
+                else {
+                    this->tree.remove(item);
+                }
+            }
+            if (sequence >= this->nextSequence){
+                this->nextSequence = sequence + 1;
+            }
+            good += RECORD_HEADER + length;
+        }
+    }
+    this->logBytes = good;
+    if (good < static_cast<size_t>(info.st_size)){
+        return ftruncate(this->logFd, good) == 0 && fsync(this->logFd) == 0;
+    }
+    return true;
+}
+
+/* append(char, const Base&)
+ * Adds a record for a change to the pending group, committing the group
+ * first if it is full
+ *  parameters:
+ *  command, 'i' for an insert or 'r' for a remove
+ *  item, value inserted or removed
+ *
+ *  return value:
+ *
+ */
+template <class Base, class Compare>
+void DurableEncryptionTree<Base, Compare>::append(char command, const Base &item){
+    if (this->pending.size() >= GROUP_BYTES){
+        this->commit();
+    }
+    size_t start = this->pending.size();
+    uint64_t sequence = this->nextSequence++;
+    uint32_t length = KeyCodec<Base>::size(item);
+    this->pending.append(4, '\0');
+    this->pending.append(reinterpret_cast<const char *>(&sequence), 8);
+    this->pending.push_back(command);
+    this->pending.append(reinterpret_cast<const char *>(&length), 4);
+    KeyCodec<Base>::append(this->pending, item);
+    uint32_t sum = checksum(this->pending.data() + start + 4, this->pending.size() - start - 4);
+    memcpy(&this->pending[start], &sum, 4);
+}
+
+/* writePending()
+ * Writes the pending group to the end of the log; if that fails, cuts the
+ * log back to where it was and keeps the group
+ *  parameters:
+ *  none
+ *
+ *  return value:
+ *  true if the group was written
+ *  false otherwise
+ */
+template <class Base, class Compare>
+bool DurableEncryptionTree<Base, Compare>::writePending(){
+    assert(this->logFd >= 0);
+    size_t done = 0;
+    while (done < this->pending.size()){
+        ssize_t written = write(this->logFd, this->pending.data() + done, this->pending.size() - done);
+        if (written < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            if (ftruncate(this->logFd, this->logBytes) != 0){
+                // the log ends in a torn record now, which open() cuts off
+            }
+            return false;
+        }
+        done += written;
+    }
+    this->logBytes += done;
+    this->unsynced = this->unsynced || done > 0;
+    this->pending.clear();
+    return true;
+}
+
+/* syncLog(bool)
+ * Flushes the log to the disk if the sync policy asks for it now
+ *  parameters:
+ *  force, true to sync whatever the policy is
+ *
+ *  return value:
+ *  true if the log did not need syncing or was synced
+ *  false if fsync() failed
+ */
+template <class Base, class Compare>
+bool DurableEncryptionTree<Base, Compare>::syncLog(bool force){
+    if (!this->unsynced){
+        return true;
+    }
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    if (!force && (this->policy == SYNC_NEVER ||
+                   (this->policy == SYNC_PERIODIC && now - this->lastSync < this->syncInterval))){
+        return true;
+    }
+    if (fsync(this->logFd) != 0){
+        return false;
+    }
+    this->lastSync = now;
+    this->unsynced = false;
+    return true;
+}
+
+/* syncDirectory() const
+ * Flushes the directory to the disk, so that a rename in it is durable
+ *  parameters:
+ *  none
+ *
+ *  return value:
+ *  true if the directory was synced
+ *  false otherwise
+ */
+template <class Base, class Compare>
+bool DurableEncryptionTree<Base, Compare>::syncDirectory() const{
+    int fd = ::open(this->directory.c_str(), O_RDONLY);
+    if (fd < 0){
+        return false;
+    }
+    bool ok = fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+}
+
+/* overflow(int_type)
+ * Passes one character on, adding it to the checksum
+ *  parameters:
+ *  c, character to pass on, or eof
+ *
+ *  return value:
+ *  c, or something other than eof if c was eof; eof if it could not be
+ *  passed on
+ */
+template <class Base, class Compare>
+typename DurableEncryptionTree<Base, Compare>::ChecksumBuffer::int_type
+DurableEncryptionTree<Base, Compare>::ChecksumBuffer::overflow(int_type c){
+    if (traits_type::eq_int_type(c, traits_type::eof())){
+        return traits_type::not_eof(c);
+    }
+    char byte = traits_type::to_char_type(c);
+    this->hash = checksum(&byte, 1, this->hash);
+    return this->out.sputc(byte);
+}
+
+/* xsputn(const char*, streamsize)
+ * Passes characters on, adding them to the checksum
+ *  parameters:
+ *  s, start of the characters
+ *  n, number of characters
+ *
+ *  return value:
+ *  The number of characters passed on
+ */
+template <class Base, class Compare>
+streamsize DurableEncryptionTree<Base, Compare>::ChecksumBuffer::xsputn(const char *s, streamsize n){
+    this->hash = checksum(s, n, this->hash);
+    return this->out.sputn(s, n);
+}
+
+/* checksum(const char*, size_t, uint32_t)
+ * Computes the 32-bit FNV-1a hash of some bytes, or carries on one
+ *  parameters:
+ *  bytes, start of the bytes
+ *  length, number of bytes
+ *  hash, hash of the bytes before these (the FNV offset basis if none)
+ *
+ *  return value:
+ *  The hash
+ */
+template <class Base, class Compare>
+uint32_t DurableEncryptionTree<Base, Compare>::checksum(const char *bytes, size_t length,
+                                                        uint32_t hash){
+    for (size_t i = 0; i < length; i++){
+        hash = (hash ^ static_cast<unsigned char>(bytes[i])) * 16777619u;
+    }
+    return hash;
+}
+
+#endif
@@ -2,7 +2,7 @@
  * Project 4 -- AVL Tree
  * Filename: main.cpp
  * Name: Eugene Pak
- * Version 1.3
+ * Version 1.4
  * Due: 3/22/24
  * This project reads in instruction letters to create an avl-balanced BST object.
  * It also allows for a path key to be used to decrypt a message, and also use a
@@ -10,87 +10,163 @@
  */
 
 #include <iostream>
-#include <sstream>
+#include <cctype>
+#include <string_view>
+#include <vector>
 #include "avl-tree-student-proj4.h"
+#include "command-io-proj4.h"
+#include "binary-command-proj4.h"
 
 using namespace std;
 
 /* main
  * This project reads in instruction letters to create a binary search tree with
- * inserts and removes until the letter q is read. When the letter i is read, the
- * word that follows is inserted into the tree. When the letter r is read, the word
- * that follows is removed from the tree. When the letter e is read, a stream of
- * words is read and encrypted into a path of keys. When the letter d is read, a
- * stream of keys are read and decrypted into a stream of words.
+ * inserts and removes until the letter q is read or the input ends. When the
+ * letter i is read, the word that follows is inserted into the tree. A run of
+ * at least WordTree::BATCH_MIN i commands in a row is collected and inserted
+ * with one multithreaded batch; a longer run is inserted in batches of
+ * CommandReader::GROUP_BYTES bytes of words, so memory stays bounded. When the letter r is read, the word that
+ * follows is removed from the tree. When the letter e is read, a stream of
+ * words is read and encrypted into a path of keys; the words are looked up as
+ * slices of the line they were read in, without copying them. When the letter
+ * d is read, a stream of keys are read and decrypted into a stream of words.
+ * The commands are read from the file named on the command line, or from
+ * standard input if there is none, through a CommandReader, so there is no
+ * limit on how many there are. All output is collected in one OutputBuffer and
+ * written when it fills or when the program ends.
+ * With -b, the commands are in the binary command format instead and are run
+ * by a BinaryExecutor, which writes binary responses. With -c, the text
+ * commands are only converted to the binary format and written out.
  *  parameters:
  *      argc -- the number of arguments from the command line
- *      argv -- the command line argument values
- *  return value: 0 (indicating a successful run)
+ *      argv -- an optional -b or -c, then optionally the file to read the
+ *              commands from
+ *  return value: 0 (indicating a successful run), 1 if the file can't be opened
+ *                or a binary command stream is malformed
  *
  */
-const int MAX = 10000;
 int main(int argc, char**argv) {
-    EncryptionTree<string> tree;
-    int count = 0;
+    int fd = 0;
+    char mode = 't';
+    int arg = 1;
+    if (arg < argc && (string(argv[arg]) == "-b" || string(argv[arg]) == "-c")){
+        mode = argv[arg][1];
+        arg++;
+    }
+    if (arg < argc){
+        fd = open(argv[arg], O_RDONLY);
+        if (fd < 0){
+            cerr << "cannot open " << argv[arg] << endl;
+            return 1;
+        }
+    }
+    WordTree tree;
+    CommandReader in(fd);
+    OutputBuffer outBuffer(1);
+    ostream out(&outBuffer);
+    if (mode != 't'){
+        bool ok = true;
+        if (mode == 'b'){
+            BinaryExecutor executor(tree, out);
+            ok = executor.run(in);
+        }
+        else {
+            textToBinary(in, out);
+        }
+        outBuffer.flushAll();
+        if (fd != 0){
+            close(fd);
+        }
+        if (!ok){
+            cerr << "malformed binary command stream" << endl;
+            return 1;
+        }
+        return 0;
+    }
     char instruction;
-    string word, word2;
+    string_view token, line;
     bool done = false;
-    cin >> instruction;
-    while (!done && count <= MAX){
-        count++;
+    bool more = in.nextChar(instruction);
+    while (!done && more){
         if (instruction == 'i'){
-            cin >> word;
-            tree.insert(word);
+            vector<string> batch;
+            size_t batchBytes = 0;
+            if (in.nextToken(token)){
+                batch.push_back(string(token));
+                batchBytes += token.size();
+            }
+            // a full batch is inserted with instruction still 'i', so the
+            // next pass of the outer loop carries on with the run
+            while (batchBytes < CommandReader::GROUP_BYTES &&
+                   (more = in.nextChar(instruction)) && instruction == 'i'){
+                if (in.nextToken(token)){
+                    batch.push_back(string(token));
+                    batchBytes += token.size();
+                }
+            }
+            if (batch.size() >= WordTree::BATCH_MIN){
+                tree.insertBatch(move(batch));
+            }
+            else {
+                for (size_t i = 0; i < batch.size(); i++){
+                    tree.insert(batch[i]);
+                }
+            }
+            continue;
         }
         else if (instruction == 'r'){
-            cin >> word;
-            tree.remove(word);
-        }
-        else if (instruction == 'e'){
-            cin.get();
-            getline(cin, word);
-            word.erase(word.begin(), word.begin() + 1);
-            word.erase(word.begin() + word.length() - 1);
-            istringstream buffer (word);
-            while (buffer >> word2){
-                cout << tree.encrypt(word2);
-                if (!buffer.eof()){
-                    cout  << " ";
-                }
+            if (in.nextToken(token)){
+                tree.remove(token);
             }
-            cout << endl;
         }
-        else if (instruction == 'd'){
-            cin.get();
-            getline(cin, word);
-            word.erase(word.begin(), word.begin() + 1);
-            word.erase(word.begin() + word.length() - 1);
-            istringstream buffer (word);
-            while (buffer >> word2){
-                if (tree.decrypt(word2)){
-                    cout << *(tree.decrypt(word2));
-                }
-                else {
-                    cout << "?";
+        else if (instruction == 'e' || instruction == 'd'){
+            string_view content;
+            if (in.restOfLine(line) && line.length() >= 2){
+                content = line.substr(1, line.length() - 2);
+            }
+            bool trailingSpace = !content.empty() && isspace(static_cast<unsigned char>(content.back()));
+            vector<string_view> words = splitWords(content);
+            if (instruction == 'e'){
+                vector<string> codes = tree.encryptMany(words);
+                for (size_t i = 0; i < codes.size(); i++){
+                    out << codes[i];
+                    if (i + 1 < codes.size() || trailingSpace){
+                        out << " ";
+                    }
                 }
-                if (!buffer.eof()){
-                    cout  << " ";
+            }
+            else {
+                vector<const string*> decoded = tree.decryptMany(words);
+                for (size_t i = 0; i < decoded.size(); i++){
+                    if (decoded[i]){
+                        out << *decoded[i];
+                    }
+                    else {
+                        out << "?";
+                    }
+                    if (i + 1 < decoded.size() || trailingSpace){
+                        out << " ";
+                    }
                 }
             }
-            cout << endl;
+            out << '\n';
         }
         else if (instruction == 'p'){
-            tree.printPreorder();
+            tree.printPreorder(out);
         }
         else if (instruction == 'l'){
-            tree.printLevelOrder();
+            tree.printLevelOrder(out);
         }
         if (instruction == 'q'){
             done = true;
         }
         else {
-            cin >> instruction;
+            more = in.nextChar(instruction);
         }
     }
+    outBuffer.flushAll();
+    if (fd != 0){
+        close(fd);
+    }
     return 0;
 }
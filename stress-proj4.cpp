@@ -0,0 +1,207 @@
+/* CSI 3334
+ * Project 4 -- AVL Tree
+ * Filename: stress-proj4.cpp
+ * Name: Eugene Pak
+ * Version 1.0
+ * This program checks that the trees built for many threads stay correct
+ * under load: that a ConcurrentEncryptionTree changed by several writers at
+ * once holds exactly the keys they left in it and is still a balanced search
+ * tree, and that a SnapshotEncryptionTree read through Snapshots meanwhile
+ * hands out the same codes as an EncryptionTree given the same operations.
+ * It must be built without NDEBUG, since the verify methods use assert().
+ */
+
+#include <iostream>
+#include <random>
+#include <set>
+#include <atomic>
+#include "avl-tree-student-proj4.h"
+
+using namespace std;
+
+const int KEYS_PER_THREAD = 2000;
+const int OPS_PER_THREAD = 100000;
+const int COMPARE_EVERY = 5000;
+
+atomic<int> failures(0);
+
+/* check
+ * Counts and reports a failed check
+ *  parameters:
+ *      ok -- whether the check passed
+ *      what -- what was checked
+ *  return value: none
+ */
+void check(bool ok, const char *what){
+    if (!ok){
+        failures++;
+        cerr << "check failed: " << what << endl;
+    }
+}
+
+/* stressConcurrent
+ * Runs the given number of writers against one ConcurrentEncryptionTree,
+ * each inserting and removing keys of its own (the keys equal to its number
+ * modulo the number of writers) and keeping them in a set of its own, while
+ * two readers search for keys of every writer. Every insert and remove must
+ * report the same as the writer's set; afterwards the tree must hold exactly
+ * the union of the sets, be balanced and in search order, and decrypt the
+ * code of each key back to that key
+ *  parameters:
+ *      writers -- the number of writer threads
+ *  return value: none
+ */
+void stressConcurrent(unsigned writers){
+    ConcurrentEncryptionTree<int> tree;
+    vector<set<int> > mine(writers);
+    atomic<bool> stop(false);
+    vector<thread> threads;
+    for (unsigned w = 0; w < writers; w++){
+        threads.push_back(thread([&, w](){
+            mt19937 rng(w + 1);
+            for (int i = 0; i < OPS_PER_THREAD; i++){
+                int key = (rng() % KEYS_PER_THREAD) * writers + w;
+                if (rng() % 3){
+                    bool added = tree.insert(key);
+                    check(added == mine[w].insert(key).second, "insert result");
+                }
+                else {
+                    bool removed = tree.remove(key);
+                    check(removed == (mine[w].erase(key) > 0), "remove result");
+                }
+            }
+        }));
+    }
+    // the readers' results can't be checked while the writers run, since
+    // any key may move; they are there to race the searches against writes
+    vector<thread> readers;
+    for (unsigned r = 0; r < 2; r++){
+        readers.push_back(thread([&, r](){
+            mt19937 rng(1000 + r);
+            while (!stop.load()){
+                int key = rng() % (KEYS_PER_THREAD * writers);
+                int found;
+                tree.decrypt(tree.encrypt(key), found);
+                tree.contains(key);
+            }
+        }));
+    }
+    for (size_t t = 0; t < threads.size(); t++){
+        threads[t].join();
+    }
+    stop.store(true);
+    for (size_t t = 0; t < readers.size(); t++){
+        readers[t].join();
+    }
+
+    size_t total = 0;
+    for (unsigned w = 0; w < writers; w++){
+        total += mine[w].size();
+        for (set<int>::const_iterator it = mine[w].begin(); it != mine[w].end(); ++it){
+            check(tree.contains(*it), "writer's key is in the tree");
+            int found = -1;
+            check(tree.decrypt(tree.encrypt(*it), found) && found == *it, "code decrypts to its key");
+        }
+    }
+    check(tree.size() == total, "tree holds exactly the writers' keys");
+    tree.verifyBalance();
+    tree.verifySearchOrder();
+}
+
+/* compareCodes
+ * Checks that a SnapshotEncryptionTree hands out the same code as an
+ * EncryptionTree for every key below the key range, present or not
+ *  parameters:
+ *      tree -- the tree under test
+ *      reference -- the tree given the same operations
+ *  return value: none
+ */
+void compareCodes(const SnapshotEncryptionTree<int> &tree, const EncryptionTree<int> &reference){
+    SnapshotEncryptionTree<int>::Snapshot snapshot(tree);
+    check(snapshot.size() == reference.size(), "snapshot size");
+    for (int key = 0; key < KEYS_PER_THREAD; key++){
+        check(snapshot.encrypt(key) == reference.encrypt(key), "snapshot code");
+    }
+}
+
+/* stressSnapshot
+ * Applies the same random inserts and removes to a SnapshotEncryptionTree
+ * and an EncryptionTree, comparing their codes every COMPARE_EVERY operations
+ * and at the end, while the given number of readers take Snapshots and check
+ * that each one stays the same size and decrypts its own codes
+ *  parameters:
+ *      readers -- the number of reader threads
+ *  return value: none
+ */
+void stressSnapshot(unsigned readers){
+    SnapshotEncryptionTree<int> tree;
+    EncryptionTree<int> reference;
+    atomic<bool> stop(false);
+    vector<thread> threads;
+    for (unsigned r = 0; r < readers; r++){
+        threads.push_back(thread([&, r](){
+            mt19937 rng(r + 1);
+            while (!stop.load()){
+                SnapshotEncryptionTree<int>::Snapshot snapshot(tree);
+                size_t size = snapshot.size();
+                for (int i = 0; i < 20; i++){
+                    int key = rng() % KEYS_PER_THREAD;
+                    string code = snapshot.encrypt(key);
+                    if (snapshot.contains(key)){
+                        const int *found = snapshot.decrypt(code);
+                        check(found && *found == key, "snapshot code decrypts to its key");
+                    }
+                    check(snapshot.size() == size, "snapshot does not change");
+                }
+            }
+        }));
+    }
+    mt19937 rng(12345);
+    for (int i = 0; i < OPS_PER_THREAD; i++){
+        int key = rng() % KEYS_PER_THREAD;
+        if (rng() % 3){
+            tree.insert(key);
+            reference.insert(key);
+        }
+        else {
+            tree.remove(key);
+            reference.remove(key);
+        }
+        if (i % COMPARE_EVERY == 0){
+            compareCodes(tree, reference);
+        }
+    }
+    stop.store(true);
+    for (size_t t = 0; t < threads.size(); t++){
+        threads[t].join();
+    }
+    compareCodes(tree, reference);
+    tree.verifyBalance();
+    tree.verifySearchOrder();
+}
+
+/* main
+ * Runs both stress tests with 2, 4, 8, ... threads up to N and prints one
+ * line per thread count
+ *  parameters:
+ *      argc -- the number of arguments from the command line
+ *      argv -- argv[1], if given, is N; otherwise N is the number of cores
+ *              (at least 2)
+ *  return value: 0 if every check passed, 1 otherwise
+ */
+int main(int argc, char**argv) {
+    unsigned maxThreads = thread::hardware_concurrency();
+    if (argc > 1){
+        maxThreads = atoi(argv[1]);
+    }
+    if (maxThreads < 2){
+        maxThreads = 2;
+    }
+
+    for (unsigned threads = 2; threads <= maxThreads; threads *= 2){
+        stressConcurrent(threads);
+        stressSnapshot(threads);
+        cout << threads << " threads: " << (failures.load() == 0 ? "ok" : "FAILED") << endl;
+    }
+    return failures.load() == 0 ? 0 : 1;
+}